@@ -0,0 +1,165 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "led_fade.h"
+#include "led_handler.h"
+#include "led_output_mock.h"
+#include "sdkconfig.h"
+
+// Every result is printed as one JSON object per line, so runs can be diffed against a
+// stored baseline before a firmware change reaches the fleet.
+
+#define FRAME_PERIOD_US (1000 * 1000 / CONFIG_LED_FRAME_RATE_HZ)
+#define LATENCY_TIMEOUT_US (2 * 1000 * 1000)
+// Stands in for the motion sensor manager's event queue
+#define MOTION_QUEUE_LENGTH 8
+
+static const size_t led_counts[] = {30, 60, 150, 300, 600, 1000, 2000};
+
+static uint8_t frame_buffers[2][LED_FRAME_BYTES(CONFIG_MAX_LED_COUNT)];
+static int64_t latency_samples[CONFIG_BENCH_LATENCY_SAMPLES];
+
+static void bench_compose(size_t led_count) {
+    led_output_mock_t mock;
+    led_renderer_t renderer;
+
+    led_output_mock_init(&mock);
+    led_renderer_init(&renderer, &mock.output, led_count, frame_buffers[0], frame_buffers[1]);
+
+    // A low intensity sends every pixel through the dithered path
+    uint16_t intensity = LED_FADE_INTENSITY_MAX / 10;
+    int64_t start_us = esp_timer_get_time();
+    for (int i = 0; i < CONFIG_BENCH_FRAMES_PER_RUN; i++) {
+        light_led_strip_uniform(&renderer, intensity);
+        led_renderer_present(&renderer);
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+
+    uint32_t wire_us = led_output_mock_wire_us(led_count);
+    printf("{\"bench\":\"compose\",\"leds\":%u,\"frames\":%d,\"ns_per_frame\":%" PRId64
+           ",\"wire_us_per_frame\":%" PRIu32 ",\"fits_frame_period\":%s}\n",
+           (unsigned)led_count, CONFIG_BENCH_FRAMES_PER_RUN,
+           elapsed_us * 1000 / CONFIG_BENCH_FRAMES_PER_RUN, wire_us,
+           wire_us <= FRAME_PERIOD_US ? "true" : "false");
+}
+
+static void bench_sweep(size_t led_count) {
+    led_output_mock_t mock;
+    led_renderer_t renderer;
+
+    led_output_mock_init(&mock);
+    led_renderer_init(&renderer, &mock.output, led_count, frame_buffers[0], frame_buffers[1]);
+
+    int64_t sweep_us = (int64_t)(led_count / 2 + 1) * CONFIG_PAUSE_BETWEEN_LEDS_MS * 1000;
+    int frames = sweep_us / FRAME_PERIOD_US > 0 ? sweep_us / FRAME_PERIOD_US : 1;
+    int sweeps = CONFIG_BENCH_FRAMES_PER_RUN / frames > 0 ? CONFIG_BENCH_FRAMES_PER_RUN / frames : 1;
+
+    int64_t start_us = esp_timer_get_time();
+    for (int s = 0; s < sweeps; s++) {
+        for (int f = 1; f <= frames; f++) {
+            uint16_t progress = (uint16_t)((uint32_t)f * LED_SM_LEVEL_MAX / frames);
+            light_led_strip_from_center_out(&renderer, progress, LED_FADE_INTENSITY_MAX);
+            led_renderer_present(&renderer);
+        }
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+
+    printf("{\"bench\":\"sweep\",\"leds\":%u,\"frames_per_sweep\":%d,\"sweep_ms\":%" PRId64
+           ",\"cpu_us_per_sweep\":%" PRId64 "}\n",
+           (unsigned)led_count, frames, sweep_us / 1000, elapsed_us / sweeps);
+}
+
+static int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void wait_until_off(void) {
+    led_handler_stats_t stats;
+    do {
+        vTaskDelay(1);
+        led_handler_get_stats(&stats);
+    } while (stats.state != LED_STATE_OFF);
+    // The LED task outranks us, so its final dark frame has gone out by the time we run again
+    vTaskDelay(1);
+}
+
+static void bench_latency(void) {
+    static led_output_mock_t mock;
+    static StaticQueue_t motion_queue_buffer;
+    static uint8_t motion_queue_storage[MOTION_QUEUE_LENGTH * sizeof(motion_event_t)];
+    int count = 0;
+    int timeouts = 0;
+
+    // No shine time and no fade-out, so the strip is dark again right after each sweep
+    led_handler_config_t config = {
+        .channels = {{.output = &mock.output, .led_count = CONFIG_BENCH_LATENCY_LED_COUNT}},
+        .channel_count = 1,
+        .shine_ms = 0,
+        .fade_out_ms = 0,
+    };
+    led_output_mock_init(&mock);
+    led_handler_start(&config);
+
+    // Motion takes the firmware's path: the sensor's queue, read by the LED task from its set
+    QueueHandle_t motion_queue = xQueueCreateStatic(MOTION_QUEUE_LENGTH, sizeof(motion_event_t),
+                                                    motion_queue_storage, &motion_queue_buffer);
+    if (!led_handler_attach_motion_queue(motion_queue)) {
+        printf("{\"bench\":\"motion_to_first_pixel\",\"error\":\"attach_failed\"}\n");
+        return;
+    }
+
+    for (int i = 0; i < CONFIG_BENCH_LATENCY_SAMPLES; i++) {
+        wait_until_off();
+        led_output_mock_arm(&mock);
+
+        int64_t posted_us = esp_timer_get_time();
+        xQueueSend(motion_queue, &(motion_event_t){.motion_detected = 1}, 0);
+        while (atomic_load(&mock.first_frame_us) == 0 &&
+               esp_timer_get_time() - posted_us < LATENCY_TIMEOUT_US) {
+            vTaskDelay(1);
+        }
+
+        int64_t first_frame_us = atomic_load(&mock.first_frame_us);
+        if (first_frame_us == 0) {
+            timeouts++;
+            continue;
+        }
+        latency_samples[count++] = first_frame_us - posted_us;
+    }
+
+    if (count == 0) {
+        printf("{\"bench\":\"motion_to_first_pixel\",\"samples\":0,\"timeouts\":%d}\n", timeouts);
+        return;
+    }
+    qsort(latency_samples, count, sizeof(latency_samples[0]), compare_int64);
+    printf("{\"bench\":\"motion_to_first_pixel\",\"leds\":%d,\"samples\":%d,\"timeouts\":%d"
+           ",\"p50_us\":%" PRId64 ",\"p90_us\":%" PRId64 ",\"p99_us\":%" PRId64
+           ",\"max_us\":%" PRId64 "}\n",
+           CONFIG_BENCH_LATENCY_LED_COUNT, count, timeouts, latency_samples[count / 2],
+           latency_samples[count * 90 / 100], latency_samples[count * 99 / 100],
+           latency_samples[count - 1]);
+}
+
+void app_main(void) {
+    // Keep stdout to the JSON results
+    esp_log_level_set("*", ESP_LOG_WARN);
+
+    for (size_t i = 0; i < sizeof(led_counts) / sizeof(led_counts[0]); i++) {
+        if (led_counts[i] <= CONFIG_MAX_LED_COUNT) {
+            bench_compose(led_counts[i]);
+            bench_sweep(led_counts[i]);
+        }
+    }
+    bench_latency();
+
+    fflush(stdout);
+    exit(0);
+}
@@ -0,0 +1,36 @@
+#include "led_output_mock.h"
+
+#include "esp_timer.h"
+
+#define WS2812_NS_PER_BIT 1250
+#define WS2812_RESET_US 280
+
+static esp_err_t mock_transmit(void *ctx, const uint8_t *frame, size_t len) {
+    led_output_mock_t *mock = ctx;
+    long long expected = 0;
+
+    atomic_compare_exchange_strong(&mock->first_frame_us, &expected, esp_timer_get_time());
+    atomic_fetch_add(&mock->frames, 1);
+    atomic_fetch_add(&mock->bytes, len);
+    return ESP_OK;
+}
+
+static esp_err_t mock_wait_done(void *ctx, int timeout_ms) { return ESP_OK; }
+
+void led_output_mock_init(led_output_mock_t *mock) {
+    mock->output = (led_output_t){
+        .transmit = mock_transmit,
+        .wait_done = mock_wait_done,
+        .ctx = mock,
+    };
+    atomic_init(&mock->frames, 0);
+    atomic_init(&mock->bytes, 0);
+    atomic_init(&mock->first_frame_us, 0);
+}
+
+void led_output_mock_arm(led_output_mock_t *mock) { atomic_store(&mock->first_frame_us, 0); }
+
+uint32_t led_output_mock_wire_us(size_t led_count) {
+    uint64_t bits = (uint64_t)LED_FRAME_BYTES(led_count) * 8;
+    return (uint32_t)(bits * WS2812_NS_PER_BIT / 1000) + WS2812_RESET_US;
+}
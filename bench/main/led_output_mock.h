@@ -0,0 +1,23 @@
+#ifndef LED_OUTPUT_MOCK_H
+#define LED_OUTPUT_MOCK_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "led_renderer.h"
+
+// Output backend that only counts what would have been sent to the strip
+typedef struct {
+    led_output_t output;
+    atomic_uint frames;
+    atomic_ullong bytes;
+    atomic_llong first_frame_us;  // Time of the first frame after the last arm, 0 until then
+} led_output_mock_t;
+
+void led_output_mock_init(led_output_mock_t *mock);
+void led_output_mock_arm(led_output_mock_t *mock);
+
+// Time a WS2812 strip needs to clock in one frame of the given size, reset pulse included
+uint32_t led_output_mock_wire_us(size_t led_count);
+
+#endif  // LED_OUTPUT_MOCK_H
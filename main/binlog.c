@@ -0,0 +1,221 @@
+#include "binlog.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "BINLOG";
+
+#define BINLOG_SLOTS CONFIG_BINLOG_SLOTS
+#define BINLOG_LINE_SIZE 160
+// Rate windows are 1024 ms, counted in the low bits of binlog_tag_t.window
+#define BINLOG_WINDOW_SHIFT 10
+#define BINLOG_COUNT_BITS 12
+#define BINLOG_COUNT_MASK ((1u << BINLOG_COUNT_BITS) - 1)
+
+_Static_assert((BINLOG_SLOTS & (BINLOG_SLOTS - 1)) == 0, "BINLOG_SLOTS must be a power of two");
+_Static_assert(CONFIG_BINLOG_TAG_RATE <= BINLOG_COUNT_MASK, "Tag rate does not fit the window");
+
+typedef struct {
+    // Bounded MPMC queue after Dmitry Vyukov: a slot is free for the producer at position p
+    // when its sequence equals p, and holds a record for the consumer when it equals p + 1.
+    // Stored relative to the slot index, so the zeroed ring is ready before init_binlog().
+    atomic_uint sequence;
+    uint8_t level;
+    uint32_t timestamp_ms;
+    const binlog_tag_t *tag;
+    const char *fmt;
+    uintptr_t args[BINLOG_MAX_ARGS];
+} binlog_slot_t;
+
+static binlog_slot_t slots[BINLOG_SLOTS];
+static atomic_uint enqueue_pos;
+static unsigned int dequeue_pos;  // Owned by the binlog task
+
+static TaskHandle_t binlog_task_handle;
+static StaticTask_t binlog_task_buffer;
+static StackType_t binlog_task_stack[CONFIG_BINLOG_TASK_STACK_SIZE];
+// Set by the binlog task just before it blocks. Only the record that clears it makes a kernel
+// call, so a burst costs one wakeup and a quiet ring none.
+static atomic_bool consumer_idle;
+
+static atomic_uint written;
+static atomic_uint dropped_full;
+static atomic_uint dropped_rate;
+
+static unsigned int slot_sequence(unsigned int index) {
+    return atomic_load_explicit(&slots[index].sequence, memory_order_acquire) + index;
+}
+
+static void set_slot_sequence(unsigned int index, unsigned int sequence) {
+    atomic_store_explicit(&slots[index].sequence, sequence - index, memory_order_release);
+}
+
+// At most CONFIG_BINLOG_TAG_RATE records per tag and window
+static bool tag_admit(binlog_tag_t *tag, uint32_t now_ms) {
+    unsigned int start = (now_ms >> BINLOG_WINDOW_SHIFT) << BINLOG_COUNT_BITS;
+    unsigned int window = atomic_load_explicit(&tag->window, memory_order_relaxed);
+    unsigned int next;
+
+    do {
+        if ((window & ~BINLOG_COUNT_MASK) != start) {
+            next = start | 1;
+        } else if ((window & BINLOG_COUNT_MASK) >= CONFIG_BINLOG_TAG_RATE) {
+            return false;
+        } else {
+            next = window + 1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&tag->window, &window, next,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
+
+void binlog_write(esp_log_level_t level, binlog_tag_t *tag, const char *fmt, uintptr_t a0,
+                  uintptr_t a1, uintptr_t a2, uintptr_t a3) {
+    uint32_t now_ms = esp_log_timestamp();
+    unsigned int index;
+
+    if (!tag_admit(tag, now_ms)) {
+        atomic_fetch_add_explicit(&tag->rate_dropped, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&dropped_rate, 1, memory_order_relaxed);
+        return;
+    }
+
+    unsigned int pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    while (1) {
+        index = pos & (BINLOG_SLOTS - 1);
+        int diff = (int)(slot_sequence(index) - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&dropped_full, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    binlog_slot_t *slot = &slots[index];
+    slot->level = level;
+    slot->timestamp_ms = now_ms;
+    slot->tag = tag;
+    slot->fmt = fmt;
+    slot->args[0] = a0;
+    slot->args[1] = a1;
+    slot->args[2] = a2;
+    slot->args[3] = a3;
+    set_slot_sequence(index, pos + 1);
+    atomic_fetch_add_explicit(&written, 1, memory_order_relaxed);
+
+    // Pairs with the fence in binlog_task, so either it sees this record or we see it idle
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&consumer_idle, false)) {
+        xTaskNotifyGive(binlog_task_handle);
+    }
+}
+
+static char level_letter(uint8_t level) {
+    switch (level) {
+    case ESP_LOG_ERROR:
+        return 'E';
+    case ESP_LOG_WARN:
+        return 'W';
+    default:
+        return 'I';
+    }
+}
+
+static void emit(const binlog_slot_t *slot) {
+    const uintptr_t *a = slot->args;
+
+#if CONFIG_BINLOG_HOST_FORMAT
+    // Addresses point into the firmware image; scripts/binlog_decode.py resolves them
+    printf("BL %c %08" PRIx32 " %08" PRIxPTR " %08" PRIxPTR " %08" PRIxPTR " %08" PRIxPTR
+           " %08" PRIxPTR " %08" PRIxPTR "\n",
+           level_letter(slot->level), slot->timestamp_ms, (uintptr_t)slot->tag->name,
+           (uintptr_t)slot->fmt, a[0], a[1], a[2], a[3]);
+#else
+    static char line[BINLOG_LINE_SIZE];
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+    // Unused arguments are passed along too, which printf ignores
+    snprintf(line, sizeof(line), slot->fmt, a[0], a[1], a[2], a[3]);
+#pragma GCC diagnostic pop
+    esp_log_write(slot->level, slot->tag->name, "%c (%" PRIu32 ") %s: %s\n",
+                  level_letter(slot->level), slot->timestamp_ms, slot->tag->name, line);
+#endif
+}
+
+static bool record_ready(void) {
+    unsigned int index = dequeue_pos & (BINLOG_SLOTS - 1);
+    return (int)(slot_sequence(index) - (dequeue_pos + 1)) >= 0;
+}
+
+static bool drain_one(void) {
+    unsigned int index = dequeue_pos & (BINLOG_SLOTS - 1);
+
+    if (!record_ready()) {
+        return false;
+    }
+    emit(&slots[index]);
+    set_slot_sequence(index, dequeue_pos + BINLOG_SLOTS);
+    dequeue_pos++;
+    return true;
+}
+
+// Sleeps until the first record after the ring ran empty, then lets the rest of the burst
+// collect for CONFIG_BINLOG_FLUSH_MS before formatting it all
+static void binlog_task(void *pvParameter) {
+    uint32_t reported_drops = 0;
+
+    while (1) {
+        while (drain_one()) {
+        }
+
+        uint32_t drops = atomic_load(&dropped_full) + atomic_load(&dropped_rate);
+        if (drops != reported_drops) {
+            ESP_LOGW(TAG, "%" PRIu32 " log records dropped", drops - reported_drops);
+            reported_drops = drops;
+        }
+
+        atomic_store(&consumer_idle, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        // A record that came in since the drain may have found the task still busy
+        if (record_ready() && atomic_exchange(&consumer_idle, false)) {
+            continue;
+        }
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_BINLOG_FLUSH_MS));
+    }
+}
+
+void binlog_get_stats(binlog_stats_t *stats) {
+    stats->written = atomic_load(&written);
+    stats->dropped_full = atomic_load(&dropped_full);
+    stats->dropped_rate = atomic_load(&dropped_rate);
+}
+
+void binlog_write_telemetry(telemetry_writer_t *writer) {
+    binlog_stats_t stats;
+    binlog_get_stats(&stats);
+
+    telemetry_write_uint(writer, "written", stats.written);
+    telemetry_write_uint(writer, "dropped_full", stats.dropped_full);
+    telemetry_write_uint(writer, "dropped_rate", stats.dropped_rate);
+}
+
+void init_binlog(void) {
+    binlog_task_handle = xTaskCreateStatic(&binlog_task, "binlog_task",
+                                           CONFIG_BINLOG_TASK_STACK_SIZE, NULL, 1,
+                                           binlog_task_stack, &binlog_task_buffer);
+}
@@ -0,0 +1,54 @@
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "esp_log.h"
+#include "telemetry_writer.h"
+
+// Deferred-format logging for hot paths. A call stores the format string's address, the tag
+// and up to BINLOG_MAX_ARGS raw arguments in a lock-free multi-producer ring; the binlog task
+// formats them later, or dumps them as hex for scripts/binlog_decode.py to format on the host.
+//
+// Arguments are stored as machine words: integers of up to 32 bits, and %s strings only if
+// they outlive the call (literals, names from lookup tables). No 64-bit or floating point
+// arguments. A full ring, or a tag over CONFIG_BINLOG_TAG_RATE records per second, drops the
+// record and counts it.
+//
+// Call from tasks only: the first record after the ring ran empty wakes the binlog task.
+
+#define BINLOG_MAX_ARGS 4
+
+typedef struct {
+    const char *name;
+    atomic_uint window;  // Second the current window started, and records in it
+    atomic_uint rate_dropped;
+} binlog_tag_t;
+
+#define BINLOG_TAG(var, tag_name) static binlog_tag_t var = {.name = (tag_name)}
+
+typedef struct {
+    uint32_t written;
+    uint32_t dropped_full;
+    uint32_t dropped_rate;
+} binlog_stats_t;
+
+void binlog_write(esp_log_level_t level, binlog_tag_t *tag, const char *fmt, uintptr_t a0,
+                  uintptr_t a1, uintptr_t a2, uintptr_t a3);
+
+#define BINLOG_ARGS_(unused, a0, a1, a2, a3, ...) \
+    (uintptr_t)(a0), (uintptr_t)(a1), (uintptr_t)(a2), (uintptr_t)(a3)
+#define BINLOG_ARGS(...) BINLOG_ARGS_(0, ##__VA_ARGS__, 0, 0, 0, 0, 0)
+
+#define BINLOG_E(tag, fmt, ...) binlog_write(ESP_LOG_ERROR, &(tag), fmt, BINLOG_ARGS(__VA_ARGS__))
+#define BINLOG_W(tag, fmt, ...) binlog_write(ESP_LOG_WARN, &(tag), fmt, BINLOG_ARGS(__VA_ARGS__))
+#define BINLOG_I(tag, fmt, ...) binlog_write(ESP_LOG_INFO, &(tag), fmt, BINLOG_ARGS(__VA_ARGS__))
+
+// Starts the task that drains the ring; records written before are kept until then
+void init_binlog(void);
+
+void binlog_get_stats(binlog_stats_t *stats);
+void binlog_write_telemetry(telemetry_writer_t *writer);
+
+#endif  // BINLOG_H
@@ -0,0 +1,69 @@
+#include "boot_sequencer.h"
+
+#include <inttypes.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+
+static const char *TAG = "BOOT";
+
+#define BOOT_STAGE_PRIORITY 5
+
+typedef struct {
+    const boot_stage_t *stage;
+    int index;
+    int64_t start_us;  // When its dependencies were met
+    int64_t done_us;
+} boot_stage_state_t;
+
+static boot_stage_state_t stage_states[BOOT_SEQUENCER_MAX_STAGES];
+static size_t stage_count;
+static EventGroupHandle_t stages_done;
+static StaticEventGroup_t stages_done_buffer;
+
+static void boot_stage_task(void *pvParameter) {
+    boot_stage_state_t *state = (boot_stage_state_t *)pvParameter;
+    const boot_stage_t *stage = state->stage;
+
+    if (stage->depends_on != 0) {
+        xEventGroupWaitBits(stages_done, stage->depends_on, pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+
+    state->start_us = esp_timer_get_time();
+    stage->run();
+    state->done_us = esp_timer_get_time();
+
+    ESP_LOGI(TAG, "Stage %s done at %" PRId64 " ms, took %" PRId64 " ms", stage->name,
+             state->done_us / 1000, (state->done_us - state->start_us) / 1000);
+    xEventGroupSetBits(stages_done, BOOT_STAGE_BIT(state->index));
+    vTaskDelete(NULL);
+}
+
+void boot_sequencer_start(const boot_stage_t *stages, size_t count) {
+    assert(count <= BOOT_SEQUENCER_MAX_STAGES);
+
+    stages_done = xEventGroupCreateStatic(&stages_done_buffer);
+    stage_count = count;
+
+    for (size_t i = 0; i < count; i++) {
+        stage_states[i] = (boot_stage_state_t){.stage = &stages[i], .index = i};
+        if (xTaskCreate(&boot_stage_task, stages[i].name, stages[i].stack_size, &stage_states[i],
+                        BOOT_STAGE_PRIORITY, NULL) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to start boot stage %s", stages[i].name);
+        }
+    }
+}
+
+void boot_sequencer_write_telemetry(telemetry_writer_t *writer) {
+    for (size_t i = 0; i < stage_count; i++) {
+        const boot_stage_state_t *state = &stage_states[i];
+
+        telemetry_begin_object(writer, state->stage->name);
+        telemetry_write_uint(writer, "start_ms", state->start_us / 1000);
+        telemetry_write_uint(writer, "done_ms", state->done_us / 1000);
+        telemetry_end_object(writer);
+    }
+}
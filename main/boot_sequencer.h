@@ -0,0 +1,29 @@
+#ifndef BOOT_SEQUENCER_H
+#define BOOT_SEQUENCER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "telemetry_writer.h"
+
+// Runs the boot stages as separate tasks, each one starting as soon as the stages it depends
+// on are done. Stages with no network dependency (lighting) are up while WiFi, SNTP and MQTT
+// are still being set up, or if they never come up at all.
+
+#define BOOT_SEQUENCER_MAX_STAGES 12
+#define BOOT_STAGE_BIT(index) (1u << (index))
+
+typedef struct {
+    const char *name;
+    void (*run)(void);
+    uint32_t depends_on;  // BOOT_STAGE_BIT() of each stage that must finish first
+    uint32_t stack_size;
+} boot_stage_t;
+
+// `stages` must stay valid until boot is over; stage indexes are positions in it
+void boot_sequencer_start(const boot_stage_t *stages, size_t count);
+
+// Start and end of each stage in milliseconds since boot; 0 for a stage not yet done
+void boot_sequencer_write_telemetry(telemetry_writer_t *writer);
+
+#endif  // BOOT_SEQUENCER_H
@@ -0,0 +1,202 @@
+#include "connection_supervisor.h"
+
+#include <inttypes.h>
+
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mqtt_outbox.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "CONNECTION";
+
+#define OFFLINE_HEARTBEAT_SIZE 160
+#define BACKOFF_MAX_SHIFT 16
+
+static const char *supervisor_device_name;
+static esp_mqtt_client_handle_t supervisor_client;
+static esp_timer_handle_t reconnect_timer;
+static esp_timer_handle_t offline_heartbeat_timer;
+
+// Updated from the MQTT task and read from the esp_timer task and telemetry
+static SemaphoreHandle_t state_mutex;
+static StaticSemaphore_t state_mutex_buffer;
+static bool link_up;
+static uint32_t backoff_step;  // Failed attempts since the link was last up
+static uint32_t reconnect_attempts;
+static uint32_t outages;
+static int64_t outage_start_us;  // 0 while connected
+static int64_t last_outage_us;
+static int64_t total_outage_us;
+
+static uint8_t offline_heartbeat[OFFLINE_HEARTBEAT_SIZE];
+
+// Equal jitter: somewhere between half and all of the exponential delay, so a fleet that
+// lost the broker together does not come back in lockstep
+static uint64_t backoff_us(uint32_t step) {
+    uint32_t shift = step < BACKOFF_MAX_SHIFT ? step : BACKOFF_MAX_SHIFT;
+    uint64_t max_us = (uint64_t)CONFIG_MQTT_RECONNECT_MAX_S * 1000 * 1000;
+    uint64_t delay_us = ((uint64_t)CONFIG_MQTT_RECONNECT_MIN_MS * 1000) << shift;
+
+    if (delay_us > max_us) {
+        delay_us = max_us;
+    }
+    return delay_us / 2 + esp_random() % (delay_us / 2 + 1);
+}
+
+static void schedule_reconnect(void) {
+    uint32_t step;
+
+    if (reconnect_timer == NULL || esp_timer_is_active(reconnect_timer)) {
+        return;
+    }
+    xSemaphoreTake(state_mutex, portMAX_DELAY);
+    step = backoff_step;
+    xSemaphoreGive(state_mutex);
+
+    uint64_t delay_us = backoff_us(step);
+    ESP_LOGI(TAG, "Reconnecting to the broker in %" PRIu64 " ms", delay_us / 1000);
+    esp_timer_start_once(reconnect_timer, delay_us);
+}
+
+// Restarting the client from here, not from the MQTT task, is what the client API allows
+static void reconnect_timer_callback(void *arg) {
+    xSemaphoreTake(state_mutex, portMAX_DELAY);
+    backoff_step++;
+    reconnect_attempts++;
+    xSemaphoreGive(state_mutex);
+
+    esp_mqtt_client_stop(supervisor_client);
+    esp_err_t ret = esp_mqtt_client_start(supervisor_client);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to restart the MQTT client: %s", esp_err_to_name(ret));
+        schedule_reconnect();
+    }
+}
+
+static void offline_heartbeat_timer_callback(void *arg) {
+    telemetry_writer_t writer;
+    int64_t now_us = esp_timer_get_time();
+    int64_t offline_us;
+
+    xSemaphoreTake(state_mutex, portMAX_DELAY);
+    offline_us = outage_start_us != 0 ? now_us - outage_start_us : 0;
+    xSemaphoreGive(state_mutex);
+
+    telemetry_writer_init(&writer, offline_heartbeat, sizeof(offline_heartbeat));
+    telemetry_write_string(&writer, "device", supervisor_device_name);
+    telemetry_write_uint(&writer, "uptime_s", now_us / (1000 * 1000));
+    telemetry_write_bool(&writer, "offline", true);
+    telemetry_write_uint(&writer, "offline_s", offline_us / (1000 * 1000));
+    size_t len = telemetry_writer_finish(&writer);
+    if (len > 0) {
+        mqtt_outbox_publish(CONFIG_MQTT_PUBLISH_HEARTBEAT_TOPIC, offline_heartbeat, len,
+                            TELEMETRY_FORMAT_JSON);
+    }
+}
+
+static void start_offline_heartbeat(void) {
+    esp_timer_start_periodic(offline_heartbeat_timer,
+                             (uint64_t)CONFIG_MQTT_HEARTBEAT_INTERVAL_MINUTES * 60 * 1000 * 1000);
+}
+
+void connection_supervisor_connected(esp_mqtt_event_handle_t event) {
+    int64_t outage_us = 0;
+
+    supervisor_client = event->client;
+    xSemaphoreTake(state_mutex, portMAX_DELAY);
+    if (outage_start_us != 0) {
+        outage_us = esp_timer_get_time() - outage_start_us;
+        last_outage_us = outage_us;
+        total_outage_us += outage_us;
+        outage_start_us = 0;
+    }
+    link_up = true;
+    backoff_step = 0;
+    xSemaphoreGive(state_mutex);
+
+    ESP_LOGI(TAG, "Connected after %" PRId64 " ms offline", outage_us / 1000);
+    esp_timer_stop(reconnect_timer);
+    esp_timer_stop(offline_heartbeat_timer);
+
+    // Held-back messages go out from the outbox's task, not from inside the event handler
+    mqtt_outbox_set_connected(event->client);
+}
+
+void connection_supervisor_disconnected(esp_mqtt_event_handle_t event) {
+    bool was_up;
+
+    supervisor_client = event->client;
+    xSemaphoreTake(state_mutex, portMAX_DELAY);
+    was_up = link_up;
+    if (was_up) {
+        link_up = false;
+        outages++;
+        outage_start_us = esp_timer_get_time();
+    }
+    xSemaphoreGive(state_mutex);
+
+    if (was_up) {
+        ESP_LOGW(TAG, "Lost the broker; the lights carry on offline");
+        mqtt_outbox_set_connected(NULL);
+        start_offline_heartbeat();
+    }
+    schedule_reconnect();
+}
+
+void connection_supervisor_error(esp_mqtt_event_handle_t event) {
+    supervisor_client = event->client;
+    if (event->error_handle->error_type == MQTT_ERROR_TYPE_ESP_TLS) {
+        ESP_LOGI(TAG, "Last ESP error code: 0x%x", event->error_handle->esp_tls_last_esp_err);
+        ESP_LOGI(TAG, "Last TLS stack error code: 0x%x", event->error_handle->esp_tls_stack_err);
+        ESP_LOGI(TAG, "Last TLS library error code: 0x%x",
+                 event->error_handle->esp_tls_cert_verify_flags);
+    } else if (event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
+        ESP_LOGI(TAG, "Connection refused error: 0x%x", event->error_handle->connect_return_code);
+    } else {
+        ESP_LOGI(TAG, "Unknown error type: 0x%x", event->error_handle->error_type);
+    }
+    schedule_reconnect();
+}
+
+void connection_supervisor_write_telemetry(telemetry_writer_t *writer) {
+    int64_t now_us = esp_timer_get_time();
+
+    xSemaphoreTake(state_mutex, portMAX_DELAY);
+    telemetry_write_bool(writer, "connected", link_up);
+    telemetry_write_uint(writer, "outages", outages);
+    telemetry_write_uint(writer, "reconnect_attempts", reconnect_attempts);
+    telemetry_write_uint(writer, "current_outage_s",
+                         outage_start_us != 0 ? (now_us - outage_start_us) / (1000 * 1000) : 0);
+    telemetry_write_uint(writer, "last_outage_s", last_outage_us / (1000 * 1000));
+    telemetry_write_uint(writer, "total_outage_s", total_outage_us / (1000 * 1000));
+    xSemaphoreGive(state_mutex);
+
+    telemetry_begin_object(writer, "outbox");
+    mqtt_outbox_write_telemetry(writer);
+    telemetry_end_object(writer);
+}
+
+void init_connection_supervisor(const char *device_name) {
+    supervisor_device_name = device_name;
+    state_mutex = xSemaphoreCreateMutexStatic(&state_mutex_buffer);
+    // Not connected yet; the first connection closes this outage without counting it
+    outage_start_us = esp_timer_get_time();
+
+    init_mqtt_outbox();
+
+    const esp_timer_create_args_t reconnect_timer_args = {
+        .callback = reconnect_timer_callback,
+        .name = "mqtt_reconnect",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&reconnect_timer_args, &reconnect_timer));
+
+    const esp_timer_create_args_t offline_heartbeat_timer_args = {
+        .callback = offline_heartbeat_timer_callback,
+        .name = "offline_heartbeat",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&offline_heartbeat_timer_args, &offline_heartbeat_timer));
+    start_offline_heartbeat();
+}
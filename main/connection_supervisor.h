@@ -0,0 +1,22 @@
+#ifndef CONNECTION_SUPERVISOR_H
+#define CONNECTION_SUPERVISOR_H
+
+#include "mqtt_client.h"
+#include "telemetry_writer.h"
+
+// Keeps the device running through broker and WiFi outages. MQTT errors restart the client
+// after a jittered exponential backoff instead of rebooting, so the lights never notice.
+// While offline, a heartbeat record is kept in the outbox every heartbeat interval, and
+// everything held back is flushed once the client reconnects.
+
+// Call before starting the MQTT client
+void init_connection_supervisor(const char *device_name);
+
+// Called from the MQTT event handlers
+void connection_supervisor_connected(esp_mqtt_event_handle_t event);
+void connection_supervisor_disconnected(esp_mqtt_event_handle_t event);
+void connection_supervisor_error(esp_mqtt_event_handle_t event);
+
+void connection_supervisor_write_telemetry(telemetry_writer_t *writer);
+
+#endif  // CONNECTION_SUPERVISOR_H
@@ -0,0 +1,256 @@
+#include "device_shadow.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "json_stream.h"
+#include "led_handler.h"
+#include "mqtt_dispatch.h"
+#include "sdkconfig.h"
+#include "telemetry_writer.h"
+
+static const char *TAG = "DEVICE_SHADOW";
+
+#define SHADOW_TOPIC_SIZE 128
+#define SHADOW_REPORT_SIZE 256
+#define SHADOW_MAX_SHINE_MINUTES (24 * 60)
+
+#define SHADOW_FIELD_POWER (1u << 0)
+#define SHADOW_FIELD_BRIGHTNESS (1u << 1)
+#define SHADOW_FIELD_SHINE (1u << 2)
+#define SHADOW_FIELD_ANIMATION (1u << 3)
+
+// Desired fields found in one shadow message
+typedef struct {
+    const char *parent;  // Path of the object holding them
+    led_handler_settings_t settings;
+    uint32_t fields;
+} shadow_update_t;
+
+static char delta_topic[SHADOW_TOPIC_SIZE];
+static char get_accepted_topic[SHADOW_TOPIC_SIZE];
+static char get_topic[SHADOW_TOPIC_SIZE];
+static char update_topic[SHADOW_TOPIC_SIZE];
+
+static esp_mqtt_client_handle_t shadow_client;
+static esp_timer_handle_t apply_timer;
+static esp_timer_handle_t report_timer;
+
+// Desired state merged from shadow messages until the apply timer fires. Messages arrive on
+// the MQTT task and the timers run on the esp_timer task.
+static SemaphoreHandle_t desired_mutex;
+static StaticSemaphore_t desired_mutex_buffer;
+static led_handler_settings_t desired;
+static bool desired_pending;
+
+// Message being parsed; only touched from the MQTT task
+static json_stream_t update_stream;
+static shadow_update_t update;
+
+// Only touched from the esp_timer task
+static int64_t last_report_us;
+static uint8_t report_buffer[SHADOW_REPORT_SIZE];
+
+static void publish_report(void) {
+    led_handler_settings_t settings;
+    telemetry_writer_t writer;
+
+    led_handler_get_settings(&settings);
+
+    telemetry_writer_init(&writer, report_buffer, sizeof(report_buffer));
+    telemetry_begin_object(&writer, "state");
+    telemetry_begin_object(&writer, "reported");
+    telemetry_write_string(&writer, "power", led_power_mode_name(settings.power));
+    telemetry_write_uint(&writer, "brightness", settings.brightness_percent);
+    telemetry_write_uint(&writer, "shine_minutes", settings.shine_ms / (60 * 1000));
+    telemetry_write_string(&writer, "animation", led_animation_name(settings.animation));
+    telemetry_end_object(&writer);
+    telemetry_end_object(&writer);
+
+    size_t len = telemetry_writer_finish(&writer);
+    if (len == 0) {
+        ESP_LOGE(TAG, "Reported state does not fit in %d bytes", SHADOW_REPORT_SIZE);
+        return;
+    }
+    if (esp_mqtt_client_enqueue(shadow_client, update_topic, (const char *)report_buffer, len, 0,
+                                0, true) < 0) {
+        ESP_LOGW(TAG, "Failed to queue reported state");
+        return;
+    }
+    last_report_us = esp_timer_get_time();
+}
+
+// Publishes now if the last report is old enough, otherwise once the interval has passed.
+// Any number of requests in between end up in that one report.
+static void request_report(void) {
+    int64_t interval_us = (int64_t)CONFIG_SHADOW_REPORT_INTERVAL_S * 1000 * 1000;
+    int64_t wait_us = last_report_us + interval_us - esp_timer_get_time();
+
+    if (last_report_us == 0 || wait_us <= 0) {
+        publish_report();
+    } else if (!esp_timer_is_active(report_timer)) {
+        esp_timer_start_once(report_timer, wait_us);
+    }
+}
+
+static void report_timer_callback(void *arg) { publish_report(); }
+
+static void apply_timer_callback(void *arg) {
+    led_handler_settings_t settings;
+    bool pending;
+
+    xSemaphoreTake(desired_mutex, portMAX_DELAY);
+    settings = desired;
+    pending = desired_pending;
+    desired_pending = false;
+    xSemaphoreGive(desired_mutex);
+
+    if (pending) {
+        led_handler_apply_settings(&settings);
+    }
+    request_report();
+}
+
+// Picks the recognized fields out of the desired state. Invalid values are skipped so one
+// bad field does not throw away the rest of the update.
+static void on_shadow_value(json_stream_t *stream, json_value_type_t type, const char *text,
+                            void *ctx) {
+    shadow_update_t *update = ctx;
+    const char *key = json_stream_key(stream);
+    int32_t number;
+
+    if (!json_stream_parent_is(stream, update->parent)) {
+        return;
+    }
+
+    if (strcmp(key, "power") == 0 && type == JSON_VALUE_STRING) {
+        if (strcmp(text, "auto") == 0) {
+            update->settings.power = LED_POWER_AUTO;
+        } else if (strcmp(text, "on") == 0) {
+            update->settings.power = LED_POWER_ON;
+        } else if (strcmp(text, "off") == 0) {
+            update->settings.power = LED_POWER_OFF;
+        } else {
+            ESP_LOGW(TAG, "Ignoring power \"%s\"", text);
+            return;
+        }
+        update->fields |= SHADOW_FIELD_POWER;
+    } else if (strcmp(key, "brightness") == 0 && type == JSON_VALUE_NUMBER) {
+        if (!json_stream_parse_int(text, &number) || number < 1 || number > 100) {
+            ESP_LOGW(TAG, "Ignoring brightness %s", text);
+            return;
+        }
+        update->settings.brightness_percent = (uint8_t)number;
+        update->fields |= SHADOW_FIELD_BRIGHTNESS;
+    } else if (strcmp(key, "shine_minutes") == 0 && type == JSON_VALUE_NUMBER) {
+        if (!json_stream_parse_int(text, &number) || number < 1 ||
+            number > SHADOW_MAX_SHINE_MINUTES) {
+            ESP_LOGW(TAG, "Ignoring shine_minutes %s", text);
+            return;
+        }
+        update->settings.shine_ms = (uint32_t)number * 60 * 1000;
+        update->fields |= SHADOW_FIELD_SHINE;
+    } else if (strcmp(key, "animation") == 0 && type == JSON_VALUE_STRING) {
+        if (strcmp(text, "sweep") == 0) {
+            update->settings.animation = LED_ANIMATION_SWEEP;
+        } else if (strcmp(text, "fade") == 0) {
+            update->settings.animation = LED_ANIMATION_FADE;
+        } else {
+            ESP_LOGW(TAG, "Ignoring animation \"%s\"", text);
+            return;
+        }
+        update->fields |= SHADOW_FIELD_ANIMATION;
+    }
+}
+
+static void handle_desired(const shadow_update_t *update) {
+    xSemaphoreTake(desired_mutex, portMAX_DELAY);
+    if (!desired_pending) {
+        led_handler_get_settings(&desired);
+    }
+    if (update->fields & SHADOW_FIELD_POWER) {
+        desired.power = update->settings.power;
+    }
+    if (update->fields & SHADOW_FIELD_BRIGHTNESS) {
+        desired.brightness_percent = update->settings.brightness_percent;
+    }
+    if (update->fields & SHADOW_FIELD_SHINE) {
+        desired.shine_ms = update->settings.shine_ms;
+    }
+    if (update->fields & SHADOW_FIELD_ANIMATION) {
+        desired.animation = update->settings.animation;
+    }
+    desired_pending |= update->fields != 0;
+    xSemaphoreGive(desired_mutex);
+
+    // The window opens with the first message of a burst and is not extended by the rest,
+    // so a steady stream of updates still gets applied
+    if (!esp_timer_is_active(apply_timer)) {
+        esp_timer_start_once(apply_timer, (uint64_t)CONFIG_SHADOW_COALESCE_MS * 1000);
+    }
+}
+
+// A delta carries the changed desired fields under "state"; the full document from a get
+// carries them under "state.desired", which may be missing on a new shadow. Either way the
+// message is parsed as it arrives, however many fragments it comes in.
+static void handle_shadow_chunk(const mqtt_chunk_t *chunk, void *ctx) {
+    if (mqtt_chunk_is_first(chunk)) {
+        memset(&update, 0, sizeof(update));
+        update.parent = ctx;
+        json_stream_init(&update_stream, on_shadow_value, &update);
+    }
+    json_stream_feed(&update_stream, chunk->data, chunk->len);
+    if (!mqtt_chunk_is_last(chunk)) {
+        return;
+    }
+    if (!json_stream_finish(&update_stream)) {
+        ESP_LOGW(TAG, "Malformed shadow document");
+        return;
+    }
+    handle_desired(&update);
+}
+
+void device_shadow_connected(esp_mqtt_client_handle_t client) {
+    // The client may connect before the shadow is set up; init asks in that case
+    if (shadow_client == NULL) {
+        return;
+    }
+    // Desired state may have changed while we were offline
+    esp_mqtt_client_enqueue(client, get_topic, "", 0, 1, 0, true);
+}
+
+void init_device_shadow(const char *thing_name, esp_mqtt_client_handle_t client) {
+    const char *prefix = CONFIG_SHADOW_TOPIC_PREFIX;
+
+    snprintf(delta_topic, sizeof(delta_topic), "%s/%s/shadow/update/delta", prefix, thing_name);
+    snprintf(get_accepted_topic, sizeof(get_accepted_topic), "%s/%s/shadow/get/accepted", prefix,
+             thing_name);
+    snprintf(get_topic, sizeof(get_topic), "%s/%s/shadow/get", prefix, thing_name);
+    snprintf(update_topic, sizeof(update_topic), "%s/%s/shadow/update", prefix, thing_name);
+
+    desired_mutex = xSemaphoreCreateMutexStatic(&desired_mutex_buffer);
+
+    const esp_timer_create_args_t apply_timer_args = {
+        .callback = apply_timer_callback,
+        .name = "shadow_apply",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&apply_timer_args, &apply_timer));
+
+    const esp_timer_create_args_t report_timer_args = {
+        .callback = report_timer_callback,
+        .name = "shadow_report",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&report_timer_args, &report_timer));
+
+    mqtt_dispatch_register(delta_topic, 1, handle_shadow_chunk, "state");
+    mqtt_dispatch_register(get_accepted_topic, 1, handle_shadow_chunk, "state.desired");
+
+    shadow_client = client;
+    ESP_LOGI(TAG, "Device shadow for %s, reporting at most every %d seconds", thing_name,
+             CONFIG_SHADOW_REPORT_INTERVAL_S);
+    device_shadow_connected(client);
+}
@@ -0,0 +1,20 @@
+#ifndef DEVICE_SHADOW_H
+#define DEVICE_SHADOW_H
+
+#include "mqtt_client.h"
+
+// Runtime control of the lights through the AWS IoT device shadow. Desired state from the
+// delta topic is merged over a short window before it reaches the LED handler, and the
+// reported state is published at most once per CONFIG_SHADOW_REPORT_INTERVAL_S.
+//
+// Shadow document, under "desired" and "reported":
+//   {"power": "auto" | "on" | "off", "brightness": 1-100, "shine_minutes": 1-1440,
+//    "animation": "sweep" | "fade"}
+
+// Call once the LED handler is running
+void init_device_shadow(const char *thing_name, esp_mqtt_client_handle_t client);
+// Asks for the current shadow document; call on every connect. The shadow topics are
+// routed and subscribed through mqtt_dispatch.
+void device_shadow_connected(esp_mqtt_client_handle_t client);
+
+#endif  // DEVICE_SHADOW_H
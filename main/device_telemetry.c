@@ -0,0 +1,91 @@
+#include "device_telemetry.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mqtt_outbox.h"
+
+static const char *TAG = "DEVICE_TELEMETRY";
+
+#define DEVICE_TELEMETRY_MAX_SECTIONS 12
+#define DEVICE_TELEMETRY_BUFFER_SIZE 3072
+
+// MQTT_OUTBOX_BATCH_SIZE's lower bound is this size plus the batch framing
+_Static_assert(DEVICE_TELEMETRY_BUFFER_SIZE <= MQTT_OUTBOX_MAX_MESSAGE,
+               "A full telemetry record must fit in an outbox batch");
+
+typedef struct {
+    const char *name;
+    device_telemetry_section_fn fn;
+} telemetry_section_t;
+
+static telemetry_section_t sections[DEVICE_TELEMETRY_MAX_SECTIONS];
+static int section_count;
+
+static const char *telemetry_device_name;
+static const char *telemetry_topic;
+static esp_mqtt_client_handle_t telemetry_client;
+static esp_timer_handle_t telemetry_timer;
+
+// Publishing can come from the timer or from a request, and both share the buffer
+static SemaphoreHandle_t buffer_mutex;
+static StaticSemaphore_t buffer_mutex_buffer;
+static uint8_t buffer[DEVICE_TELEMETRY_BUFFER_SIZE];
+
+void device_telemetry_register_section(const char *name, device_telemetry_section_fn fn) {
+    if (section_count >= DEVICE_TELEMETRY_MAX_SECTIONS) {
+        ESP_LOGE(TAG, "No room for telemetry section %s", name);
+        return;
+    }
+    sections[section_count++] = (telemetry_section_t){.name = name, .fn = fn};
+}
+
+void device_telemetry_publish_now(void) {
+    telemetry_writer_t writer;
+
+    if (telemetry_client == NULL) {
+        return;
+    }
+    xSemaphoreTake(buffer_mutex, portMAX_DELAY);
+
+    telemetry_writer_init_format(&writer, TELEMETRY_FORMAT_DEFAULT, buffer, sizeof(buffer));
+    telemetry_write_string(&writer, "device", telemetry_device_name);
+    telemetry_write_uint(&writer, "uptime_s", esp_timer_get_time() / (1000 * 1000));
+    for (int i = 0; i < section_count; i++) {
+        telemetry_begin_object(&writer, sections[i].name);
+        sections[i].fn(&writer);
+        telemetry_end_object(&writer);
+    }
+
+    size_t len = telemetry_writer_finish(&writer);
+    if (len == 0) {
+        ESP_LOGE(TAG, "Telemetry does not fit in %d bytes", DEVICE_TELEMETRY_BUFFER_SIZE);
+    } else {
+        // Held in the outbox while the broker is unreachable
+        mqtt_outbox_publish(telemetry_topic, buffer, len, TELEMETRY_FORMAT_DEFAULT);
+    }
+
+    xSemaphoreGive(buffer_mutex);
+}
+
+static void telemetry_timer_callback(void *arg) { device_telemetry_publish_now(); }
+
+void init_device_telemetry(const char *device_name, esp_mqtt_client_handle_t client,
+                           const char *topic, int interval_minutes) {
+    telemetry_device_name = device_name;
+    telemetry_topic = topic;
+    buffer_mutex = xSemaphoreCreateMutexStatic(&buffer_mutex_buffer);
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = telemetry_timer_callback,
+        .name = "device_telemetry",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &telemetry_timer));
+    ESP_ERROR_CHECK(
+        esp_timer_start_periodic(telemetry_timer, (uint64_t)interval_minutes * 60 * 1000 * 1000));
+
+    telemetry_client = client;
+    ESP_LOGI(TAG, "Publishing %d telemetry sections to %s every %d minutes", section_count, topic,
+             interval_minutes);
+}
@@ -0,0 +1,18 @@
+#ifndef DEVICE_TELEMETRY_H
+#define DEVICE_TELEMETRY_H
+
+#include "mqtt_client.h"
+#include "telemetry_writer.h"
+
+// The device's telemetry record, the only message on the telemetry topic, published every
+// interval and on request. Each module contributes a named section, and the whole record is
+// encoded as JSON or, with CONFIG_TELEMETRY_FORMAT_CBOR, as one compact CBOR map.
+
+typedef void (*device_telemetry_section_fn)(telemetry_writer_t *writer);
+
+void device_telemetry_register_section(const char *name, device_telemetry_section_fn fn);
+void init_device_telemetry(const char *device_name, esp_mqtt_client_handle_t client,
+                           const char *topic, int interval_minutes);
+void device_telemetry_publish_now(void);
+
+#endif  // DEVICE_TELEMETRY_H
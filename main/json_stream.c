@@ -0,0 +1,395 @@
+#include "json_stream.h"
+
+#include <string.h>
+
+enum {
+    STATE_VALUE,         // Expecting a value
+    STATE_ARRAY_FIRST,   // After '[': a value or ']'
+    STATE_OBJECT_FIRST,  // After '{': a key or '}'
+    STATE_KEY,           // After ',' in an object
+    STATE_COLON,
+    STATE_AFTER_VALUE,   // ',' or the closing bracket
+    STATE_STRING,
+    STATE_STRING_ESCAPE,
+    STATE_STRING_UNICODE,
+    STATE_LITERAL,       // Number, true, false or null
+    STATE_DONE,
+};
+
+static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+
+static bool is_literal_char(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '-' || c == '+' ||
+           c == '.' || c == 'E';
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool fail(json_stream_t *stream) {
+    stream->error = true;
+    return false;
+}
+
+static void token_put(json_stream_t *stream, char c) {
+    if (stream->token_len < JSON_STREAM_MAX_TOKEN) {
+        stream->token[stream->token_len++] = c;
+    } else {
+        stream->token_truncated = true;
+    }
+}
+
+static void token_put_utf8(json_stream_t *stream, uint32_t cp) {
+    if (cp < 0x80) {
+        token_put(stream, (char)cp);
+    } else if (cp < 0x800) {
+        token_put(stream, (char)(0xC0 | (cp >> 6)));
+        token_put(stream, (char)(0x80 | (cp & 0x3F)));
+    } else {
+        // Surrogate halves are encoded one by one; none of our fields go beyond the BMP
+        token_put(stream, (char)(0xE0 | (cp >> 12)));
+        token_put(stream, (char)(0x80 | ((cp >> 6) & 0x3F)));
+        token_put(stream, (char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+static void value_done(json_stream_t *stream) {
+    stream->state = stream->depth == 0 ? STATE_DONE : STATE_AFTER_VALUE;
+}
+
+static void emit(json_stream_t *stream, json_value_type_t type) {
+    stream->token[stream->token_len] = '\0';
+    if (stream->on_value != NULL) {
+        stream->on_value(stream, type, stream->token, stream->ctx);
+    }
+    value_done(stream);
+}
+
+static bool open_level(json_stream_t *stream, bool array) {
+    if (stream->depth >= JSON_STREAM_MAX_DEPTH) {
+        return fail(stream);
+    }
+    uint8_t bit = 1u << stream->depth;
+    if (array) {
+        stream->in_array |= bit;
+    } else {
+        stream->in_array &= ~bit;
+    }
+    stream->keys[stream->depth][0] = '\0';
+    stream->long_keys &= ~bit;
+    stream->depth++;
+    stream->state = array ? STATE_ARRAY_FIRST : STATE_OBJECT_FIRST;
+    return true;
+}
+
+static bool close_level(json_stream_t *stream, bool array) {
+    if (stream->depth == 0 || ((stream->in_array >> (stream->depth - 1)) & 1) != array) {
+        return fail(stream);
+    }
+    stream->depth--;
+    value_done(stream);
+    return true;
+}
+
+static bool valid_number(const char *p) {
+    if (*p == '-') {
+        p++;
+    }
+    if (*p < '0' || *p > '9') {
+        return false;
+    }
+    while (*p >= '0' && *p <= '9') {
+        p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    if (*p == 'e' || *p == 'E') {
+        p++;
+        if (*p == '+' || *p == '-') {
+            p++;
+        }
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    return *p == '\0';
+}
+
+static bool finish_literal(json_stream_t *stream) {
+    stream->token[stream->token_len] = '\0';
+    if (stream->token_truncated) {
+        return fail(stream);
+    }
+    if (strcmp(stream->token, "true") == 0) {
+        emit(stream, JSON_VALUE_TRUE);
+    } else if (strcmp(stream->token, "false") == 0) {
+        emit(stream, JSON_VALUE_FALSE);
+    } else if (strcmp(stream->token, "null") == 0) {
+        emit(stream, JSON_VALUE_NULL);
+    } else if (valid_number(stream->token)) {
+        emit(stream, JSON_VALUE_NUMBER);
+    } else {
+        return fail(stream);
+    }
+    return true;
+}
+
+static void begin_token(json_stream_t *stream, int state) {
+    stream->token_len = 0;
+    stream->token_truncated = false;
+    stream->state = state;
+}
+
+static bool begin_value(json_stream_t *stream, char c) {
+    if (c == '{') {
+        return open_level(stream, false);
+    }
+    if (c == '[') {
+        return open_level(stream, true);
+    }
+    if (c == '"') {
+        stream->string_is_key = false;
+        begin_token(stream, STATE_STRING);
+        return true;
+    }
+    if (is_literal_char(c)) {
+        begin_token(stream, STATE_LITERAL);
+        token_put(stream, c);
+        return true;
+    }
+    return fail(stream);
+}
+
+static void end_string(json_stream_t *stream) {
+    if (stream->string_is_key) {
+        uint8_t bit = 1u << (stream->depth - 1);
+        size_t len = stream->token_len;
+
+        // A cut-off key could match a shorter one we look for, so it matches nothing
+        if (stream->token_truncated || len > JSON_STREAM_MAX_KEY - 1) {
+            stream->long_keys |= bit;
+            len = 0;
+        } else {
+            stream->long_keys &= ~bit;
+        }
+        memcpy(stream->keys[stream->depth - 1], stream->token, len);
+        stream->keys[stream->depth - 1][len] = '\0';
+        stream->state = STATE_COLON;
+    } else {
+        emit(stream, stream->token_truncated ? JSON_VALUE_LONG_STRING : JSON_VALUE_STRING);
+    }
+}
+
+// Handles one character. Returns false if the character ended a literal and has to be
+// looked at again in the new state.
+static bool step(json_stream_t *stream, char c) {
+    switch (stream->state) {
+        case STATE_STRING:
+            if (c == '"') {
+                end_string(stream);
+            } else if (c == '\\') {
+                stream->state = STATE_STRING_ESCAPE;
+            } else if ((unsigned char)c < 0x20) {
+                fail(stream);
+            } else {
+                token_put(stream, c);
+            }
+            return true;
+
+        case STATE_STRING_ESCAPE: {
+            static const char escapes[] = "\"\"\\\\//b\bf\fn\nr\rt\t";
+            if (c == 'u') {
+                stream->codepoint = 0;
+                stream->hex_digits = 0;
+                stream->state = STATE_STRING_UNICODE;
+                return true;
+            }
+            for (const char *e = escapes; *e; e += 2) {
+                if (*e == c) {
+                    token_put(stream, e[1]);
+                    stream->state = STATE_STRING;
+                    return true;
+                }
+            }
+            fail(stream);
+            return true;
+        }
+
+        case STATE_STRING_UNICODE: {
+            int digit = hex_value(c);
+            if (digit < 0) {
+                fail(stream);
+                return true;
+            }
+            stream->codepoint = (stream->codepoint << 4) | (uint32_t)digit;
+            if (++stream->hex_digits == 4) {
+                token_put_utf8(stream, stream->codepoint);
+                stream->state = STATE_STRING;
+            }
+            return true;
+        }
+
+        case STATE_LITERAL:
+            if (is_literal_char(c)) {
+                token_put(stream, c);
+                return true;
+            }
+            finish_literal(stream);
+            return false;
+
+        default:
+            break;
+    }
+
+    if (is_space(c)) {
+        return true;
+    }
+
+    switch (stream->state) {
+        case STATE_VALUE:
+            begin_value(stream, c);
+            break;
+        case STATE_ARRAY_FIRST:
+            if (c == ']') {
+                close_level(stream, true);
+            } else {
+                begin_value(stream, c);
+            }
+            break;
+        case STATE_OBJECT_FIRST:
+        case STATE_KEY:
+            if (c == '}' && stream->state == STATE_OBJECT_FIRST) {
+                close_level(stream, false);
+            } else if (c == '"') {
+                stream->string_is_key = true;
+                begin_token(stream, STATE_STRING);
+            } else {
+                fail(stream);
+            }
+            break;
+        case STATE_COLON:
+            if (c == ':') {
+                stream->state = STATE_VALUE;
+            } else {
+                fail(stream);
+            }
+            break;
+        case STATE_AFTER_VALUE:
+            if (c == ',') {
+                bool array = (stream->in_array >> (stream->depth - 1)) & 1;
+                stream->state = array ? STATE_VALUE : STATE_KEY;
+            } else if (c == ']' || c == '}') {
+                close_level(stream, c == ']');
+            } else {
+                fail(stream);
+            }
+            break;
+        default:
+            // Anything but whitespace after the document
+            fail(stream);
+            break;
+    }
+    return true;
+}
+
+void json_stream_init(json_stream_t *stream, json_value_fn on_value, void *ctx) {
+    memset(stream, 0, sizeof(*stream));
+    stream->on_value = on_value;
+    stream->ctx = ctx;
+    stream->state = STATE_VALUE;
+}
+
+bool json_stream_feed(json_stream_t *stream, const char *data, size_t len) {
+    for (size_t i = 0; i < len && !stream->error;) {
+        if (step(stream, data[i])) {
+            i++;
+        }
+    }
+    return !stream->error;
+}
+
+bool json_stream_finish(json_stream_t *stream) {
+    // A bare top-level number has nothing after it to end it
+    if (stream->state == STATE_LITERAL && stream->depth == 0) {
+        finish_literal(stream);
+    }
+    return !stream->error && stream->state == STATE_DONE;
+}
+
+// Matches the first `levels` keys against a dot-separated path
+static bool keys_match(const json_stream_t *stream, int levels, const char *path) {
+    for (int level = 0; level < levels; level++) {
+        const char *key = stream->keys[level];
+        size_t len = strcspn(path, ".");
+
+        if ((stream->long_keys >> level) & 1) {
+            return false;
+        }
+        if (strlen(key) != len || strncmp(key, path, len) != 0) {
+            return false;
+        }
+        path += len;
+        if (level < levels - 1) {
+            if (*path != '.') {
+                return false;
+            }
+            path++;
+        }
+    }
+    return *path == '\0';
+}
+
+bool json_stream_path_is(const json_stream_t *stream, const char *path) {
+    return stream->depth > 0 && keys_match(stream, stream->depth, path);
+}
+
+bool json_stream_parent_is(const json_stream_t *stream, const char *path) {
+    return stream->depth > 0 && keys_match(stream, stream->depth - 1, path);
+}
+
+bool json_stream_parse_int(const char *text, int32_t *value) {
+    bool negative = *text == '-';
+    int64_t result = 0;
+
+    if (negative) {
+        text++;
+    }
+    if (*text == '\0') {
+        return false;
+    }
+    for (; *text; text++) {
+        if (*text < '0' || *text > '9') {
+            return false;
+        }
+        result = result * 10 + (*text - '0');
+        if (result > (int64_t)INT32_MAX + 1) {
+            return false;
+        }
+    }
+    result = negative ? -result : result;
+    if (result > INT32_MAX) {
+        return false;
+    }
+    *value = (int32_t)result;
+    return true;
+}
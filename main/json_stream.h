@@ -0,0 +1,74 @@
+#ifndef JSON_STREAM_H
+#define JSON_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Incremental JSON tokenizer with no allocation. The document can be fed in any number of
+// chunks, split anywhere, and every scalar is handed to a callback together with the keys
+// leading to it. Callers pick out the fields they know into their own structs.
+//
+// Strings longer than JSON_STREAM_MAX_TOKEN bytes are reported as JSON_VALUE_LONG_STRING with
+// only their first bytes, so they are never taken for a complete value. A key of
+// JSON_STREAM_MAX_KEY bytes or more matches no path. Numbers that long fail the parse. The
+// fields we read are all far shorter.
+
+#define JSON_STREAM_MAX_DEPTH 8
+#define JSON_STREAM_MAX_KEY 24
+#define JSON_STREAM_MAX_TOKEN 64
+
+typedef enum {
+    JSON_VALUE_STRING,
+    JSON_VALUE_NUMBER,
+    JSON_VALUE_TRUE,
+    JSON_VALUE_FALSE,
+    JSON_VALUE_NULL,
+    JSON_VALUE_LONG_STRING,  // Cut off after JSON_STREAM_MAX_TOKEN bytes
+} json_value_type_t;
+
+typedef struct json_stream json_stream_t;
+
+// `text` is NUL-terminated and only valid during the call
+typedef void (*json_value_fn)(json_stream_t *stream, json_value_type_t type, const char *text,
+                              void *ctx);
+
+struct json_stream {
+    json_value_fn on_value;
+    void *ctx;
+    int state;
+    int depth;          // Open objects and arrays
+    uint8_t in_array;   // Bit per nesting level
+    uint8_t long_keys;  // Bit per nesting level whose key did not fit
+    char keys[JSON_STREAM_MAX_DEPTH][JSON_STREAM_MAX_KEY];  // Current key at each level
+    char token[JSON_STREAM_MAX_TOKEN + 1];
+    size_t token_len;
+    bool token_truncated;
+    bool string_is_key;
+    uint32_t codepoint;  // \u escape being decoded
+    int hex_digits;
+    bool error;
+};
+
+void json_stream_init(json_stream_t *stream, json_value_fn on_value, void *ctx);
+// Both return false once the input is known to be malformed
+bool json_stream_feed(json_stream_t *stream, const char *data, size_t len);
+// Call after the last chunk; true only for one complete, well-formed document
+bool json_stream_finish(json_stream_t *stream);
+
+// Whether the value being reported sits at the given dot-separated key path,
+// e.g. "state.desired.brightness". Array levels are matched by an empty component.
+bool json_stream_path_is(const json_stream_t *stream, const char *path);
+// Same for the object or array holding the value; "" is the top level
+bool json_stream_parent_is(const json_stream_t *stream, const char *path);
+// Key of the value being reported, "" inside arrays and for a key too long to keep
+static inline const char *json_stream_key(const json_stream_t *stream) {
+    if (stream->depth == 0 || ((stream->long_keys >> (stream->depth - 1)) & 1)) {
+        return "";
+    }
+    return stream->keys[stream->depth - 1];
+}
+// Parses a JSON_VALUE_NUMBER that must be an integer
+bool json_stream_parse_int(const char *text, int32_t *value);
+
+#endif  // JSON_STREAM_H
@@ -0,0 +1,93 @@
+#include "latency_trace.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+typedef struct {
+    atomic_uint buckets[LATENCY_TRACE_BUCKETS];
+    atomic_uint samples;
+    atomic_uint max_us;
+} latency_histogram_t;
+
+static latency_histogram_t histograms[LATENCY_STAGE_COUNT];
+
+static const char *stage_names[LATENCY_STAGE_COUNT] = {
+    [LATENCY_STAGE_WAKEUP] = "wakeup",
+    [LATENCY_STAGE_COMPOSE] = "compose",
+    [LATENCY_STAGE_REFRESH] = "refresh",
+    [LATENCY_STAGE_TOTAL] = "total",
+    [LATENCY_STAGE_WAKE_TO_LIGHT] = "wake_to_light",
+};
+
+static int bucket_for(uint32_t us) {
+    int bucket = us == 0 ? 0 : 32 - __builtin_clz(us);
+    return bucket < LATENCY_TRACE_BUCKETS ? bucket : LATENCY_TRACE_BUCKETS - 1;
+}
+
+void latency_trace_record(latency_stage_t stage, int64_t start_us, int64_t end_us) {
+    latency_histogram_t *hist = &histograms[stage];
+    int64_t delta = end_us - start_us;
+    uint32_t us = delta < 0 ? 0 : delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta;
+
+    atomic_fetch_add_explicit(&hist->buckets[bucket_for(us)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->samples, 1, memory_order_relaxed);
+
+    unsigned int max = atomic_load_explicit(&hist->max_us, memory_order_relaxed);
+    while (us > max && !atomic_compare_exchange_weak_explicit(&hist->max_us, &max, us,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed)) {
+    }
+}
+
+// Upper edge of the bucket holding the given percentile
+uint32_t latency_trace_percentile_us(latency_stage_t stage, uint32_t percent) {
+    latency_histogram_t *hist = &histograms[stage];
+    uint32_t samples = atomic_load_explicit(&hist->samples, memory_order_relaxed);
+    uint64_t rank = ((uint64_t)samples * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    if (samples == 0) {
+        return 0;
+    }
+    for (int i = 0; i < LATENCY_TRACE_BUCKETS; i++) {
+        seen += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+        if (seen >= rank) {
+            return i == LATENCY_TRACE_BUCKETS - 1 ? atomic_load(&hist->max_us) : 1u << i;
+        }
+    }
+    return atomic_load(&hist->max_us);
+}
+
+void latency_trace_reset(void) {
+    for (int s = 0; s < LATENCY_STAGE_COUNT; s++) {
+        for (int i = 0; i < LATENCY_TRACE_BUCKETS; i++) {
+            atomic_store(&histograms[s].buckets[i], 0);
+        }
+        atomic_store(&histograms[s].samples, 0);
+        atomic_store(&histograms[s].max_us, 0);
+    }
+}
+
+void latency_trace_write_telemetry(telemetry_writer_t *writer) {
+    for (int s = 0; s < LATENCY_STAGE_COUNT; s++) {
+        latency_histogram_t *hist = &histograms[s];
+        int last = LATENCY_TRACE_BUCKETS - 1;
+
+        // Trailing empty buckets are left out; consumers treat missing buckets as zero
+        while (last >= 0 && atomic_load(&hist->buckets[last]) == 0) {
+            last--;
+        }
+
+        telemetry_begin_object(writer, stage_names[s]);
+        telemetry_write_uint(writer, "n", atomic_load(&hist->samples));
+        telemetry_write_uint(writer, "p50_us", latency_trace_percentile_us(s, 50));
+        telemetry_write_uint(writer, "p99_us", latency_trace_percentile_us(s, 99));
+        telemetry_write_uint(writer, "max_us", atomic_load(&hist->max_us));
+        telemetry_begin_array(writer, "buckets");
+        for (int i = 0; i <= last; i++) {
+            telemetry_write_uint(writer, NULL, atomic_load(&hist->buckets[i]));
+        }
+        telemetry_end_array(writer);
+        telemetry_end_object(writer);
+    }
+}
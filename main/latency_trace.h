@@ -0,0 +1,30 @@
+#ifndef LATENCY_TRACE_H
+#define LATENCY_TRACE_H
+
+#include <stdint.h>
+
+#include "telemetry_writer.h"
+
+// Fixed-size, lock-free latency histograms for the motion-to-light path. Recording is a
+// couple of atomic increments, so it is safe from any task.
+
+// Bucket i counts latencies in [2^(i-1), 2^i) microseconds; bucket 0 is under 1us and the
+// last bucket also takes everything above its range (~8.4s).
+#define LATENCY_TRACE_BUCKETS 24
+
+typedef enum {
+    LATENCY_STAGE_WAKEUP = 0,     // Motion stamped -> picked up by the LED task
+    LATENCY_STAGE_COMPOSE,        // Picked up -> first frame handed to the output
+    LATENCY_STAGE_REFRESH,        // Handed to the output -> frame latched by the strip
+    LATENCY_STAGE_TOTAL,          // Motion stamped -> frame latched
+    LATENCY_STAGE_WAKE_TO_LIGHT,  // PIR woke the chip from light sleep -> frame latched
+    LATENCY_STAGE_COUNT,
+} latency_stage_t;
+
+void latency_trace_record(latency_stage_t stage, int64_t start_us, int64_t end_us);
+uint32_t latency_trace_percentile_us(latency_stage_t stage, uint32_t percent);
+void latency_trace_reset(void);
+
+void latency_trace_write_telemetry(telemetry_writer_t *writer);
+
+#endif  // LATENCY_TRACE_H
@@ -0,0 +1,82 @@
+#include "led_fade.h"
+
+#include "led_gamma_lut.h"
+#include "led_renderer.h"
+
+// Bit-reversed 4-bit counter, centered in each 1/16 step. Walking it frame by frame turns the
+// fractional byte into an even on/off pattern instead of a long on burst.
+static const uint8_t dither_thresholds[16] = {
+    8, 136, 72, 200, 40, 168, 104, 232, 24, 152, 88, 216, 56, 184, 120, 248,
+};
+
+// Neighbouring pixels start at different points of the pattern so the strip doesn't pulse
+#define DITHER_PIXEL_STRIDE 5
+
+uint16_t led_fade_ease(uint16_t progress) {
+    uint64_t p = progress;
+    // One shift at the end: truncating p * p first lets the curve step backwards
+    uint64_t eased = (p * p * (3u * 0x10000u - 2u * p)) >> 32;
+    return eased > LED_FADE_INTENSITY_MAX ? LED_FADE_INTENSITY_MAX : (uint16_t)eased;
+}
+
+static inline uint16_t lut_lookup(const uint16_t *lut, uint32_t index, uint32_t frac) {
+    uint32_t lo = lut[index];
+    uint32_t hi = lut[index + 1];
+    return (uint16_t)(lo + (((hi - lo) * frac) >> 8));
+}
+
+void led_fade_color(uint16_t intensity, led_rgb16_t *color) {
+    // Stretch 0..LED_FADE_INTENSITY_MAX over the whole table so full intensity is its last entry
+    uint32_t position = intensity + (intensity >> 15);
+    uint32_t index = position >> 8;
+    uint32_t frac = position & 0xFF;
+
+    if (index == LED_GAMMA_LUT_SIZE - 1) {
+        color->r = led_gamma_lut_r[index];
+        color->g = led_gamma_lut_g[index];
+        color->b = led_gamma_lut_b[index];
+        return;
+    }
+    color->r = lut_lookup(led_gamma_lut_r, index, frac);
+    color->g = lut_lookup(led_gamma_lut_g, index, frac);
+    color->b = lut_lookup(led_gamma_lut_b, index, frac);
+}
+
+static inline uint16_t settle(uint16_t value) {
+    if (value == 0) {
+        return 0;
+    }
+    uint32_t rounded = ((uint32_t)value + 0x80) & ~0xFFu;
+    if (rounded == 0) {
+        return 0x100;  // A dim glow must not round to dark
+    }
+    return rounded > 0xFF00 ? 0xFF00 : (uint16_t)rounded;
+}
+
+void led_fade_settle(led_rgb16_t *color) {
+    color->r = settle(color->r);
+    color->g = settle(color->g);
+    color->b = settle(color->b);
+}
+
+static inline uint8_t dither(uint16_t value, uint8_t threshold) {
+    return (uint8_t)((value >> 8) + ((value & 0xFF) > threshold));
+}
+
+void led_fade_fill(uint8_t *frame, size_t first, size_t count, const led_rgb16_t *color,
+                   uint32_t frame_number) {
+    if (!led_fade_needs_dither(color)) {
+        uint32_t rgb = ((uint32_t)(color->r >> 8) << 16) | ((color->g >> 8) << 8) | (color->b >> 8);
+        led_frame_fill(frame, first, count, rgb);
+        return;
+    }
+
+    uint8_t *dst = frame + LED_FRAME_BYTES(first);
+    uint32_t phase = frame_number + first * DITHER_PIXEL_STRIDE;
+    for (size_t i = 0; i < count; i++, phase += DITHER_PIXEL_STRIDE) {
+        uint8_t threshold = dither_thresholds[phase & 0xF];
+        *dst++ = dither(color->g, threshold);
+        *dst++ = dither(color->r, threshold);
+        *dst++ = dither(color->b, threshold);
+    }
+}
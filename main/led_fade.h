@@ -0,0 +1,44 @@
+#ifndef LED_FADE_H
+#define LED_FADE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Integer-only dimming. Intensities are linear, 0..LED_FADE_INTENSITY_MAX; channel values
+// are gamma corrected 8.8 fixed point, where the low byte is spread over frames by dithering.
+
+#define LED_FADE_INTENSITY_MAX 0xFFFFu
+
+typedef struct {
+    uint16_t r;
+    uint16_t g;
+    uint16_t b;
+} led_rgb16_t;
+
+// a * b / LED_FADE_INTENSITY_MAX, rounded, so full intensity scales by exactly one
+static inline uint16_t led_fade_scale(uint16_t a, uint16_t b) {
+    uint32_t product = (uint32_t)a * b;
+    return (uint16_t)((product + (product >> 16) + 0x8000u) >> 16);
+}
+
+// Smoothstep easing of a linear ramp progress
+uint16_t led_fade_ease(uint16_t progress);
+
+// Gamma and white point corrected color for a linear intensity
+void led_fade_color(uint16_t intensity, led_rgb16_t *color);
+
+// Rounds every channel to a whole value, so a color held on the strip needs no fresh frames
+// and the strip can idle. A lit channel stays at least 1.
+void led_fade_settle(led_rgb16_t *color);
+
+// True when the color has a fractional part that needs dithering to show
+static inline bool led_fade_needs_dither(const led_rgb16_t *color) {
+    return ((color->r | color->g | color->b) & 0xFF) != 0;
+}
+
+// Writes count GRB pixels starting at first, dithered for the given frame number
+void led_fade_fill(uint8_t *frame, size_t first, size_t count, const led_rgb16_t *color,
+                   uint32_t frame_number);
+
+#endif  // LED_FADE_H
@@ -0,0 +1,23 @@
+# Gamma tables are baked from the Kconfig values at build time. Shared with the host
+# benchmark project, which compiles the lighting sources from this directory.
+set(LED_GAMMA_LUT_SCRIPT "${CMAKE_CURRENT_LIST_DIR}/../scripts/gen_gamma_lut.py")
+
+function(led_gamma_lut_generate target)
+    idf_build_get_property(python PYTHON)
+    idf_build_get_property(sdkconfig_header SDKCONFIG_HEADER)
+    set(script "${LED_GAMMA_LUT_SCRIPT}")
+    set(header "${CMAKE_CURRENT_BINARY_DIR}/led_gamma_lut.h")
+    add_custom_command(
+        OUTPUT ${header}
+        COMMAND ${python} ${script}
+            --gamma-x100 ${CONFIG_LED_GAMMA_X100}
+            --max-brightness ${CONFIG_LED_MAX_BRIGHTNESS}
+            --color-temperature ${CONFIG_LED_COLOR_TEMPERATURE_K}
+            --output ${header}
+        DEPENDS ${script} ${sdkconfig_header}
+        VERBATIM
+    )
+    add_custom_target(led_gamma_lut DEPENDS ${header})
+    add_dependencies(${target} led_gamma_lut)
+    target_include_directories(${target} PRIVATE ${CMAKE_CURRENT_BINARY_DIR})
+endfunction()
@@ -1,59 +1,343 @@
 #include "led_handler.h"
 
 #include <inttypes.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 
+#include "binlog.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
-#include "led_strip.h"
+#include "latency_trace.h"
+#include "led_fade.h"
+#include "led_renderer.h"
+#include "motion_trace.h"
+#include "occupancy.h"
+#include "presence_model.h"
+#include "sdkconfig.h"
+
+#ifndef CONFIG_IDF_TARGET_LINUX
+#include "led_output_rmt.h"
+#endif
+#ifdef CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
 
 static const char *TAG = "LED_HANDLER";
+// The LED task logs through the deferred log, never through ESP_LOG
+BINLOG_TAG(led_log, "LED_HANDLER");
+
+// Longest motion queue the bus can take; the queue set needs one slot per queued item
+#define LED_BUS_MAX_MOTION_QUEUE_LENGTH 32
+// The motion sensor may post between emptying its queue and adding it to the set
+#define LED_BUS_ATTACH_ATTEMPTS 10
+#define LED_BUS_MOTION (1u << 0)
+#define LED_BUS_SETTINGS (1u << 1)
+#define FRAME_PERIOD_US (1000 * 1000 / CONFIG_LED_FRAME_RATE_HZ)
+
+#ifndef CONFIG_IDF_TARGET_LINUX
+static led_output_rmt_t led_outputs[CONFIG_LED_CHANNEL_COUNT];
+#endif
+// One renderer per channel; all channels are sent out together and transmit in parallel
+static led_renderer_t led_renderers[CONFIG_LED_CHANNEL_COUNT];
+static size_t channel_count;
+static uint8_t frame_buffers[CONFIG_LED_CHANNEL_COUNT][2][LED_FRAME_BYTES(CONFIG_MAX_LED_COUNT)];
+
+typedef struct
+{
+    led_segment_config_t config;
+    led_renderer_t *renderer;
+    led_sm_t sm;
+    // Set when the last frame carried a visible fraction of brightness that needs a fresh
+    // dither. Only ramps dither; a held level is settled to whole values.
+    bool dithering;
+    // Turned on from the pre-light glow, which a sweep or wipe would black out, so it fades
+    bool prelit;
+} led_segment_t;
+
+static led_segment_t segments[LED_MAX_SEGMENTS];
+static size_t segment_count;
 
-#define BRIGHTNESS 0x606060
+// The LED task waits on one queue set: the motion sensor's queue, read directly, and a
+// binary semaphore signalling that bits were posted to pending_events.
+// The queue set itself has no static variant in this FreeRTOS version and is allocated once.
+static QueueSetHandle_t led_bus;
+static QueueHandle_t motion_queue;
+static SemaphoreHandle_t bus_signal;
+static StaticSemaphore_t bus_signal_buffer;
+static atomic_uint pending_events;
+static atomic_llong latest_motion_us;
+static atomic_llong latest_wake_us;
+static atomic_uint motion_sensors;
+static atomic_uint coalesced_events;
+// Counted by the LED task; segments only see their own sensor's motion
+static atomic_uint motion_events;
+static atomic_uint retriggers;
+// Whether any segment is mid-animation, for tasks that should keep out of its way
+static atomic_bool animating;
 
-led_strip_handle_t led_strip;
+static StaticTask_t led_task_buffer;
+static StackType_t led_task_stack[CONFIG_LED_TASK_STACK_SIZE];
 
-/* LED strip initialization with the GPIO and pixels number */
-led_strip_config_t strip_config = {
-    .strip_gpio_num = CONFIG_LED_STRIP_GPIO_PIN, // The GPIO that is connected to the LED strip's data line
-    .max_leds = CONFIG_MAX_LED_COUNT,            // This will be set in led_handler_init()
-    .led_pixel_format = LED_PIXEL_FORMAT_GRB,    // Pixel format of your LED strip
-    .led_model = LED_MODEL_WS2812,               // LED strip model
-    .flags.invert_out = false,                   // Whether to invert the output signal (useful when your hardware
-                                                 // has a level inverter)
-};
+// Latest settings handed in by led_handler_apply_settings(), read by the LED task
+static SemaphoreHandle_t settings_mutex;
+static StaticSemaphore_t settings_mutex_buffer;
+static led_handler_settings_t settings;
 
-led_strip_rmt_config_t led_strip_rmt_config = {
-    .clk_src = RMT_CLK_SRC_DEFAULT,    // Different clock sources can lead to different power consumption
-    .resolution_hz = 10 * 1000 * 1000, // 10MHz
-    .flags.with_dma = false,           // Whether to enable the DMA feature
-};
+// Owned by the LED task
+static led_power_mode_t power = LED_POWER_AUTO;
+#ifdef CONFIG_LED_ANIMATION_FADE
+static led_animation_t animation = LED_ANIMATION_FADE;
+#else
+static led_animation_t animation = LED_ANIMATION_SWEEP;
+#endif
+static uint16_t target_intensity =
+    (uint16_t)((uint32_t)CONFIG_LED_TARGET_BRIGHTNESS_PERCENT * LED_FADE_INTENSITY_MAX / 100);
+static uint8_t brightness_percent = CONFIG_LED_TARGET_BRIGHTNESS_PERCENT;
+static uint32_t shine_ms_setting;
+// What the presence model expects of the current half hour; decided on the first pass
+static presence_decision_t presence = {.ramp_percent = 100};
+static uint16_t prelight_intensity;
 
-QueueHandle_t led_state_queue;
+// Set when the strip shows a static frame that still has to be sent
+static bool frame_dirty;
+// Motion collected while draining the bus, handled once it is empty
+static bool motion_pending;
+static uint32_t motion_pending_sensors;
+static int64_t motion_detected_us;
+static int64_t motion_dequeued_us;
+static int64_t motion_woke_us;
+// What the last frames drew, for the occupancy energy estimate
+static uint32_t channel_outputs[CONFIG_LED_CHANNEL_COUNT];
+static uint32_t light_output;
 
-QueueHandle_t get_led_state_queue(void) { return led_state_queue; }
+// The motion event that turned the strip on, followed until its first frame is latched
+static bool trace_pending;
+static int64_t trace_detected_us;
+static int64_t trace_dequeued_us;
+// When the PIR woke the chip from light sleep for that motion, or 0
+static int64_t trace_woke_us;
+
+// Set while frames are being produced. The outputs are enabled and, with power management,
+// the CPU is held at full speed; in between the chip is free to sleep.
+static bool strip_active;
+#ifdef CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t animation_lock;
+#endif
 
 // Function to convert milliseconds to minutes
 uint32_t ms_to_minutes(uint32_t milliseconds) { return milliseconds / (60 * 1000); }
 
+static int sweep_steps(size_t led_count) { return led_count / 2 + 1; }
+
+static esp_err_t set_all_leds_off(void);
+
+static led_effect_t segment_effect(const led_segment_t *segment)
+{
+    if (segment->prelit)
+    {
+        return LED_EFFECT_FADE;
+    }
+    if (segment->config.effect != LED_EFFECT_DEFAULT)
+    {
+        return segment->config.effect;
+    }
+    return animation == LED_ANIMATION_FADE ? LED_EFFECT_FADE : LED_EFFECT_SWEEP;
+}
+
+static int64_t ramp_up_us(const led_segment_t *segment)
+{
+    // One step per CONFIG_PAUSE_BETWEEN_LEDS_MS, the same pace as the old blocking sweep
+    switch (segment_effect(segment))
+    {
+    case LED_EFFECT_SWEEP:
+        return (int64_t)sweep_steps(segment->config.led_count) * CONFIG_PAUSE_BETWEEN_LEDS_MS *
+               1000;
+    case LED_EFFECT_WIPE:
+        return (int64_t)segment->config.led_count * CONFIG_PAUSE_BETWEEN_LEDS_MS * 1000;
+    default:
+        return (int64_t)CONFIG_LED_FADE_IN_MS * 1000;
+    }
+}
+
+static int64_t shine_us(const led_segment_t *segment, uint32_t default_shine_ms)
+{
+    uint32_t shine_ms = segment->config.shine_ms != 0 ? segment->config.shine_ms : default_shine_ms;
+    return (int64_t)shine_ms * 1000;
+}
+
+#ifndef CONFIG_IDF_TARGET_LINUX
+#define KCONFIG_SEGMENT(n)                                             \
+    {                                                                  \
+        .channel = CONFIG_LED_SEGMENT##n##_CHANNEL,                    \
+        .start = CONFIG_LED_SEGMENT##n##_START,                        \
+        .led_count = CONFIG_LED_SEGMENT##n##_LED_COUNT,                \
+        .reversed = CONFIG_LED_SEGMENT##n##_REVERSED,                  \
+        .effect = CONFIG_LED_SEGMENT##n##_EFFECT,                      \
+        .shine_ms = CONFIG_LED_SEGMENT##n##_SHINE_MINUTES * 60 * 1000, \
+        .motion_sensor = CONFIG_LED_SEGMENT##n##_MOTION_SENSOR,        \
+    }
+
 void init_led_handler()
 {
-    esp_err_t ret = led_strip_new_rmt_device(&strip_config, &led_strip_rmt_config, &led_strip);
-    if (ret != ESP_OK)
+    static const int channel_gpios[] = {
+        CONFIG_LED_STRIP_GPIO_PIN,
+#if CONFIG_LED_CHANNEL_COUNT > 1
+        CONFIG_LED_CHANNEL1_GPIO_PIN,
+#endif
+    };
+    static const size_t channel_led_counts[] = {
+        CONFIG_MAX_LED_COUNT,
+#if CONFIG_LED_CHANNEL_COUNT > 1
+        CONFIG_LED_CHANNEL1_LED_COUNT,
+#endif
+    };
+    led_handler_config_t config = {
+        .channel_count = CONFIG_LED_CHANNEL_COUNT,
+        .segments = {
+#if CONFIG_LED_SEGMENT_COUNT > 0
+            KCONFIG_SEGMENT(0),
+#endif
+#if CONFIG_LED_SEGMENT_COUNT > 1
+            KCONFIG_SEGMENT(1),
+#endif
+#if CONFIG_LED_SEGMENT_COUNT > 2
+            KCONFIG_SEGMENT(2),
+#endif
+#if CONFIG_LED_SEGMENT_COUNT > 3
+            KCONFIG_SEGMENT(3),
+#endif
+        },
+        .segment_count = CONFIG_LED_SEGMENT_COUNT,
+        .shine_ms = CONFIG_MAX_LED_SHINE_MINUTES * 60 * 1000,
+        .fade_out_ms = CONFIG_LED_FADE_OUT_MS,
+    };
+
+    for (int c = 0; c < CONFIG_LED_CHANNEL_COUNT; c++)
     {
-        ESP_LOGE(TAG, "Error initializing LED strip: %s", esp_err_to_name(ret));
-        return;
+        // Only one channel can have the DMA engine; the others refill from an interrupt
+        esp_err_t ret = led_output_rmt_init(&led_outputs[c], channel_gpios[c], c == 0);
+        if (ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Error initializing LED channel %d: %s", c, esp_err_to_name(ret));
+            return;
+        }
+        config.channels[c] = (led_channel_config_t){
+            .output = &led_outputs[c].output,
+            .led_count = channel_led_counts[c],
+        };
+    }
+    led_handler_start(&config);
+}
+#endif
+
+// Segments that do not fit their channel are clipped to it
+static void setup_segments(const led_handler_config_t *config)
+{
+    segment_count = 0;
+    if (config->segment_count == 0)
+    {
+        for (size_t c = 0; c < channel_count; c++)
+        {
+            segments[segment_count++].config = (led_segment_config_t){
+                .channel = c,
+                .led_count = led_renderers[c].led_count,
+            };
+        }
+    }
+    for (size_t i = 0; i < config->segment_count && i < LED_MAX_SEGMENTS; i++)
+    {
+        led_segment_config_t segment = config->segments[i];
+        if (segment.channel >= channel_count)
+        {
+            ESP_LOGE(TAG, "Segment %u is on channel %u, which does not exist", (unsigned)i,
+                     segment.channel);
+            continue;
+        }
+        size_t channel_leds = led_renderers[segment.channel].led_count;
+        if (segment.motion_sensor >= LED_MAX_MOTION_SENSORS)
+        {
+            ESP_LOGE(TAG, "Segment %u follows motion sensor %u, which does not exist",
+                     (unsigned)i, segment.motion_sensor);
+            continue;
+        }
+        if (segment.start >= channel_leds)
+        {
+            ESP_LOGE(TAG, "Segment %u starts past the end of its channel", (unsigned)i);
+            continue;
+        }
+        if (segment.start + segment.led_count > channel_leds)
+        {
+            segment.led_count = channel_leds - segment.start;
+            ESP_LOGW(TAG, "Segment %u clipped to %u LEDs", (unsigned)i,
+                     (unsigned)segment.led_count);
+        }
+        segments[segment_count++].config = segment;
+    }
+    for (size_t i = 0; i < segment_count; i++)
+    {
+        segments[i].renderer = &led_renderers[segments[i].config.channel];
+    }
+}
+
+void led_handler_start(const led_handler_config_t *config)
+{
+    assert(config->channel_count >= 1 && config->channel_count <= CONFIG_LED_CHANNEL_COUNT);
+    channel_count = config->channel_count;
+    for (size_t c = 0; c < channel_count; c++)
+    {
+        assert(config->channels[c].led_count <= CONFIG_MAX_LED_COUNT);
+        led_renderer_init(&led_renderers[c], config->channels[c].output,
+                          config->channels[c].led_count, frame_buffers[c][0], frame_buffers[c][1]);
     }
+    setup_segments(config);
 
-    // Create queue for LED handling events
-    led_state_queue = xQueueCreate(10, sizeof(uint32_t));
+    settings_mutex = xSemaphoreCreateMutexStatic(&settings_mutex_buffer);
+    settings = (led_handler_settings_t){
+        .power = power,
+        .brightness_percent = brightness_percent,
+        .shine_ms = config->shine_ms,
+        .animation = animation,
+    };
+    shine_ms_setting = config->shine_ms;
 
-    ESP_LOGI(TAG, "Initializing LED handler with %" PRIu32 " LEDs", strip_config.max_leds);
+    led_bus = xQueueCreateSet(LED_BUS_MAX_MOTION_QUEUE_LENGTH + 1);
+    bus_signal = xSemaphoreCreateBinaryStatic(&bus_signal_buffer);
+    xQueueAddToSet(bus_signal, led_bus);
+
+    for (size_t i = 0; i < segment_count; i++)
+    {
+        led_sm_config_t sm_config = {
+            .ramp_up_us = ramp_up_us(&segments[i]),
+            .shine_us = shine_us(&segments[i], config->shine_ms),
+            .ramp_down_us = (int64_t)config->fade_out_ms * 1000,
+        };
+        led_sm_init(&segments[i].sm, &sm_config);
+        ESP_LOGI(TAG, "Segment %u: channel %u, LEDs %u-%u%s, motion sensor %u", (unsigned)i,
+                 segments[i].config.channel, (unsigned)segments[i].config.start,
+                 (unsigned)(segments[i].config.start + segments[i].config.led_count - 1),
+                 segments[i].config.reversed ? ", reversed" : "",
+                 segments[i].config.motion_sensor);
+    }
+    init_occupancy();
+    init_motion_trace();
+    init_presence_model();
+#ifdef CONFIG_PM_ENABLE
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "led_animation", &animation_lock));
+    esp_pm_lock_acquire(animation_lock);
+#endif
+    // The clearing frame below is on the wire until the task first goes idle
+    strip_active = true;
+
+    ESP_LOGI(TAG, "Initializing LED handler with %u channels and %u segments at %d FPS",
+             (unsigned)channel_count, (unsigned)segment_count, CONFIG_LED_FRAME_RATE_HZ);
+    ESP_LOGI(TAG, "LEDs will shine for %" PRIu32 " minutes after the last motion event.",
+             ms_to_minutes(config->shine_ms));
     // Turn off the LED strip initially
-    ret = led_strip_clear(led_strip);
+    esp_err_t ret = set_all_leds_off();
     if (ret != ESP_OK)
     {
         ESP_LOGE(TAG, "Error clearing LED strip: %s", esp_err_to_name(ret));
@@ -62,76 +346,803 @@ void init_led_handler()
     {
         ESP_LOGI(TAG, "LED strip cleared at initialization.");
     }
-    xTaskCreate(&led_handling_task, "led_handling_task", 8192, NULL, 5, NULL);
+    xTaskCreateStatic(&led_handling_task, "led_handling_task", CONFIG_LED_TASK_STACK_SIZE, NULL, 5,
+                      led_task_stack, &led_task_buffer);
+}
+
+bool led_handler_attach_motion_queue(QueueHandle_t queue)
+{
+    UBaseType_t length = uxQueueMessagesWaiting(queue) + uxQueueSpacesAvailable(queue);
+
+    if (length > LED_BUS_MAX_MOTION_QUEUE_LENGTH)
+    {
+        ESP_LOGE(TAG, "Motion queue of %u events is too long for the LED bus", (unsigned)length);
+        return false;
+    }
+    // Only an empty queue can join a set; anything in it now is stale boot noise. The sensor
+    // is already running, so an event can land in between and the add has to be retried.
+    for (int attempt = 0; attempt < LED_BUS_ATTACH_ATTEMPTS; attempt++)
+    {
+        xQueueReset(queue);
+        if (xQueueAddToSet(queue, led_bus) == pdPASS)
+        {
+            motion_queue = queue;
+            return true;
+        }
+    }
+    ESP_LOGE(TAG, "Failed to add the motion queue to the LED bus");
+    return false;
+}
+
+// Returns false when the event was already pending, so the LED task will see it anyway
+static bool signal_bus(uint32_t event)
+{
+    if (atomic_fetch_or(&pending_events, event) & event)
+    {
+        return false;
+    }
+    xSemaphoreGive(bus_signal);
+    return true;
+}
+
+// The sensors go in before the bus bit, so the LED task never sees motion without them
+static void store_motion(uint32_t sensors, int64_t detected_us)
+{
+    long long latest = atomic_load(&latest_motion_us);
+    while (detected_us > latest &&
+           !atomic_compare_exchange_weak(&latest_motion_us, &latest, detected_us))
+    {
+    }
+    atomic_fetch_or(&motion_sensors, sensors);
+}
+
+void led_handler_post_motion(uint32_t sensors, int64_t detected_us)
+{
+    store_motion(sensors, detected_us);
+    // A burst before the LED task runs folds into one wakeup
+    if (!signal_bus(LED_BUS_MOTION))
+    {
+        atomic_fetch_add(&coalesced_events, 1);
+    }
+}
+
+void led_handler_post_motion_from_isr(uint32_t sensors, int64_t detected_us)
+{
+    BaseType_t task_woken = pdFALSE;
+
+    store_motion(sensors, detected_us);
+    if (atomic_fetch_or(&pending_events, LED_BUS_MOTION) & LED_BUS_MOTION)
+    {
+        atomic_fetch_add(&coalesced_events, 1);
+        return;
+    }
+    xSemaphoreGiveFromISR(bus_signal, &task_woken);
+    portYIELD_FROM_ISR(task_woken);
+}
+
+void led_handler_post_wakeup(uint32_t sensors, int64_t woke_us)
+{
+    BaseType_t task_woken = pdFALSE;
+
+    atomic_store(&latest_wake_us, woke_us);
+    store_motion(sensors, woke_us);
+    if (atomic_fetch_or(&pending_events, LED_BUS_MOTION) & LED_BUS_MOTION)
+    {
+        return;
+    }
+    // The LED task outranks whatever was idle, so it runs as soon as the scheduler resumes
+    xSemaphoreGiveFromISR(bus_signal, &task_woken);
+}
+
+void led_handler_apply_settings(const led_handler_settings_t *new_settings)
+{
+    xSemaphoreTake(settings_mutex, portMAX_DELAY);
+    settings = *new_settings;
+    xSemaphoreGive(settings_mutex);
+    signal_bus(LED_BUS_SETTINGS);
+}
+
+void led_handler_get_settings(led_handler_settings_t *out)
+{
+    xSemaphoreTake(settings_mutex, portMAX_DELAY);
+    *out = settings;
+    xSemaphoreGive(settings_mutex);
+}
+
+const char *led_power_mode_name(led_power_mode_t mode)
+{
+    switch (mode)
+    {
+    case LED_POWER_AUTO:
+        return "auto";
+    case LED_POWER_ON:
+        return "on";
+    case LED_POWER_OFF:
+        return "off";
+    }
+    return "unknown";
+}
+
+const char *led_animation_name(led_animation_t anim)
+{
+    return anim == LED_ANIMATION_FADE ? "fade" : "sweep";
+}
+
+// Brightest first, so the strip as a whole only counts as off when every segment is
+static int state_rank(led_state_t state)
+{
+    switch (state)
+    {
+    case LED_STATE_ON:
+        return 3;
+    case LED_STATE_RAMPING_UP:
+        return 2;
+    case LED_STATE_RAMPING_DOWN:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static led_state_t overall_state(void)
+{
+    led_state_t state = LED_STATE_OFF;
+
+    for (size_t i = 0; i < segment_count; i++)
+    {
+        if (state_rank(segments[i].sm.state) > state_rank(state))
+        {
+            state = segments[i].sm.state;
+        }
+    }
+    return state;
+}
+
+bool led_handler_animating(void) { return atomic_load(&animating); }
+
+void led_handler_get_stats(led_handler_stats_t *stats)
+{
+    stats->state = overall_state();
+    stats->motion_events = atomic_load(&motion_events);
+    stats->retriggers = atomic_load(&retriggers);
+    stats->coalesced_events = atomic_load(&coalesced_events);
+}
+
+void led_handler_write_telemetry(telemetry_writer_t *writer)
+{
+    led_handler_stats_t stats;
+    led_handler_get_stats(&stats);
+
+    telemetry_write_string(writer, "state", led_state_name(stats.state));
+    telemetry_write_uint(writer, "motion_events", stats.motion_events);
+    telemetry_write_uint(writer, "retriggers", stats.retriggers);
+    telemetry_write_uint(writer, "coalesced_events", stats.coalesced_events);
+    telemetry_write_uint(writer, "frames", led_renderers[0].frames_presented);
+    if (segment_count > 1)
+    {
+        telemetry_begin_array(writer, "segments");
+        for (size_t i = 0; i < segment_count; i++)
+        {
+            telemetry_write_string(writer, NULL, led_state_name(segments[i].sm.state));
+        }
+        telemetry_end_array(writer);
+    }
+}
+
+static void flush_channels(int timeout_ms)
+{
+    for (size_t c = 0; c < channel_count; c++)
+    {
+        led_renderer_flush(&led_renderers[c], timeout_ms);
+    }
+}
+
+static esp_err_t set_all_leds_off(void)
+{
+    esp_err_t ret = ESP_OK;
+
+    for (size_t c = 0; c < channel_count; c++)
+    {
+        led_renderer_t *renderer = &led_renderers[c];
+        led_frame_fill(led_renderer_back_buffer(renderer), 0, renderer->led_count, 0);
+        esp_err_t channel_ret = led_renderer_present(renderer);
+        if (channel_ret != ESP_OK)
+        {
+            ret = channel_ret;
+        }
+    }
+    for (size_t i = 0; i < segment_count; i++)
+    {
+        segments[i].dithering = false;
+    }
+    return ret;
+}
+
+bool led_compose_uniform(uint8_t *frame, uint32_t frame_number, size_t first, size_t count,
+                         uint16_t intensity)
+{
+    led_rgb16_t color;
+    led_fade_color(intensity, &color);
+    led_fade_fill(frame, first, count, &color, frame_number);
+    return led_fade_needs_dither(&color);
+}
+
+// The pixels at the leading edge are faded in by the fractional part of the progress, so the
+// sweep stays smooth at any frame rate.
+bool led_compose_center_out(uint8_t *frame, uint32_t frame_number, size_t first, size_t count,
+                            uint16_t progress, uint16_t intensity)
+{
+    uint32_t steps_q16 = (uint32_t)progress * (uint32_t)sweep_steps(count);
+    size_t lit_first, lit_last;
+    led_rgb16_t color, edge_color;
+
+    led_frame_center_span(count, steps_q16 >> 16, &lit_first, &lit_last);
+    led_fade_color(intensity, &color);
+    led_fade_color(led_fade_scale(intensity, steps_q16 & 0xFFFF), &edge_color);
+
+    led_frame_fill(frame, first, count, 0);
+    led_fade_fill(frame, first + lit_first, lit_last - lit_first, &color, frame_number);
+    if (lit_first > 0 && lit_last > lit_first)
+    {
+        led_fade_fill(frame, first + lit_first - 1, 1, &edge_color, frame_number);
+    }
+    if (lit_last < count)
+    {
+        led_fade_fill(frame, first + lit_last, 1, &edge_color, frame_number);
+    }
+    return led_fade_needs_dither(&color) || led_fade_needs_dither(&edge_color);
+}
+
+// Lights the pixels one after the other from the first, or from the last when reversed, with
+// the same soft leading edge as the sweep
+bool led_compose_wipe(uint8_t *frame, uint32_t frame_number, size_t first, size_t count,
+                      bool reversed, uint16_t progress, uint16_t intensity)
+{
+    uint32_t lit_q16 = (uint32_t)progress * (uint32_t)count;
+    size_t lit = lit_q16 >> 16;
+    led_rgb16_t color, edge_color;
+
+    led_fade_color(intensity, &color);
+    led_fade_color(led_fade_scale(intensity, lit_q16 & 0xFFFF), &edge_color);
+
+    led_frame_fill(frame, first, count, 0);
+    if (reversed)
+    {
+        led_fade_fill(frame, first + count - lit, lit, &color, frame_number);
+        if (lit < count)
+        {
+            led_fade_fill(frame, first + count - lit - 1, 1, &edge_color, frame_number);
+        }
+    }
+    else
+    {
+        led_fade_fill(frame, first, lit, &color, frame_number);
+        if (lit < count)
+        {
+            led_fade_fill(frame, first + lit, 1, &edge_color, frame_number);
+        }
+    }
+    return led_fade_needs_dither(&color) || led_fade_needs_dither(&edge_color);
+}
+
+bool light_led_strip_uniform(led_renderer_t *renderer, uint16_t intensity)
+{
+    return led_compose_uniform(led_renderer_back_buffer(renderer), renderer->frames_presented, 0,
+                               renderer->led_count, intensity);
+}
+
+bool light_led_strip_from_center_out(led_renderer_t *renderer, uint16_t progress,
+                                     uint16_t intensity)
+{
+    return led_compose_center_out(led_renderer_back_buffer(renderer),
+                                  renderer->frames_presented, 0, renderer->led_count, progress,
+                                  intensity);
+}
+
+// Sum of the channel values a segment lit at this intensity sends, in 8.8 fixed point
+static uint32_t segment_output(const led_segment_t *segment, uint16_t intensity,
+                               uint16_t lit_fraction)
+{
+    led_rgb16_t color;
+    led_fade_color(intensity, &color);
+
+    uint64_t per_led = (uint32_t)color.r + color.g + color.b;
+    return (uint32_t)((per_led * segment->config.led_count * lit_fraction) /
+                      LED_FADE_INTENSITY_MAX);
+}
+
+static bool segment_needs_frame(const led_segment_t *segment)
+{
+    return led_sm_is_ramping(&segment->sm) || segment->dithering;
+}
+
+static bool strip_animating(void)
+{
+    for (size_t i = 0; i < segment_count; i++)
+    {
+        if (segment_needs_frame(&segments[i]))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void wake_strip(void)
+{
+    if (strip_active)
+    {
+        return;
+    }
+#ifdef CONFIG_PM_ENABLE
+    esp_pm_lock_acquire(animation_lock);
+#endif
+    strip_active = true;
+}
+
+// The WS2812s hold the last frame on their own, so once it is latched nothing needs the
+// outputs or a fast clock until the next change
+static void idle_strip(void)
+{
+    if (!strip_active)
+    {
+        return;
+    }
+    for (size_t c = 0; c < channel_count; c++)
+    {
+        esp_err_t ret = led_renderer_suspend(&led_renderers[c], 100);
+        if (ret != ESP_OK)
+        {
+            BINLOG_E(led_log, "Error suspending channel %u: %s", (unsigned)c,
+                     esp_err_to_name(ret));
+        }
+    }
+#ifdef CONFIG_PM_ENABLE
+    esp_pm_lock_release(animation_lock);
+#endif
+    strip_active = false;
+}
+
+// Composes one segment into its channel's back buffer; returns what it draws
+static uint32_t compose_segment(led_segment_t *segment, int64_t now_us)
+{
+    led_renderer_t *renderer = segment->renderer;
+    uint8_t *frame = led_renderer_back_buffer(renderer);
+    uint32_t frame_number = renderer->frames_presented;
+    size_t first = segment->config.start;
+    size_t count = segment->config.led_count;
+    uint16_t level = led_sm_level(&segment->sm, now_us);
+    led_effect_t effect = segment_effect(segment);
+
+    if (segment->sm.state == LED_STATE_RAMPING_UP && effect == LED_EFFECT_SWEEP)
+    {
+        segment->dithering = led_compose_center_out(frame, frame_number, first, count, level,
+                                                    target_intensity);
+        return segment_output(segment, target_intensity, level);
+    }
+    if (segment->sm.state == LED_STATE_RAMPING_UP && effect == LED_EFFECT_WIPE)
+    {
+        segment->dithering = led_compose_wipe(frame, frame_number, first, count,
+                                              segment->config.reversed, level, target_intensity);
+        return segment_output(segment, target_intensity, level);
+    }
+
+    uint16_t intensity = led_fade_scale(led_fade_ease(level), target_intensity);
+    if (intensity < prelight_intensity)
+    {
+        intensity = prelight_intensity;
+    }
+    if (led_sm_is_ramping(&segment->sm))
+    {
+        segment->dithering = led_compose_uniform(frame, frame_number, first, count, intensity);
+        return segment_output(segment, intensity, LED_FADE_INTENSITY_MAX);
+    }
+
+    // Held at its level, the segment settles to whole values so the strip can idle at any
+    // brightness, including a dim pre-light glow, instead of dithering for hours
+    led_rgb16_t color;
+    led_fade_color(intensity, &color);
+    led_fade_settle(&color);
+    led_fade_fill(frame, first, count, &color, frame_number);
+    segment->dithering = led_fade_needs_dither(&color);
+    return segment_output(segment, intensity, LED_FADE_INTENSITY_MAX);
+}
+
+// Channels that need a new frame get all their segments composed and are then sent out;
+// their transfers run in parallel, so extra channels cost no frame time.
+static void render(int64_t now_us)
+{
+    bool presented = false;
+
+    for (size_t c = 0; c < channel_count; c++)
+    {
+        led_renderer_t *renderer = &led_renderers[c];
+        bool needed = frame_dirty;
+
+        for (size_t i = 0; i < segment_count && !needed; i++)
+        {
+            needed = segments[i].renderer == renderer && segment_needs_frame(&segments[i]);
+        }
+        if (!needed)
+        {
+            continue;
+        }
+
+        channel_outputs[c] = 0;
+        for (size_t i = 0; i < segment_count; i++)
+        {
+            if (segments[i].renderer == renderer)
+            {
+                channel_outputs[c] += compose_segment(&segments[i], now_us);
+            }
+        }
+        esp_err_t ret = led_renderer_present(renderer);
+        if (ret != ESP_OK)
+        {
+            BINLOG_E(led_log, "Error presenting frame on channel %u: %s", (unsigned)c,
+                     esp_err_to_name(ret));
+            return;
+        }
+        presented = true;
+    }
+    if (!presented)
+    {
+        return;
+    }
+    frame_dirty = false;
+
+    uint32_t output = 0;
+    for (size_t c = 0; c < channel_count; c++)
+    {
+        output += channel_outputs[c];
+    }
+    if (output != light_output)
+    {
+        occupancy_set_output(output, now_us);
+        light_output = output;
+    }
+
+    if (trace_pending)
+    {
+        // Wait for this one frame to latch so the refresh stage is measured, not guessed
+        int64_t composed_us = esp_timer_get_time();
+        flush_channels(100);
+        int64_t latched_us = esp_timer_get_time();
+
+        latency_trace_record(LATENCY_STAGE_COMPOSE, trace_dequeued_us, composed_us);
+        latency_trace_record(LATENCY_STAGE_REFRESH, composed_us, latched_us);
+        latency_trace_record(LATENCY_STAGE_TOTAL, trace_detected_us, latched_us);
+        if (trace_woke_us != 0)
+        {
+            latency_trace_record(LATENCY_STAGE_WAKE_TO_LIGHT, trace_woke_us, latched_us);
+        }
+        trace_pending = false;
+    }
 }
 
-void light_led_strip_from_center_out(uint32_t color)
+static TickType_t ticks_until_next_wakeup(int64_t now_us)
 {
-    int center = strip_config.max_leds / 2;
-    for (int i = 0; i <= center; i++)
+    int64_t wake_us = LED_SM_NO_DEADLINE;
+
+    for (size_t i = 0; i < segment_count; i++)
     {
-        if (center + i < strip_config.max_leds)
+        int64_t deadline_us = led_sm_next_deadline(&segments[i].sm);
+        if (deadline_us < wake_us)
         {
-            ESP_ERROR_CHECK(led_strip_set_pixel(led_strip, center + i, (color >> 16) & 0xFF,
-                                                (color >> 8) & 0xFF, color & 0xFF));
+            wake_us = deadline_us;
         }
-        if (center - i >= 0)
+    }
+    if (strip_animating())
+    {
+        int64_t frame_us = now_us + FRAME_PERIOD_US;
+        if (frame_us < wake_us)
         {
-            ESP_ERROR_CHECK(led_strip_set_pixel(led_strip, center - i, (color >> 16) & 0xFF,
-                                                (color >> 8) & 0xFF, color & 0xFF));
+            wake_us = frame_us;
         }
-        ESP_ERROR_CHECK(led_strip_refresh(led_strip));
-        vTaskDelay(pdMS_TO_TICKS(CONFIG_PAUSE_BETWEEN_LEDS_MS)); // Adjust delay for desired speed
     }
+    // A recheck already due waits for a ramp, whose frames wake the task anyway
+    if (presence.recheck_us > now_us && presence.recheck_us < wake_us)
+    {
+        wake_us = presence.recheck_us;
+    }
+    if (wake_us == LED_SM_NO_DEADLINE)
+    {
+        return portMAX_DELAY;
+    }
+    if (wake_us <= now_us)
+    {
+        return 0;
+    }
+    // Round up so we never wake just before the deadline and spin
+    TickType_t ticks = pdMS_TO_TICKS((wake_us - now_us + 999) / 1000);
+    return ticks > 0 ? ticks : 1;
 }
 
-void set_all_leds_off()
+// The pre-light follows the model's decision for the half hour, in auto mode only
+static void refresh_presence(int64_t now_us)
 {
-    for (int i = 0; i < strip_config.max_leds; i++)
+    presence_model_decide(now_us, &presence);
+
+    uint16_t intensity = 0;
+    if (power == LED_POWER_AUTO)
     {
-        ESP_ERROR_CHECK(led_strip_set_pixel(led_strip, i, 0, 0, 0));
+        intensity = (uint16_t)((uint32_t)target_intensity * presence.prelight_percent / 100);
+    }
+    if (intensity != prelight_intensity)
+    {
+        BINLOG_I(led_log, "Pre-light %s, arrival odds %u permille.", intensity ? "on" : "off",
+                 presence.arrival_permille);
+        prelight_intensity = intensity;
+        frame_dirty = true;
+    }
+}
+
+// Motion gets the turn-on pace and shine time the presence model calls for. The ramp time
+// only changes while the segment is not ramping up, so its level never jumps.
+static void adapt_segment(led_segment_t *segment)
+{
+    led_sm_config_t sm_config = segment->sm.config;
+    int64_t base_shine_us = shine_us(segment, shine_ms_setting);
+    int64_t hold_us = (int64_t)presence.hold_ms * 1000;
+
+    if (segment->sm.state == LED_STATE_OFF || segment->sm.state == LED_STATE_RAMPING_DOWN)
+    {
+        segment->prelit = prelight_intensity > 0;
+        sm_config.ramp_up_us = ramp_up_us(segment) * presence.ramp_percent / 100;
+    }
+    sm_config.shine_us = hold_us != 0 && hold_us < base_shine_us ? hold_us : base_shine_us;
+    led_sm_set_config(&segment->sm, &sm_config);
+}
+
+// Only the segments following one of the sensors react. The trace and the presence model
+// learn the motion sensor manager's PIR, the one in the hallway.
+static void handle_motion(uint32_t sensors, int64_t detected_us, int64_t woke_us,
+                          int64_t now_us)
+{
+    bool primary = sensors & LED_MOTION_SENSOR(0);
+    bool changed = false;
+    bool activation = false;
+    bool retrigger = false;
+
+    // The trace is for replaying occupancy, so it keeps motion the lights ignored
+    if (primary)
+    {
+        motion_trace_record(detected_us);
+    }
+    if (power == LED_POWER_OFF)
+    {
+        return;
+    }
+    if (power == LED_POWER_AUTO && primary)
+    {
+        presence_model_motion(overall_state(), now_us);
+    }
+
+    atomic_fetch_add(&motion_events, 1);
+    for (size_t i = 0; i < segment_count; i++)
+    {
+        led_sm_t *sm = &segments[i].sm;
+        led_state_t previous_state = sm->state;
+        uint32_t previous_retriggers = sm->retriggers;
+
+        if (!(sensors & LED_MOTION_SENSOR(segments[i].config.motion_sensor)))
+        {
+            continue;
+        }
+
+        if (power == LED_POWER_AUTO)
+        {
+            adapt_segment(&segments[i]);
+        }
+        changed |= led_sm_motion(sm, now_us);
+        activation |= previous_state == LED_STATE_OFF && sm->state != LED_STATE_OFF;
+        retrigger |= sm->retriggers != previous_retriggers;
+    }
+
+    if (retrigger)
+    {
+        atomic_fetch_add(&retriggers, 1);
+    }
+    occupancy_record_motion(activation, retrigger);
+    if (changed)
+    {
+        BINLOG_I(led_log, "Motion: LED strip %s.", led_state_name(overall_state()));
+        frame_dirty = true;
+        if (!trace_pending)
+        {
+            trace_pending = true;
+            trace_detected_us = detected_us;
+            trace_dequeued_us = now_us;
+            trace_woke_us = 0;
+        }
+    }
+    // The sensor's own event for the same motion may have been handled first
+    if (trace_pending && trace_woke_us == 0)
+    {
+        trace_woke_us = woke_us;
+    }
+}
+
+static void handle_settings(int64_t now_us)
+{
+    led_handler_settings_t next;
+    bool changed = false;
+
+    led_handler_get_settings(&next);
+
+    animation = next.animation;
+    brightness_percent = next.brightness_percent;
+    target_intensity = (uint16_t)((uint32_t)next.brightness_percent * LED_FADE_INTENSITY_MAX / 100);
+    shine_ms_setting = next.shine_ms;
+
+    for (size_t i = 0; i < segment_count; i++)
+    {
+        led_segment_t *segment = &segments[i];
+
+        // Held on or off, the strip turns on with its own effect
+        if (segment->sm.state == LED_STATE_OFF)
+        {
+            segment->prelit = false;
+        }
+
+        // A new shine time applies from the next motion event on
+        led_sm_config_t sm_config = segment->sm.config;
+        sm_config.ramp_up_us = ramp_up_us(segment);
+        sm_config.shine_us = shine_us(segment, next.shine_ms);
+        led_sm_set_config(&segment->sm, &sm_config);
+
+        switch (next.power)
+        {
+        case LED_POWER_ON:
+            changed |= led_sm_hold(&segment->sm, now_us);
+            break;
+        case LED_POWER_OFF:
+            changed |= led_sm_force_off(&segment->sm, now_us);
+            break;
+        case LED_POWER_AUTO:
+            changed |= led_sm_release(&segment->sm, now_us);
+            break;
+        }
+    }
+    power = next.power;
+    // The pre-light depends on the power mode and brightness
+    presence.recheck_us = 0;
+
+    BINLOG_I(led_log, "Settings: power %s, brightness %u%%, shine %" PRIu32 " minutes, %s.",
+             led_power_mode_name(power), brightness_percent, ms_to_minutes(next.shine_ms),
+             led_animation_name(animation));
+    if (changed)
+    {
+        BINLOG_I(led_log, "LED strip %s.", led_state_name(overall_state()));
+    }
+    // Brightness may have changed under a static frame
+    frame_dirty = true;
+}
+
+// Motion from any source seen in one pass over the bus is folded into one event for all the
+// sensors that saw it, stamped with the earliest time it is known to have happened
+static void collect_motion(uint32_t sensors, int64_t detected_us, int64_t woke_us,
+                           int64_t now_us)
+{
+    if (!motion_pending)
+    {
+        motion_pending = true;
+        motion_pending_sensors = 0;
+        motion_detected_us = detected_us;
+        motion_dequeued_us = now_us;
+        motion_woke_us = 0;
+    }
+    else
+    {
+        atomic_fetch_add(&coalesced_events, 1);
+    }
+    motion_pending_sensors |= sensors;
+    if (detected_us < motion_detected_us)
+    {
+        motion_detected_us = detected_us;
+    }
+    if (woke_us != 0)
+    {
+        motion_woke_us = woke_us;
+    }
+}
+
+// A queue set member must be read exactly once per selection
+static void handle_bus_member(QueueSetMemberHandle_t member, int64_t now_us)
+{
+    if (member == motion_queue)
+    {
+        motion_event_t motion_event;
+        if (xQueueReceive(motion_queue, &motion_event, 0) == pdTRUE && motion_event.motion_detected)
+        {
+            // The sensor's events carry no time. If the PIR woke the chip, the power manager's
+            // wakeup is the earliest sign of it; while awake the event is picked up at once.
+            int64_t woke_us = atomic_exchange(&latest_wake_us, 0);
+            collect_motion(LED_MOTION_SENSOR(0), woke_us != 0 ? woke_us : now_us, woke_us,
+                           now_us);
+        }
+    }
+    else if (member == bus_signal)
+    {
+        xSemaphoreTake(bus_signal, 0);
+        uint32_t events = atomic_exchange(&pending_events, 0);
+        // A post racing this pass may have left its sensors here already; then its bus bit
+        // comes round again with none
+        uint32_t sensors = (events & LED_BUS_MOTION) ? atomic_exchange(&motion_sensors, 0) : 0;
+        if (sensors != 0)
+        {
+            collect_motion(sensors, atomic_load(&latest_motion_us),
+                           atomic_exchange(&latest_wake_us, 0), now_us);
+        }
+        if (events & LED_BUS_SETTINGS)
+        {
+            handle_settings(now_us);
+        }
     }
-    ESP_ERROR_CHECK(led_strip_refresh(led_strip));
 }
 
 void led_handling_task(void *pvParameter)
 {
-    uint32_t led_event;
-    bool led_on = false;
+    TickType_t wait = portMAX_DELAY;
 
-    assert(led_state_queue != NULL);
-    led_strip_clear(led_strip);
+    assert(led_bus != NULL);
 
     while (1)
     {
-        if (!led_on) // Only check the queue if the LEDs are off
+        QueueSetMemberHandle_t member = xQueueSelectFromSet(led_bus, wait);
+
+        // Everything already pending is folded into one state update and one frame
+        while (member != NULL)
+        {
+            handle_bus_member(member, esp_timer_get_time());
+            member = xQueueSelectFromSet(led_bus, 0);
+        }
+        if (motion_pending)
+        {
+            // Only a stamp from before the task got the event says how long it took
+            if (motion_detected_us < motion_dequeued_us)
+            {
+                latency_trace_record(LATENCY_STAGE_WAKEUP, motion_detected_us,
+                                     motion_dequeued_us);
+            }
+            handle_motion(motion_pending_sensors, motion_detected_us, motion_woke_us,
+                          motion_dequeued_us);
+            motion_pending = false;
+        }
+
+        int64_t now_us = esp_timer_get_time();
+        bool ramping = false;
+        bool went_dark = false;
+        for (size_t i = 0; i < segment_count; i++)
         {
-            if (xQueueReceive(led_state_queue, &led_event, portMAX_DELAY))
+            if (led_sm_update(&segments[i].sm, now_us))
             {
-                ESP_LOGI(TAG, "Received event: %" PRIu32, led_event);
-                if (led_event)
-                {
-                    led_on = true;
-                    ESP_LOGI(TAG, "Turning on the LED strip.");
-                    // Light the LED strip from center outwards
-                    light_led_strip_from_center_out(BRIGHTNESS);
-
-                    // Delay based on CONFIG_MAX_LED_SHINE_MINUTES
-                    uint32_t shine_duration = CONFIG_MAX_LED_SHINE_MINUTES * 60 * 1000;
-                    uint32_t shine_duration_minutes = ms_to_minutes(shine_duration);
-                    ESP_LOGI(TAG, "LEDs will shine for %" PRIu32 " minutes (%" PRIu32 " milliseconds).",
-                             shine_duration_minutes, shine_duration);
-
-                    vTaskDelay(pdMS_TO_TICKS(shine_duration));
-
-                    ESP_LOGI(TAG, "Turning off the LED strip.");
-
-                    // Set all LEDs to off before clearing
-                    set_all_leds_off();
-                    led_on = false;
-                }
+                BINLOG_I(led_log, "LED segment %u %s.", (unsigned)i,
+                         led_state_name(segments[i].sm.state));
+                frame_dirty = true;
+                went_dark |= segments[i].sm.state == LED_STATE_OFF;
             }
+            ramping |= led_sm_is_ramping(&segments[i].sm);
+        }
+        atomic_store(&animating, ramping);
+        if (went_dark && overall_state() == LED_STATE_OFF)
+        {
+            presence_model_lights_out(now_us);
+        }
+        // Deciding may write to flash, so it waits for the ramp to end
+        if (now_us >= presence.recheck_us && !ramping)
+        {
+            refresh_presence(now_us);
+        }
+        if (frame_dirty || strip_animating())
+        {
+            wake_strip();
+        }
+        render(now_us);
+        if (!frame_dirty && !strip_animating())
+        {
+            idle_strip();
         }
-        vTaskDelay(pdMS_TO_TICKS(1000)); // 1 second delay at the bottom of the loop
+        wait = ticks_until_next_wakeup(now_us);
     }
 }
@@ -1,14 +1,137 @@
 #ifndef LED_HANDLER_H
 #define LED_HANDLER_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "led_renderer.h"
+#include "led_state_machine.h"
+#include "telemetry_writer.h"
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 
-extern QueueHandle_t led_event_queue;
+// Item type of the motion sensor manager's event queue
+typedef struct
+{
+    int motion_detected;
+} motion_event_t;
+
+typedef enum
+{
+    LED_ANIMATION_SWEEP = 0,
+    LED_ANIMATION_FADE,
+} led_animation_t;
+
+typedef enum
+{
+    LED_POWER_AUTO = 0,  // Motion turns the strip on, the shine timer turns it off
+    LED_POWER_ON,        // Held on regardless of motion
+    LED_POWER_OFF,       // Held off regardless of motion
+} led_power_mode_t;
+
+// Settings that can be changed at runtime, e.g. from the device shadow
+typedef struct
+{
+    led_power_mode_t power;
+    uint8_t brightness_percent;  // 1 to 100
+    uint32_t shine_ms;
+    led_animation_t animation;
+} led_handler_settings_t;
+
+#define LED_MAX_CHANNELS 2
+#define LED_MAX_SEGMENTS 4
+// Sensor 0 is the motion sensor manager's PIR; motion posts carry a mask of these bits
+#define LED_MAX_MOTION_SENSORS 2
+#define LED_MOTION_SENSOR(n) (1u << (n))
+
+typedef enum
+{
+    LED_EFFECT_DEFAULT = 0,  // Follows the animation setting
+    LED_EFFECT_SWEEP,        // From the center out
+    LED_EFFECT_WIPE,         // From the first pixel to the last, or back with reversed
+    LED_EFFECT_FADE,
+} led_effect_t;
 
+typedef struct
+{
+    led_state_t state;  // Of the brightest segment; off only when all of them are
+    uint32_t motion_events;
+    uint32_t retriggers;
+    uint32_t coalesced_events;
+} led_handler_stats_t;
+
+// A physical strip on its own output, transmitting in parallel with the others
+typedef struct
+{
+    const led_output_t *output;
+    size_t led_count;  // At most CONFIG_MAX_LED_COUNT
+} led_channel_config_t;
+
+// A run of pixels on one channel with its own state machine, effect and shine time
+typedef struct
+{
+    uint8_t channel;
+    size_t start;
+    size_t led_count;
+    bool reversed;
+    led_effect_t effect;
+    uint32_t shine_ms;  // 0 follows the shine time in the settings
+    uint8_t motion_sensor;  // The only sensor whose motion turns it on
+} led_segment_config_t;
+
+typedef struct
+{
+    led_channel_config_t channels[LED_MAX_CHANNELS];
+    size_t channel_count;
+    // With no segments, each channel is one segment covering all of it
+    led_segment_config_t segments[LED_MAX_SEGMENTS];
+    size_t segment_count;
+    uint32_t shine_ms;
+    uint32_t fade_out_ms;
+} led_handler_config_t;
+
+// Drives the channels and segments set up in Kconfig
 void init_led_handler();
+// Same, with any output backends; used by the host benchmarks
+void led_handler_start(const led_handler_config_t *config);
 void led_handling_task(void *pvParameter);
-QueueHandle_t get_led_state_queue(void);
+
+// Frame composition into the renderer's back buffer. All return true when the frame carries
+// fractional brightness and must be re-sent every frame to be dithered.
+bool light_led_strip_uniform(led_renderer_t *renderer, uint16_t intensity);
+bool light_led_strip_from_center_out(led_renderer_t *renderer, uint16_t progress,
+                                     uint16_t intensity);
+// The same for pixels [first, first + count) of a frame
+bool led_compose_uniform(uint8_t *frame, uint32_t frame_number, size_t first, size_t count,
+                         uint16_t intensity);
+bool led_compose_center_out(uint8_t *frame, uint32_t frame_number, size_t first, size_t count,
+                            uint16_t progress, uint16_t intensity);
+bool led_compose_wipe(uint8_t *frame, uint32_t frame_number, size_t first, size_t count,
+                      bool reversed, uint16_t progress, uint16_t intensity);
+
+// Lets the LED task read the motion sensor's queue directly, with no relay in between
+bool led_handler_attach_motion_queue(QueueHandle_t queue);
+// Motion from any other source, seen by the sensors in the mask. Never blocks; posts that
+// arrive before the LED task has run are merged into one.
+void led_handler_post_motion(uint32_t sensors, int64_t detected_us);
+// The same from an interrupt handler
+void led_handler_post_motion_from_isr(uint32_t sensors, int64_t detected_us);
+// Motion that woke the chip from light sleep. Safe from interrupts and sleep callbacks; the
+// time from woke_us to the first lit frame is traced as wake-to-light latency.
+void led_handler_post_wakeup(uint32_t sensors, int64_t woke_us);
+// Takes effect on the LED task's next wakeup. Settings applied in between replace each other.
+void led_handler_apply_settings(const led_handler_settings_t *settings);
+void led_handler_get_settings(led_handler_settings_t *settings);
+const char *led_power_mode_name(led_power_mode_t power);
+const char *led_animation_name(led_animation_t animation);
+
+// True while a turn-on or turn-off animation runs. Flash writes stall the LED task, so
+// background work that writes to flash waits for this to clear.
+bool led_handler_animating(void);
+void led_handler_get_stats(led_handler_stats_t *stats);
+void led_handler_write_telemetry(telemetry_writer_t *writer);
 
 #define LED_ON 1
 
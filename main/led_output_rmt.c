@@ -0,0 +1,173 @@
+#include "led_output_rmt.h"
+
+#include <stdlib.h>
+
+#include "driver/rmt_encoder.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "LED_OUTPUT_RMT";
+
+#define RMT_RESOLUTION_HZ (10 * 1000 * 1000)  // 10MHz, 0.1us per tick
+#define RMT_TICKS(ns) ((ns) / 100)
+#define WS2812_RESET_US 280
+
+#define RMT_DMA_MEM_BLOCK_SYMBOLS 1024
+#define RMT_MEM_BLOCK_SYMBOLS 64
+
+// Pixel bytes followed by the low reset pulse that latches the frame
+typedef struct {
+    rmt_encoder_t base;
+    rmt_encoder_t *bytes_encoder;
+    rmt_encoder_t *copy_encoder;
+    int state;
+    rmt_symbol_word_t reset_code;
+} ws2812_encoder_t;
+
+static size_t ws2812_encode(rmt_encoder_t *encoder, rmt_channel_handle_t channel,
+                            const void *primary_data, size_t data_size,
+                            rmt_encode_state_t *ret_state) {
+    ws2812_encoder_t *ws2812 = __containerof(encoder, ws2812_encoder_t, base);
+    rmt_encode_state_t session_state = RMT_ENCODING_RESET;
+    rmt_encode_state_t state = RMT_ENCODING_RESET;
+    size_t encoded_symbols = 0;
+
+    switch (ws2812->state) {
+        case 0:
+            encoded_symbols += ws2812->bytes_encoder->encode(ws2812->bytes_encoder, channel,
+                                                             primary_data, data_size,
+                                                             &session_state);
+            if (session_state & RMT_ENCODING_COMPLETE) {
+                ws2812->state = 1;
+            }
+            if (session_state & RMT_ENCODING_MEM_FULL) {
+                state |= RMT_ENCODING_MEM_FULL;
+                goto out;
+            }
+        // fall-through
+        case 1:
+            encoded_symbols += ws2812->copy_encoder->encode(ws2812->copy_encoder, channel,
+                                                            &ws2812->reset_code,
+                                                            sizeof(ws2812->reset_code),
+                                                            &session_state);
+            if (session_state & RMT_ENCODING_COMPLETE) {
+                ws2812->state = RMT_ENCODING_RESET;
+                state |= RMT_ENCODING_COMPLETE;
+            }
+            if (session_state & RMT_ENCODING_MEM_FULL) {
+                state |= RMT_ENCODING_MEM_FULL;
+                goto out;
+            }
+    }
+out:
+    *ret_state = state;
+    return encoded_symbols;
+}
+
+static esp_err_t ws2812_del(rmt_encoder_t *encoder) {
+    ws2812_encoder_t *ws2812 = __containerof(encoder, ws2812_encoder_t, base);
+    rmt_del_encoder(ws2812->bytes_encoder);
+    rmt_del_encoder(ws2812->copy_encoder);
+    free(ws2812);
+    return ESP_OK;
+}
+
+static esp_err_t ws2812_reset(rmt_encoder_t *encoder) {
+    ws2812_encoder_t *ws2812 = __containerof(encoder, ws2812_encoder_t, base);
+    rmt_encoder_reset(ws2812->bytes_encoder);
+    rmt_encoder_reset(ws2812->copy_encoder);
+    ws2812->state = RMT_ENCODING_RESET;
+    return ESP_OK;
+}
+
+static esp_err_t new_ws2812_encoder(rmt_encoder_handle_t *ret_encoder) {
+    esp_err_t ret = ESP_OK;
+    ws2812_encoder_t *ws2812 = calloc(1, sizeof(ws2812_encoder_t));
+    ESP_RETURN_ON_FALSE(ws2812, ESP_ERR_NO_MEM, TAG, "no mem for ws2812 encoder");
+
+    ws2812->base.encode = ws2812_encode;
+    ws2812->base.del = ws2812_del;
+    ws2812->base.reset = ws2812_reset;
+
+    rmt_bytes_encoder_config_t bytes_encoder_config = {
+        .bit0 = {.level0 = 1, .duration0 = RMT_TICKS(300), .level1 = 0,
+                 .duration1 = RMT_TICKS(900)},
+        .bit1 = {.level0 = 1, .duration0 = RMT_TICKS(900), .level1 = 0,
+                 .duration1 = RMT_TICKS(300)},
+        .flags.msb_first = 1,
+    };
+    ESP_GOTO_ON_ERROR(rmt_new_bytes_encoder(&bytes_encoder_config, &ws2812->bytes_encoder), err,
+                      TAG, "create bytes encoder failed");
+
+    rmt_copy_encoder_config_t copy_encoder_config = {};
+    ESP_GOTO_ON_ERROR(rmt_new_copy_encoder(&copy_encoder_config, &ws2812->copy_encoder), err, TAG,
+                      "create copy encoder failed");
+
+    uint32_t reset_ticks = RMT_RESOLUTION_HZ / 1000000 * WS2812_RESET_US / 2;
+    ws2812->reset_code = (rmt_symbol_word_t){
+        .level0 = 0,
+        .duration0 = reset_ticks,
+        .level1 = 0,
+        .duration1 = reset_ticks,
+    };
+    *ret_encoder = &ws2812->base;
+    return ESP_OK;
+
+err:
+    if (ws2812->bytes_encoder) {
+        rmt_del_encoder(ws2812->bytes_encoder);
+    }
+    if (ws2812->copy_encoder) {
+        rmt_del_encoder(ws2812->copy_encoder);
+    }
+    free(ws2812);
+    return ret;
+}
+
+static esp_err_t rmt_output_transmit(void *ctx, const uint8_t *frame, size_t len) {
+    led_output_rmt_t *rmt = ctx;
+    rmt_transmit_config_t tx_config = {.loop_count = 0};
+    return rmt_transmit(rmt->channel, rmt->encoder, frame, len, &tx_config);
+}
+
+static esp_err_t rmt_output_wait_done(void *ctx, int timeout_ms) {
+    led_output_rmt_t *rmt = ctx;
+    return rmt_tx_wait_all_done(rmt->channel, timeout_ms);
+}
+
+// An enabled channel holds a power management lock, so it is only enabled while sending
+static esp_err_t rmt_output_set_enabled(void *ctx, bool enabled) {
+    led_output_rmt_t *rmt = ctx;
+    return enabled ? rmt_enable(rmt->channel) : rmt_disable(rmt->channel);
+}
+
+esp_err_t led_output_rmt_init(led_output_rmt_t *rmt, int gpio_num, bool use_dma) {
+    rmt_tx_channel_config_t channel_config = {
+        .gpio_num = gpio_num,
+        .clk_src = RMT_CLK_SRC_DEFAULT,
+        .resolution_hz = RMT_RESOLUTION_HZ,
+        .mem_block_symbols = RMT_MEM_BLOCK_SYMBOLS,
+        .trans_queue_depth = 2,  // One frame on the wire, one queued behind it
+    };
+#ifdef CONFIG_LED_RMT_WITH_DMA
+    if (use_dma) {
+        channel_config.mem_block_symbols = RMT_DMA_MEM_BLOCK_SYMBOLS;
+        channel_config.flags.with_dma = true;
+    }
+#endif
+    ESP_RETURN_ON_ERROR(rmt_new_tx_channel(&channel_config, &rmt->channel), TAG,
+                        "create RMT TX channel failed");
+    ESP_RETURN_ON_ERROR(new_ws2812_encoder(&rmt->encoder), TAG, "create encoder failed");
+    ESP_RETURN_ON_ERROR(rmt_enable(rmt->channel), TAG, "enable RMT channel failed");
+
+    rmt->output = (led_output_t){
+        .transmit = rmt_output_transmit,
+        .wait_done = rmt_output_wait_done,
+        .set_enabled = rmt_output_set_enabled,
+        .ctx = rmt,
+    };
+    ESP_LOGI(TAG, "WS2812 output on GPIO %d (%s)", gpio_num,
+             channel_config.flags.with_dma ? "DMA" : "RMT memory");
+    return ESP_OK;
+}
@@ -0,0 +1,17 @@
+#ifndef LED_OUTPUT_RMT_H
+#define LED_OUTPUT_RMT_H
+
+#include "driver/rmt_tx.h"
+#include "led_renderer.h"
+
+typedef struct {
+    rmt_channel_handle_t channel;
+    rmt_encoder_handle_t encoder;
+    led_output_t output;
+} led_output_rmt_t;
+
+// WS2812 output on one RMT TX channel. With use_dma, and where the chip supports it, a whole
+// frame is sent as a single transaction. Chips have one RMT DMA channel at most.
+esp_err_t led_output_rmt_init(led_output_rmt_t *rmt, int gpio_num, bool use_dma);
+
+#endif  // LED_OUTPUT_RMT_H
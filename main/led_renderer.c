@@ -0,0 +1,107 @@
+#include "led_renderer.h"
+
+#include <string.h>
+
+#define LED_RENDERER_WAIT_MS 100
+
+void led_renderer_init(led_renderer_t *renderer, const led_output_t *output, size_t led_count,
+                       uint8_t *frame0, uint8_t *frame1) {
+    renderer->frames[0] = frame0;
+    renderer->frames[1] = frame1;
+    renderer->led_count = led_count;
+    renderer->back = 0;
+    renderer->in_flight = false;
+    renderer->suspended = false;
+    renderer->output = output;
+    renderer->frames_presented = 0;
+    memset(frame0, 0, LED_FRAME_BYTES(led_count));
+    memset(frame1, 0, LED_FRAME_BYTES(led_count));
+}
+
+uint8_t *led_renderer_back_buffer(led_renderer_t *renderer) {
+    return renderer->frames[renderer->back];
+}
+
+esp_err_t led_renderer_flush(led_renderer_t *renderer, int timeout_ms) {
+    if (!renderer->in_flight) {
+        return ESP_OK;
+    }
+    esp_err_t ret = renderer->output->wait_done(renderer->output->ctx, timeout_ms);
+    if (ret == ESP_OK) {
+        renderer->in_flight = false;
+    }
+    return ret;
+}
+
+esp_err_t led_renderer_suspend(led_renderer_t *renderer, int timeout_ms) {
+    if (renderer->suspended || renderer->output->set_enabled == NULL) {
+        return ESP_OK;
+    }
+    esp_err_t ret = led_renderer_flush(renderer, timeout_ms);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = renderer->output->set_enabled(renderer->output->ctx, false);
+    if (ret == ESP_OK) {
+        renderer->suspended = true;
+    }
+    return ret;
+}
+
+esp_err_t led_renderer_present(led_renderer_t *renderer) {
+    // The front buffer may still be on the wire; the back buffer is free to hand over
+    esp_err_t ret = led_renderer_flush(renderer, LED_RENDERER_WAIT_MS);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (renderer->suspended) {
+        ret = renderer->output->set_enabled(renderer->output->ctx, true);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        renderer->suspended = false;
+    }
+    ret = renderer->output->transmit(renderer->output->ctx, renderer->frames[renderer->back],
+                                     LED_FRAME_BYTES(renderer->led_count));
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    renderer->in_flight = true;
+    renderer->frames_presented++;
+    renderer->back ^= 1;
+    return ESP_OK;
+}
+
+void led_frame_fill(uint8_t *frame, size_t first, size_t count, uint32_t rgb) {
+    uint8_t *dst = frame + LED_FRAME_BYTES(first);
+    size_t len = LED_FRAME_BYTES(count);
+
+    if (count == 0) {
+        return;
+    }
+    if (rgb == 0) {
+        memset(dst, 0, len);
+        return;
+    }
+    dst[0] = (rgb >> 8) & 0xFF;   // G
+    dst[1] = (rgb >> 16) & 0xFF;  // R
+    dst[2] = rgb & 0xFF;          // B
+
+    // Double the filled prefix until the span is covered
+    for (size_t done = LED_BYTES_PER_PIXEL; done < len;) {
+        size_t chunk = done < len - done ? done : len - done;
+        memcpy(dst + done, dst, chunk);
+        done += chunk;
+    }
+}
+
+void led_frame_center_span(size_t led_count, size_t steps, size_t *first, size_t *last) {
+    size_t center = led_count / 2;
+
+    if (steps == 0) {
+        *first = *last = center;
+        return;
+    }
+    *first = steps - 1 < center ? center - (steps - 1) : 0;
+    *last = center + steps < led_count ? center + steps : led_count;
+}
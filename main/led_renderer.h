@@ -0,0 +1,53 @@
+#ifndef LED_RENDERER_H
+#define LED_RENDERER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// Frames are composed as GRB bytes in wire order, so a whole frame goes out in one transfer.
+#define LED_BYTES_PER_PIXEL 3
+#define LED_FRAME_BYTES(led_count) ((led_count) * LED_BYTES_PER_PIXEL)
+
+// Output backend. transmit() may return before the data is on the wire, but must be done
+// with the buffer by the time wait_done() returns. set_enabled() is optional; a disabled
+// output releases whatever keeps the chip out of light sleep.
+typedef struct {
+    esp_err_t (*transmit)(void *ctx, const uint8_t *frame, size_t len);
+    esp_err_t (*wait_done)(void *ctx, int timeout_ms);
+    esp_err_t (*set_enabled)(void *ctx, bool enabled);
+    void *ctx;
+} led_output_t;
+
+typedef struct {
+    uint8_t *frames[2];
+    size_t led_count;
+    int back;  // Index of the frame being composed
+    bool in_flight;
+    bool suspended;
+    const led_output_t *output;
+    uint32_t frames_presented;
+} led_renderer_t;
+
+// Buffers are supplied by the caller and must each hold LED_FRAME_BYTES(led_count) bytes.
+void led_renderer_init(led_renderer_t *renderer, const led_output_t *output, size_t led_count,
+                       uint8_t *frame0, uint8_t *frame1);
+
+uint8_t *led_renderer_back_buffer(led_renderer_t *renderer);
+
+// Waits for the previous frame, starts sending the back buffer and swaps buffers.
+esp_err_t led_renderer_present(led_renderer_t *renderer);
+esp_err_t led_renderer_flush(led_renderer_t *renderer, int timeout_ms);
+// Waits for the last frame and disables the output until the next present(). The strip keeps
+// showing the last frame.
+esp_err_t led_renderer_suspend(led_renderer_t *renderer, int timeout_ms);
+
+// Compose helpers; colors are 0xRRGGBB.
+void led_frame_fill(uint8_t *frame, size_t first, size_t count, uint32_t rgb);
+
+// Pixels [first, last) lit after the given number of steps of a sweep from the center out
+void led_frame_center_span(size_t led_count, size_t steps, size_t *first, size_t *last);
+
+#endif  // LED_RENDERER_H
@@ -0,0 +1,172 @@
+#include "led_state_machine.h"
+
+#include <stddef.h>
+
+static uint16_t ramp_level(int64_t elapsed_us, int64_t duration_us) {
+    if (duration_us <= 0 || elapsed_us >= duration_us) {
+        return LED_SM_LEVEL_MAX;
+    }
+    if (elapsed_us <= 0) {
+        return 0;
+    }
+    return (uint16_t)((elapsed_us * LED_SM_LEVEL_MAX) / duration_us);
+}
+
+static void enter_state(led_sm_t *sm, led_state_t state, int64_t since_us) {
+    sm->state = state;
+    sm->state_since_us = since_us;
+}
+
+void led_sm_init(led_sm_t *sm, const led_sm_config_t *config) {
+    sm->config = *config;
+    sm->state = LED_STATE_OFF;
+    sm->state_since_us = 0;
+    sm->off_deadline_us = LED_SM_NO_DEADLINE;
+    sm->motion_events = 0;
+    sm->retriggers = 0;
+}
+
+void led_sm_set_config(led_sm_t *sm, const led_sm_config_t *config) { sm->config = *config; }
+
+// Starts a ramp up from whatever level the lights are at now
+static void ramp_up_from(led_sm_t *sm, uint16_t level, int64_t now_us) {
+    int64_t done_us = (sm->config.ramp_up_us * level) / LED_SM_LEVEL_MAX;
+    enter_state(sm, LED_STATE_RAMPING_UP, now_us - done_us);
+}
+
+bool led_sm_motion(led_sm_t *sm, int64_t now_us) {
+    sm->motion_events++;
+
+    switch (sm->state) {
+        case LED_STATE_OFF:
+            enter_state(sm, LED_STATE_RAMPING_UP, now_us);
+            sm->off_deadline_us = now_us + sm->config.ramp_up_us + sm->config.shine_us;
+            return true;
+
+        case LED_STATE_RAMPING_UP:
+        case LED_STATE_ON:
+            sm->retriggers++;
+            if (now_us + sm->config.shine_us > sm->off_deadline_us) {
+                sm->off_deadline_us = now_us + sm->config.shine_us;
+            }
+            return false;
+
+        case LED_STATE_RAMPING_DOWN: {
+            // Reverse from the current level rather than restarting the ramp from dark
+            sm->retriggers++;
+            ramp_up_from(sm, led_sm_level(sm, now_us), now_us);
+            sm->off_deadline_us = sm->state_since_us + sm->config.ramp_up_us + sm->config.shine_us;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool led_sm_hold(led_sm_t *sm, int64_t now_us) {
+    bool changed = sm->state == LED_STATE_OFF || sm->state == LED_STATE_RAMPING_DOWN;
+
+    if (changed) {
+        ramp_up_from(sm, led_sm_level(sm, now_us), now_us);
+    }
+    // Motion only ever pushes the deadline later, so it cannot end the hold
+    sm->off_deadline_us = LED_SM_NO_DEADLINE;
+    return changed;
+}
+
+bool led_sm_release(led_sm_t *sm, int64_t now_us) {
+    if (sm->off_deadline_us != LED_SM_NO_DEADLINE || sm->state == LED_STATE_OFF ||
+        sm->state == LED_STATE_RAMPING_DOWN) {
+        return false;
+    }
+    // Shine time counts from the end of the ramp, as it does for motion
+    int64_t from_us = sm->state == LED_STATE_RAMPING_UP ? led_sm_next_deadline(sm) : now_us;
+    sm->off_deadline_us = from_us + sm->config.shine_us;
+    return false;
+}
+
+bool led_sm_force_off(led_sm_t *sm, int64_t now_us) {
+    if (sm->state == LED_STATE_OFF || sm->state == LED_STATE_RAMPING_DOWN) {
+        return false;
+    }
+    // Mirror the current level onto the fade-out so there is no jump
+    uint16_t level = led_sm_level(sm, now_us);
+    int64_t done_us = (sm->config.ramp_down_us * (LED_SM_LEVEL_MAX - level)) / LED_SM_LEVEL_MAX;
+    enter_state(sm, LED_STATE_RAMPING_DOWN, now_us - done_us);
+    sm->off_deadline_us = LED_SM_NO_DEADLINE;
+    return true;
+}
+
+bool led_sm_update(led_sm_t *sm, int64_t now_us) {
+    bool changed = false;
+
+    // Several transitions may be due at once when the caller wakes late
+    for (;;) {
+        int64_t deadline = led_sm_next_deadline(sm);
+        if (deadline == LED_SM_NO_DEADLINE || now_us < deadline) {
+            return changed;
+        }
+        switch (sm->state) {
+            case LED_STATE_RAMPING_UP:
+                enter_state(sm, LED_STATE_ON, deadline);
+                break;
+            case LED_STATE_ON:
+                enter_state(sm, LED_STATE_RAMPING_DOWN, deadline);
+                break;
+            case LED_STATE_RAMPING_DOWN:
+                enter_state(sm, LED_STATE_OFF, deadline);
+                sm->off_deadline_us = LED_SM_NO_DEADLINE;
+                break;
+            case LED_STATE_OFF:
+                return changed;
+        }
+        changed = true;
+    }
+}
+
+uint16_t led_sm_level(const led_sm_t *sm, int64_t now_us) {
+    int64_t elapsed_us = now_us - sm->state_since_us;
+
+    switch (sm->state) {
+        case LED_STATE_RAMPING_UP:
+            return ramp_level(elapsed_us, sm->config.ramp_up_us);
+        case LED_STATE_ON:
+            return LED_SM_LEVEL_MAX;
+        case LED_STATE_RAMPING_DOWN:
+            return LED_SM_LEVEL_MAX - ramp_level(elapsed_us, sm->config.ramp_down_us);
+        case LED_STATE_OFF:
+        default:
+            return 0;
+    }
+}
+
+int64_t led_sm_next_deadline(const led_sm_t *sm) {
+    switch (sm->state) {
+        case LED_STATE_RAMPING_UP:
+            return sm->state_since_us + sm->config.ramp_up_us;
+        case LED_STATE_ON:
+            return sm->off_deadline_us;
+        case LED_STATE_RAMPING_DOWN:
+            return sm->state_since_us + sm->config.ramp_down_us;
+        case LED_STATE_OFF:
+        default:
+            return LED_SM_NO_DEADLINE;
+    }
+}
+
+bool led_sm_is_ramping(const led_sm_t *sm) {
+    return sm->state == LED_STATE_RAMPING_UP || sm->state == LED_STATE_RAMPING_DOWN;
+}
+
+const char *led_state_name(led_state_t state) {
+    switch (state) {
+        case LED_STATE_OFF:
+            return "off";
+        case LED_STATE_RAMPING_UP:
+            return "ramping_up";
+        case LED_STATE_ON:
+            return "on";
+        case LED_STATE_RAMPING_DOWN:
+            return "ramping_down";
+    }
+    return "unknown";
+}
@@ -0,0 +1,58 @@
+#ifndef LED_STATE_MACHINE_H
+#define LED_STATE_MACHINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Lighting state logic with no FreeRTOS or driver dependencies. Time is passed in by the
+// caller so the same code runs on the device and on the linux host target.
+
+#define LED_SM_LEVEL_MAX 0xFFFFu
+#define LED_SM_NO_DEADLINE INT64_MAX
+
+typedef enum {
+    LED_STATE_OFF = 0,
+    LED_STATE_RAMPING_UP,
+    LED_STATE_ON,
+    LED_STATE_RAMPING_DOWN,
+} led_state_t;
+
+typedef struct {
+    int64_t ramp_up_us;
+    int64_t shine_us;
+    int64_t ramp_down_us;
+} led_sm_config_t;
+
+typedef struct {
+    led_sm_config_t config;
+    led_state_t state;
+    int64_t state_since_us;   // Start of the current state, or of the current ramp
+    int64_t off_deadline_us;  // When ON gives way to RAMPING_DOWN; pushed out by motion
+    uint32_t motion_events;
+    uint32_t retriggers;
+} led_sm_t;
+
+void led_sm_init(led_sm_t *sm, const led_sm_config_t *config);
+void led_sm_set_config(led_sm_t *sm, const led_sm_config_t *config);
+
+// Both return true when the state changed.
+bool led_sm_motion(led_sm_t *sm, int64_t now_us);
+bool led_sm_update(led_sm_t *sm, int64_t now_us);
+
+// Output level between 0 (off) and LED_SM_LEVEL_MAX (fully on) at the given time.
+uint16_t led_sm_level(const led_sm_t *sm, int64_t now_us);
+
+// Manual overrides. led_sm_hold() brings the lights up and keeps them on with no deadline;
+// led_sm_release() starts the normal shine timer from now; led_sm_force_off() fades the
+// lights out from their current level. All return true when the state changed.
+bool led_sm_hold(led_sm_t *sm, int64_t now_us);
+bool led_sm_release(led_sm_t *sm, int64_t now_us);
+bool led_sm_force_off(led_sm_t *sm, int64_t now_us);
+
+// Absolute time of the next timed transition, or LED_SM_NO_DEADLINE when idle.
+int64_t led_sm_next_deadline(const led_sm_t *sm);
+
+bool led_sm_is_ramping(const led_sm_t *sm);
+const char *led_state_name(led_state_t state);
+
+#endif  // LED_STATE_MACHINE_H
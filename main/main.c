@@ -1,9 +1,13 @@
-#include "cJSON.h"
-#include "driver/rmt_rx.h"
-#include "driver/rmt_tx.h"
-#include "esp_https_ota.h"
+#include <string.h>
+
+#include "binlog.h"
+#include "boot_sequencer.h"
+#include "connection_supervisor.h"
+#include "device_shadow.h"
+#include "device_telemetry.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_task_wdt.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
@@ -13,97 +17,154 @@
 #include "gecl-logger-manager.h"
 #include "gecl-misc-util-manager.h"
 #include "gecl-motion-sensor-manager.h"
-#include "gecl-mqtt-manager.h"
-#include "gecl-ota-manager.h"
-#include "gecl-telemetry-manager.h"
 #include "gecl-time-sync-manager.h"
 #include "gecl-versioning-manager.h"
 #include "gecl-wifi-manager.h"
+#include "latency_trace.h"
 #include "led_handler.h"
-#include "led_strip.h"
+#include "mem_profiler.h"
+#include "motion_trace.h"
+#include "mqtt_dispatch.h"
+#include "mqtt_outbox.h"
+#include "mqtt_session.h"
 #include "nvs_flash.h"
+#include "occupancy.h"
+#include "ota_pipeline.h"
+#include "pir_input.h"
+#include "power_manager.h"
+#include "presence_model.h"
 #include "sdkconfig.h"
 
 static const char *TAG = "MAIN";
+
+// esp-mqtt only exposes its task's stack size with a custom configuration
+#ifdef CONFIG_MQTT_TASK_STACK_SIZE
+#define MQTT_TASK_STACK_SIZE CONFIG_MQTT_TASK_STACK_SIZE
+#else
+#define MQTT_TASK_STACK_SIZE 6144
+#endif
+// For the MQTT event handlers, which run on every event
+BINLOG_TAG(mqtt_log, "MAIN");
 const char *device_name = CONFIG_WIFI_HOSTNAME;
 
-TaskHandle_t ota_handler_task_handle = NULL;
+// Long-lived tasks and queues are allocated up front so they never fragment the heap
+static StaticTask_t logger_task_buffer;
+static StackType_t logger_task_stack[CONFIG_LOGGER_TASK_STACK_SIZE];
+static StaticQueue_t log_queue_buffer;
+static uint8_t log_queue_storage[CONFIG_LOGGER_QUEUE_LENGTH * sizeof(log_message_t)];
 
+extern const uint8_t AmazonRootCA1_pem[];
 extern const uint8_t home_hallway_bathroom_lights_certificate_pem[];
 extern const uint8_t home_hallway_bathroom_lights_private_pem_key[];
 
-#define QUEUE_SIZE 10
-typedef struct {
-    int motion_detected;
-} motion_event_t;
+void custom_handle_mqtt_event_connected(esp_mqtt_event_handle_t event) {
+    esp_mqtt_client_handle_t client = event->client;
+    BINLOG_I(mqtt_log, "Custom handler: MQTT_EVENT_CONNECTED");
 
-typedef struct {
-    int led_action;
-} led_event_t;
+    connection_supervisor_connected(event);
+    mqtt_dispatch_connected(client, event->session_present);
+    device_shadow_connected(client);
+}
 
-typedef struct {
-    QueueHandle_t motion_queue;
-    QueueHandle_t led_queue;
-} motion_led_params_t;
+void custom_handle_mqtt_event_disconnected(esp_mqtt_event_handle_t event) {
+    BINLOG_I(mqtt_log, "Custom handler: MQTT_EVENT_DISCONNECTED");
+    // The reconnect stops this task, taking its stack high water mark with it
+    mem_profiler_sample_current_task();
+    mqtt_dispatch_disconnected();
+    connection_supervisor_disconnected(event);
+}
 
-void custom_handle_mqtt_event_connected(esp_mqtt_event_handle_t event) {
-    esp_mqtt_client_handle_t client = event->client;
-    ESP_LOGI(TAG, "Custom handler: MQTT_EVENT_CONNECTED");
+void custom_handle_mqtt_event_data(esp_mqtt_event_handle_t event) { mqtt_dispatch_data(event); }
 
-    ESP_LOGI(TAG, "Subscribing to topic %s", CONFIG_MQTT_SUBSCRIBE_OTA_UPDATE_TOPIC);
-    esp_mqtt_client_subscribe(client, CONFIG_MQTT_SUBSCRIBE_OTA_UPDATE_TOPIC, 0);
+void custom_handle_mqtt_event_subscribed(esp_mqtt_event_handle_t event) {
+    mqtt_dispatch_subscribed(event);
+}
 
-    ESP_LOGI(TAG, "Subscribing to topic %s", CONFIG_MQTT_SUBSCRIBE_TELEMETRY_REQUEST_TOPIC);
-    esp_mqtt_client_subscribe(client, CONFIG_MQTT_SUBSCRIBE_TELEMETRY_REQUEST_TOPIC, 0);
+// The payload is the image URL, or empty for CONFIG_OTA_FIRMWARE_URL. A URL is far shorter
+// than the MQTT buffer, so a request that arrives in fragments is not one.
+static void handle_ota_update_request(const mqtt_chunk_t *chunk, void *ctx) {
+    if (!mqtt_chunk_is_last(chunk)) {
+        return;
+    }
+    BINLOG_I(mqtt_log, "Received topic %s", CONFIG_MQTT_SUBSCRIBE_OTA_UPDATE_TOPIC);
+    if (!mqtt_chunk_is_first(chunk)) {
+        ESP_LOGW(TAG, "OTA request of %u bytes is too long, skipping", (unsigned)chunk->total);
+        return;
+    }
+    ota_pipeline_request(chunk->data, chunk->len);
 }
 
-void custom_handle_mqtt_event_disconnected(esp_mqtt_event_handle_t event) {
-    ESP_LOGI(TAG, "Custom handler: MQTT_EVENT_DISCONNECTED");
-}
-
-void custom_handle_mqtt_event_data(esp_mqtt_event_handle_t event) {
-    ESP_LOGI(TAG, "Custom handler: MQTT_EVENT_DATA");
-    if (strncmp(event->topic, CONFIG_MQTT_SUBSCRIBE_OTA_UPDATE_TOPIC, event->topic_len) == 0) {
-        ESP_LOGI(TAG, "Received topic %s", CONFIG_MQTT_SUBSCRIBE_OTA_UPDATE_TOPIC);
-        if (ota_handler_task_handle != NULL) {
-            eTaskState task_state = eTaskGetState(ota_handler_task_handle);
-            if (task_state != eDeleted) {
-                ESP_LOGW(TAG,
-                         "OTA task is already running or not yet cleaned up, skipping OTA update");
-                return;
-            }
-            // Clean up task handle if it has been deleted
-            ota_handler_task_handle = NULL;
-        }
-        xTaskCreate(&ota_handler_task, "ota_handler_task", 8192, event, 5,
-                    &ota_handler_task_handle);
+static void handle_telemetry_request(const mqtt_chunk_t *chunk, void *ctx) {
+    if (mqtt_chunk_is_last(chunk)) {
+        device_telemetry_publish_now();
     }
 }
 
-void custom_handle_mqtt_event_error(esp_mqtt_event_handle_t event) {
-    ESP_LOGI(TAG, "Custom handler: MQTT_EVENT_ERROR");
-    if (event->error_handle->error_type == MQTT_ERROR_TYPE_ESP_TLS) {
-        ESP_LOGI(TAG, "Last ESP error code: 0x%x", event->error_handle->esp_tls_last_esp_err);
-        ESP_LOGI(TAG, "Last TLS stack error code: 0x%x", event->error_handle->esp_tls_stack_err);
-        ESP_LOGI(TAG, "Last TLS library error code: 0x%x",
-                 event->error_handle->esp_tls_cert_verify_flags);
-    } else if (event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
-        ESP_LOGI(TAG, "Connection refused error: 0x%x", event->error_handle->connect_return_code);
+_Static_assert(MOTION_TRACE_PAGE_BYTES <= MQTT_OUTBOX_MAX_MESSAGE,
+               "A motion trace page must fit in an outbox batch");
+
+// Upload in progress; written here only while trace_upload_timer is stopped, then owned by
+// the esp_timer task
+static esp_timer_handle_t trace_upload_timer;
+static uint32_t trace_upload_next;
+static uint32_t trace_upload_end;
+
+// Publishes one page per tick, so a whole trace never lands in the MQTT client's outbox at once
+static void trace_upload_timer_callback(void *arg) {
+    static uint8_t page[MOTION_TRACE_PAGE_BYTES];
+    telemetry_writer_t writer;
+
+    telemetry_writer_init_format(&writer, TELEMETRY_FORMAT_DEFAULT, page, sizeof(page));
+    telemetry_write_string(&writer, "device", device_name);
+    motion_trace_write_page(&writer, &trace_upload_next, trace_upload_end);
+    size_t len = telemetry_writer_finish(&writer);
+    if (len == 0) {
+        ESP_LOGE(TAG, "Motion trace page does not fit in %u bytes", (unsigned)sizeof(page));
     } else {
-        ESP_LOGI(TAG, "Unknown error type: 0x%x", event->error_handle->error_type);
+        mqtt_outbox_publish(CONFIG_MQTT_PUBLISH_MOTION_TRACE_TOPIC, page, len,
+                            TELEMETRY_FORMAT_DEFAULT);
+    }
+    if (len == 0 || trace_upload_next >= trace_upload_end) {
+        esp_timer_stop(trace_upload_timer);
+    }
+}
+
+// Uploads the trace as it stands now, one page every MOTION_TRACE_PAGE_INTERVAL_MS
+static void handle_motion_trace_request(const mqtt_chunk_t *chunk, void *ctx) {
+    if (!mqtt_chunk_is_last(chunk)) {
+        return;
     }
-    esp_restart();
+    if (esp_timer_is_active(trace_upload_timer)) {
+        ESP_LOGW(TAG, "Motion trace upload already running");
+        return;
+    }
+    motion_trace_range(&trace_upload_next, &trace_upload_end);
+    BINLOG_I(mqtt_log, "Uploading motion events %u to %u", (unsigned)trace_upload_next,
+             (unsigned)trace_upload_end);
+    // An empty trace still gets one page in reply
+    esp_timer_start_periodic(trace_upload_timer,
+                             (uint64_t)CONFIG_MOTION_TRACE_PAGE_INTERVAL_MS * 1000);
 }
 
+// Recovery is left to the connection supervisor; rebooting would only drop the light state
+void custom_handle_mqtt_event_error(esp_mqtt_event_handle_t event) {
+    BINLOG_I(mqtt_log, "Custom handler: MQTT_EVENT_ERROR");
+    connection_supervisor_error(event);
+}
+
+// Hot paths log through the deferred binary log, so the logger manager's queue of fully
+// formatted messages can stay short
 QueueHandle_t start_logging(void) {
-    log_queue = xQueueCreate(LOG_QUEUE_LENGTH, sizeof(log_message_t));
+    log_queue = xQueueCreateStatic(CONFIG_LOGGER_QUEUE_LENGTH, sizeof(log_message_t),
+                                   log_queue_storage, &log_queue_buffer);
 
     if (log_queue == NULL) {
         ESP_LOGE("MISC_UTIL", "Failed to create logger queue");
         esp_restart();
     }
 
-    xTaskCreate(&logger_task, "logger_task", 4096, NULL, 5, NULL);
+    xTaskCreateStatic(&logger_task, "logger_task", CONFIG_LOGGER_TASK_STACK_SIZE, NULL, 5,
+                      logger_task_stack, &logger_task_buffer);
     return log_queue;
 }
 
@@ -116,88 +177,140 @@ void setup_nvs_flash(void) {
     ESP_ERROR_CHECK(ret);
 }
 
-esp_mqtt_client_handle_t start_mqtt(const mqtt_config_t *config) {
-    // Define the configuration
-
-    // Set the custom event handlers
-    mqtt_set_event_connected_handler(custom_handle_mqtt_event_connected);
-    mqtt_set_event_disconnected_handler(custom_handle_mqtt_event_disconnected);
-    mqtt_set_event_data_handler(custom_handle_mqtt_event_data);
-    mqtt_set_event_error_handler(custom_handle_mqtt_event_error);
+esp_mqtt_client_handle_t start_mqtt(const mqtt_session_config_t *config) {
+    static const mqtt_session_handlers_t handlers = {
+        .connected = custom_handle_mqtt_event_connected,
+        .disconnected = custom_handle_mqtt_event_disconnected,
+        .data = custom_handle_mqtt_event_data,
+        .error = custom_handle_mqtt_event_error,
+        .subscribed = custom_handle_mqtt_event_subscribed,
+    };
+
+    const esp_timer_create_args_t trace_upload_timer_args = {
+        .callback = trace_upload_timer_callback,
+        .name = "trace_upload",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&trace_upload_timer_args, &trace_upload_timer));
+
+    mqtt_dispatch_register(CONFIG_MQTT_SUBSCRIBE_OTA_UPDATE_TOPIC, 0, handle_ota_update_request,
+                           NULL);
+    mqtt_dispatch_register(CONFIG_MQTT_SUBSCRIBE_TELEMETRY_REQUEST_TOPIC, 0,
+                           handle_telemetry_request, NULL);
+    mqtt_dispatch_register(CONFIG_MQTT_SUBSCRIBE_MOTION_TRACE_REQUEST_TOPIC, 0,
+                           handle_motion_trace_request, NULL);
 
     // Start the MQTT client
-    esp_mqtt_client_handle_t client = mqtt_app_start(config);
-
-    return client;
-}
-
-void pass_motion_to_led_task(void *pvParameter) {
-    motion_led_params_t *params = (motion_led_params_t *)pvParameter;
-    motion_event_t motion_event;
-    led_event_t led_event;
-    assert(params->motion_queue != NULL && params->led_queue != NULL);
-
-    while (1) {
-        if (xQueueReceive(params->motion_queue, &motion_event, portMAX_DELAY)) {
-            led_event.led_action = motion_event.motion_detected;
-            xQueueSend(params->led_queue, &led_event, 0);
-            vTaskDelay(pdMS_TO_TICKS(100));  // Delay to allow other tasks to run
-        }
-    }
+    return mqtt_session_start(config, &handlers);
 }
 
+// The LED task reads the motion queue itself; there is no relay task in between
 void associate_led_with_motion() {
     QueueHandle_t motion_queue = get_motion_event_queue();
-    QueueHandle_t led_queue = get_led_state_queue();
-
-    if (motion_queue == NULL || led_queue == NULL) {
-        printf("Failed to create queues\n");
-        return;
-    }
 
-    // Allocate and initialize task parameters
-    motion_led_params_t *params = (motion_led_params_t *)malloc(sizeof(motion_led_params_t));
-    if (params == NULL) {
-        // Handle error
-        printf("Failed to allocate memory for task parameters\n");
-        return;
+    if (motion_queue == NULL || !led_handler_attach_motion_queue(motion_queue)) {
+        ESP_LOGE(TAG, "Failed to attach the motion queue to the LED handler");
     }
-    params->motion_queue = motion_queue;
-    params->led_queue = led_queue;
-
-    // Create the task and pass the parameters
-    xTaskCreate(pass_motion_to_led_task, "pass_motion_to_led_task", 2048, (void *)params, 5, NULL);
 }
 
-void app_main(void) {
-    setup_nvs_flash();
+static esp_mqtt_client_handle_t mqtt_client;
 
-    wifi_init_sta();
+static void boot_nvs(void) { setup_nvs_flash(); }
 
-    synchronize_time();
+static void boot_lighting(void) {
+    init_motion_sensor_manager();
+    init_led_handler();
+    associate_led_with_motion();
+    init_pir_input();
+}
 
+static void boot_logging(void) {
+    init_binlog();
     log_queue = start_logging();
+}
 
-    mqtt_config_t config = {.certificate = home_hallway_bathroom_lights_certificate_pem,
-                            .private_key = home_hallway_bathroom_lights_private_pem_key,
-                            .broker_uri = CONFIG_AWS_IOT_ENDPOINT};
-
-    esp_mqtt_client_handle_t client = start_mqtt(&config);
-
-    init_heartbeat_manager(client, CONFIG_MQTT_PUBLISH_HEARTBEAT_TOPIC,
-                           CONFIG_MQTT_HEARTBEAT_INTERVAL_MINUTES);
+static void boot_mqtt(void) {
+    // Read by the TLS transport on every reconnect
+    static const mqtt_session_config_t config = {
+        .broker_uri = CONFIG_AWS_IOT_ENDPOINT,
+        .ca_certificate = AmazonRootCA1_pem,
+        .certificate = home_hallway_bathroom_lights_certificate_pem,
+        .private_key = home_hallway_bathroom_lights_private_pem_key,
+    };
+
+    init_connection_supervisor(device_name);
+    init_ota_pipeline();
+    mqtt_client = start_mqtt(&config);
+}
 
-    init_telemetry_manager(device_name, client, CONFIG_MQTT_PUBLISH_TELEMETRY_TOPIC,
-                           CONFIG_MQTT_TELEMETRY_INTERVAL_MINUTES);
+static void track_memory(void) {
+    mem_profiler_track_task("led_handling_task", CONFIG_LED_TASK_STACK_SIZE);
+    mem_profiler_track_task("ota_pipeline", CONFIG_OTA_TASK_STACK_SIZE);
+    mem_profiler_track_task("logger_task", CONFIG_LOGGER_TASK_STACK_SIZE);
+    mem_profiler_track_task("binlog_task", CONFIG_BINLOG_TASK_STACK_SIZE);
+    mem_profiler_track_task("mqtt_outbox", CONFIG_MQTT_OUTBOX_TASK_STACK_SIZE);
+    // Stopping the client for a reconnect deletes its task
+    mem_profiler_track_restarting_task("mqtt_task", MQTT_TASK_STACK_SIZE);
+    mem_profiler_track_task("esp_timer", CONFIG_ESP_TIMER_TASK_STACK_SIZE);
+    mem_profiler_track_task("tiT", CONFIG_LWIP_TCPIP_TASK_STACK_SIZE);
+    mem_profiler_track_task("sys_evt", CONFIG_ESP_SYSTEM_EVENT_TASK_STACK_SIZE);
+    init_mem_profiler();
+}
 
-    init_motion_sensor_manager();
+static void boot_services(void) {
+    track_memory();
 
-    init_led_handler();
+    init_heartbeat_manager(mqtt_client, CONFIG_MQTT_PUBLISH_HEARTBEAT_TOPIC,
+                           CONFIG_MQTT_HEARTBEAT_INTERVAL_MINUTES);
 
-    associate_led_with_motion();
+    device_telemetry_register_section("lighting", led_handler_write_telemetry);
+    device_telemetry_register_section("occupancy", occupancy_write_telemetry);
+    device_telemetry_register_section("presence", presence_model_write_telemetry);
+    device_telemetry_register_section("latency", latency_trace_write_telemetry);
+    device_telemetry_register_section("boot", boot_sequencer_write_telemetry);
+    device_telemetry_register_section("connection", connection_supervisor_write_telemetry);
+    device_telemetry_register_section("tls", mqtt_session_write_telemetry);
+    device_telemetry_register_section("ota", ota_pipeline_write_telemetry);
+    device_telemetry_register_section("log", binlog_write_telemetry);
+    device_telemetry_register_section("memory", mem_profiler_write_telemetry);
+    device_telemetry_register_section("power", power_manager_write_telemetry);
+    init_device_telemetry(device_name, mqtt_client, CONFIG_MQTT_PUBLISH_TELEMETRY_TOPIC,
+                          CONFIG_MQTT_TELEMETRY_INTERVAL_MINUTES);
+
+    const char *thing_name =
+        strlen(CONFIG_SHADOW_THING_NAME) > 0 ? CONFIG_SHADOW_THING_NAME : device_name;
+    init_device_shadow(thing_name, mqtt_client);
+}
 
-    // Infinite loop to prevent exiting app_main
-    while (true) {
-        vTaskDelay(pdMS_TO_TICKS(100));  // Delay to allow other tasks to run
-    }
-}
\ No newline at end of file
+enum {
+    BOOT_NVS,
+    BOOT_LIGHTING,
+    BOOT_LOGGING,
+    BOOT_WIFI,
+    BOOT_POWER,
+    BOOT_WIFI_POWER,
+    BOOT_TIME,
+    BOOT_MQTT,
+    BOOT_SERVICES,
+};
+
+// Lighting depends on nothing, so the hallway lights work within the first frames of boot
+// whatever state the network is in. TLS needs the time for certificate checks.
+static const boot_stage_t boot_stages[] = {
+    [BOOT_NVS] = {"boot_nvs", boot_nvs, 0, 3072},
+    [BOOT_LIGHTING] = {"boot_lighting", boot_lighting, 0, 4096},
+    [BOOT_LOGGING] = {"boot_logging", boot_logging, 0, 3072},
+    [BOOT_WIFI] = {"boot_wifi", wifi_init_sta, BOOT_STAGE_BIT(BOOT_NVS), 4096},
+    [BOOT_POWER] = {"boot_power", init_power_manager, BOOT_STAGE_BIT(BOOT_LIGHTING), 3072},
+    [BOOT_WIFI_POWER] = {"boot_wifi_power", power_manager_wifi_started,
+                         BOOT_STAGE_BIT(BOOT_WIFI) | BOOT_STAGE_BIT(BOOT_POWER), 3072},
+    [BOOT_TIME] = {"boot_time", synchronize_time, BOOT_STAGE_BIT(BOOT_WIFI), 4096},
+    [BOOT_MQTT] = {"boot_mqtt", boot_mqtt,
+                   BOOT_STAGE_BIT(BOOT_TIME) | BOOT_STAGE_BIT(BOOT_LOGGING), 4096},
+    [BOOT_SERVICES] = {"boot_services", boot_services,
+                       BOOT_STAGE_BIT(BOOT_MQTT) | BOOT_STAGE_BIT(BOOT_LIGHTING), 4096},
+};
+
+// Returning deletes the main task; everything from here on is event driven
+void app_main(void) {
+    boot_sequencer_start(boot_stages, sizeof(boot_stages) / sizeof(boot_stages[0]));
+}
@@ -0,0 +1,137 @@
+#include "mem_profiler.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "MEM_PROFILER";
+
+typedef struct {
+    const char *name;
+    TaskHandle_t handle;  // NULL for restarting tasks, or if not found
+    bool restarting;
+    uint32_t stack_size;
+    uint32_t min_free_stack;  // Lowest headroom seen, in bytes
+    bool seen;
+} tracked_task_t;
+
+static tracked_task_t tasks[MEM_PROFILER_MAX_TASKS];
+static int task_count;
+
+// Sampled from whichever task writes the telemetry, and by restarting tasks themselves
+static SemaphoreHandle_t profiler_mutex;
+static StaticSemaphore_t profiler_mutex_buffer;
+static uint32_t min_largest_block = UINT32_MAX;
+
+static void track(const char *name, uint32_t stack_size, bool restarting) {
+    if (task_count >= MEM_PROFILER_MAX_TASKS) {
+        ESP_LOGE(TAG, "No room to track task %s", name);
+        return;
+    }
+    tasks[task_count++] = (tracked_task_t){
+        .name = name,
+        .restarting = restarting,
+        .stack_size = stack_size,
+        .min_free_stack = UINT32_MAX,
+    };
+}
+
+void mem_profiler_track_task(const char *name, uint32_t stack_size) {
+    track(name, stack_size, false);
+}
+
+void mem_profiler_track_restarting_task(const char *name, uint32_t stack_size) {
+    track(name, stack_size, true);
+}
+
+static void record(tracked_task_t *task, uint32_t free_stack) {
+    if (free_stack < task->min_free_stack) {
+        task->min_free_stack = free_stack;
+    }
+    task->seen = true;
+}
+
+// Only the calling task's own name is read, which needs no walk over the task lists
+static void sample_current(void) {
+    const char *name = pcTaskGetName(NULL);
+
+    for (int i = 0; i < task_count; i++) {
+        if (strcmp(tasks[i].name, name) == 0) {
+            // The high water mark is in bytes on ESP-IDF
+            record(&tasks[i], uxTaskGetStackHighWaterMark(NULL));
+            return;
+        }
+    }
+}
+
+static void sample(void) {
+    for (int i = 0; i < task_count; i++) {
+        if (tasks[i].handle != NULL) {
+            record(&tasks[i], uxTaskGetStackHighWaterMark(tasks[i].handle));
+        }
+    }
+    sample_current();
+
+    uint32_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT);
+    if (largest < min_largest_block) {
+        min_largest_block = largest;
+    }
+}
+
+void mem_profiler_sample_current_task(void) {
+    if (profiler_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(profiler_mutex, portMAX_DELAY);
+    sample_current();
+    xSemaphoreGive(profiler_mutex);
+}
+
+void mem_profiler_write_telemetry(telemetry_writer_t *writer) {
+    xSemaphoreTake(profiler_mutex, portMAX_DELAY);
+    sample();
+
+    telemetry_begin_object(writer, "heap");
+    telemetry_write_uint(writer, "free", heap_caps_get_free_size(MALLOC_CAP_DEFAULT));
+    telemetry_write_uint(writer, "min_free", heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT));
+    telemetry_write_uint(writer, "largest_block",
+                         heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT));
+    telemetry_write_uint(writer, "min_largest_block", min_largest_block);
+    telemetry_write_uint(writer, "internal_free", heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    telemetry_end_object(writer);
+
+    telemetry_begin_object(writer, "stacks");
+    for (int i = 0; i < task_count; i++) {
+        if (!tasks[i].seen) {
+            continue;
+        }
+        telemetry_begin_object(writer, tasks[i].name);
+        telemetry_write_uint(writer, "size", tasks[i].stack_size);
+        telemetry_write_uint(writer, "min_free", tasks[i].min_free_stack);
+        telemetry_end_object(writer);
+    }
+    telemetry_end_object(writer);
+
+    xSemaphoreGive(profiler_mutex);
+}
+
+// xTaskGetHandle() walks every task list with the scheduler suspended, so it is done once
+void init_mem_profiler(void) {
+    for (int i = 0; i < task_count; i++) {
+        if (tasks[i].restarting) {
+            continue;
+        }
+        tasks[i].handle = xTaskGetHandle(tasks[i].name);
+        if (tasks[i].handle == NULL) {
+            ESP_LOGW(TAG, "Task %s is not running, its stack is not tracked", tasks[i].name);
+        }
+    }
+    profiler_mutex = xSemaphoreCreateMutexStatic(&profiler_mutex_buffer);
+    ESP_LOGI(TAG, "Tracking %d task stacks and the heap", task_count);
+}
@@ -0,0 +1,30 @@
+#ifndef MEM_PROFILER_H
+#define MEM_PROFILER_H
+
+#include <stdint.h>
+
+#include "telemetry_writer.h"
+
+// Field data for sizing stacks and watching the heap. Tracked tasks are named, so tasks
+// owned by other components can be watched too, and their lowest stack headroom is kept
+// across samples. The heap's free size and largest free block are sampled alongside; a
+// largest block far below the free size means the heap is fragmenting. Samples are taken
+// when the memory telemetry section is written, so the profiler never wakes the chip.
+
+#define MEM_PROFILER_MAX_TASKS 12
+
+// stack_size is what the task was created with, in bytes. The task must live as long as the
+// device runs; it is looked up by name once, in init_mem_profiler().
+void mem_profiler_track_task(const char *name, uint32_t stack_size);
+// For a task that is deleted and created again, like the MQTT client's. It is never looked
+// up, so a stale handle cannot be read; the task reports its own stack instead.
+void mem_profiler_track_restarting_task(const char *name, uint32_t stack_size);
+// Folds in the calling task's headroom if it is tracked. Restarting tasks call this before
+// they go away, and writing the telemetry does it for whichever task writes it.
+void mem_profiler_sample_current_task(void);
+void init_mem_profiler(void);
+
+// Takes a fresh sample first
+void mem_profiler_write_telemetry(telemetry_writer_t *writer);
+
+#endif  // MEM_PROFILER_H
@@ -0,0 +1,96 @@
+#include "motion_trace.h"
+
+#include <sys/time.h>
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// 2024-01-01; anything earlier means SNTP has not set the clock yet
+#define MOTION_TRACE_MIN_VALID_EPOCH_S 1704067200
+
+// Written by the LED task, read by the MQTT task while it uploads
+static SemaphoreHandle_t trace_mutex;
+static StaticSemaphore_t trace_mutex_buffer;
+static uint32_t events_ms[CONFIG_MOTION_TRACE_EVENTS];
+static uint32_t recorded;
+
+// Owned by the MQTT task, the only one that uploads
+static uint32_t page[CONFIG_MOTION_TRACE_PAGE_EVENTS];
+
+void motion_trace_record(int64_t detected_us) {
+    if (trace_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(trace_mutex, portMAX_DELAY);
+    events_ms[recorded % CONFIG_MOTION_TRACE_EVENTS] = detected_us / 1000;
+    recorded++;
+    xSemaphoreGive(trace_mutex);
+}
+
+static uint32_t oldest_held(void) {
+    return recorded > CONFIG_MOTION_TRACE_EVENTS ? recorded - CONFIG_MOTION_TRACE_EVENTS : 0;
+}
+
+void motion_trace_range(uint32_t *oldest, uint32_t *end) {
+    xSemaphoreTake(trace_mutex, portMAX_DELAY);
+    *oldest = oldest_held();
+    *end = recorded;
+    xSemaphoreGive(trace_mutex);
+}
+
+// Wall clock time of an uptime in the past, or 0 while the clock is not set
+static uint64_t epoch_ms_at(uint32_t uptime_ms) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    if (now.tv_sec < MOTION_TRACE_MIN_VALID_EPOCH_S) {
+        return 0;
+    }
+    uint64_t now_ms = (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+    uint32_t age_ms = (uint32_t)(esp_timer_get_time() / 1000) - uptime_ms;
+    return now_ms - age_ms;
+}
+
+void motion_trace_write_page(telemetry_writer_t *writer, uint32_t *next, uint32_t end) {
+    uint32_t first = *next;
+    uint32_t lost = 0;
+    uint32_t count;
+
+    // Copied out first so the LED task never waits on the encoder
+    xSemaphoreTake(trace_mutex, portMAX_DELAY);
+    uint32_t oldest = oldest_held();
+    if (first < oldest) {
+        lost = oldest - first;
+        first = oldest;
+    }
+    count = end > first ? end - first : 0;
+    if (count > CONFIG_MOTION_TRACE_PAGE_EVENTS) {
+        count = CONFIG_MOTION_TRACE_PAGE_EVENTS;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        page[i] = events_ms[(first + i) % CONFIG_MOTION_TRACE_EVENTS];
+    }
+    xSemaphoreGive(trace_mutex);
+    *next = first + count;
+
+    telemetry_write_uint(writer, "first", first);
+    telemetry_write_uint(writer, "end", end);
+    telemetry_write_uint(writer, "lost", lost);
+    if (count == 0) {
+        return;
+    }
+    telemetry_write_uint(writer, "uptime_ms", page[0]);
+    uint64_t epoch_ms = epoch_ms_at(page[0]);
+    if (epoch_ms != 0) {
+        telemetry_write_uint(writer, "epoch_ms", epoch_ms);
+    }
+    // Gaps wrap like the uptime itself, so a trace may cross the 49-day rollover
+    telemetry_begin_array(writer, "gaps_ms");
+    for (uint32_t i = 0; i < count; i++) {
+        telemetry_write_uint(writer, NULL, i == 0 ? 0 : page[i] - page[i - 1]);
+    }
+    telemetry_end_array(writer);
+}
+
+void init_motion_trace(void) { trace_mutex = xSemaphoreCreateMutexStatic(&trace_mutex_buffer); }
@@ -0,0 +1,28 @@
+#ifndef MOTION_TRACE_H
+#define MOTION_TRACE_H
+
+#include <stdint.h>
+
+#include "sdkconfig.h"
+#include "telemetry_writer.h"
+
+// The last CONFIG_MOTION_TRACE_EVENTS motion events, as milliseconds since boot, for tuning
+// the shine time and animations offline with the replay simulator in sim/. Events are
+// numbered from boot on, so a trace uploaded in several pages stays consistent while new
+// motion comes in. The ring is in RAM and starts empty after a reboot.
+
+// Room for one page in either encoding
+#define MOTION_TRACE_PAGE_BYTES (CONFIG_MOTION_TRACE_PAGE_EVENTS * 11 + 128)
+
+void init_motion_trace(void);
+void motion_trace_record(int64_t detected_us);
+
+// Number of the oldest event still held and one past the newest
+void motion_trace_range(uint32_t *oldest, uint32_t *end);
+
+// Writes up to CONFIG_MOTION_TRACE_PAGE_EVENTS events from number *next on, and no further
+// than `end`, as one page, then advances *next past them. Events the ring has overwritten
+// since are counted under "lost".
+void motion_trace_write_page(telemetry_writer_t *writer, uint32_t *next, uint32_t end);
+
+#endif  // MOTION_TRACE_H
@@ -0,0 +1,212 @@
+#include "mqtt_dispatch.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "MQTT_DISPATCH";
+
+// Open-addressed index into routes; at most half full so probes stay short
+#define MQTT_DISPATCH_INDEX_SIZE 16
+#define MQTT_DISPATCH_NO_ROUTE -1
+
+typedef struct {
+    const char *topic;
+    size_t topic_len;
+    uint32_t hash;
+    int qos;
+    mqtt_topic_handler_t handler;
+    void *ctx;
+    bool subscribed;       // Acknowledged, so in the broker's session for this client
+    int subscribe_msg_id;  // Of the SUBSCRIBE waiting for its SUBACK, or 0
+} mqtt_route_t;
+
+// Routes are only ever appended, so pointers to them stay valid
+static mqtt_route_t routes[MQTT_DISPATCH_MAX_ROUTES];
+static int route_count;
+static int8_t route_index[MQTT_DISPATCH_INDEX_SIZE];
+static bool index_built;
+static esp_mqtt_client_handle_t connected_client;
+static portMUX_TYPE routes_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Route of the message whose fragments are arriving; only used on the MQTT task
+static const mqtt_route_t *current_route;
+
+static uint32_t topic_hash(const char *topic, size_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)topic[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void build_index(void) {
+    memset(route_index, MQTT_DISPATCH_NO_ROUTE, sizeof(route_index));
+    for (int i = 0; i < route_count; i++) {
+        uint32_t slot = routes[i].hash;
+        while (route_index[slot & (MQTT_DISPATCH_INDEX_SIZE - 1)] != MQTT_DISPATCH_NO_ROUTE) {
+            slot++;
+        }
+        route_index[slot & (MQTT_DISPATCH_INDEX_SIZE - 1)] = (int8_t)i;
+    }
+    index_built = true;
+}
+
+static const mqtt_route_t *find_route(const char *topic, size_t len) {
+    uint32_t hash = topic_hash(topic, len);
+    const mqtt_route_t *found = NULL;
+
+    taskENTER_CRITICAL(&routes_lock);
+    if (index_built) {
+        for (uint32_t slot = hash;; slot++) {
+            int i = route_index[slot & (MQTT_DISPATCH_INDEX_SIZE - 1)];
+            if (i == MQTT_DISPATCH_NO_ROUTE) {
+                break;
+            }
+            if (routes[i].hash == hash && routes[i].topic_len == len &&
+                memcmp(routes[i].topic, topic, len) == 0) {
+                found = &routes[i];
+                break;
+            }
+        }
+    }
+    taskEXIT_CRITICAL(&routes_lock);
+    return found;
+}
+
+// The subscription only counts once the broker acknowledges it, in mqtt_dispatch_subscribed()
+static void subscribe(esp_mqtt_client_handle_t client, mqtt_route_t *route) {
+    ESP_LOGI(TAG, "Subscribing to topic %s", route->topic);
+    int msg_id = esp_mqtt_client_subscribe(client, route->topic, route->qos);
+    if (msg_id < 0) {
+        ESP_LOGW(TAG, "Could not queue the subscription to %s", route->topic);
+    }
+
+    taskENTER_CRITICAL(&routes_lock);
+    route->subscribed = false;
+    route->subscribe_msg_id = msg_id > 0 ? msg_id : 0;
+    taskEXIT_CRITICAL(&routes_lock);
+}
+
+bool mqtt_dispatch_register(const char *topic, int qos, mqtt_topic_handler_t handler, void *ctx) {
+    esp_mqtt_client_handle_t client;
+    mqtt_route_t *route;
+
+    taskENTER_CRITICAL(&routes_lock);
+    if (route_count >= MQTT_DISPATCH_MAX_ROUTES) {
+        taskEXIT_CRITICAL(&routes_lock);
+        ESP_LOGE(TAG, "No room to route topic %s", topic);
+        return false;
+    }
+    route = &routes[route_count++];
+    *route = (mqtt_route_t){
+        .topic = topic,
+        .topic_len = strlen(topic),
+        .hash = topic_hash(topic, strlen(topic)),
+        .qos = qos,
+        .handler = handler,
+        .ctx = ctx,
+    };
+    client = connected_client;
+    if (client != NULL) {
+        build_index();
+    }
+    taskEXIT_CRITICAL(&routes_lock);
+
+    if (client != NULL) {
+        subscribe(client, route);
+    }
+    return true;
+}
+
+void mqtt_dispatch_connected(esp_mqtt_client_handle_t client, bool session_present) {
+    int count;
+
+    taskENTER_CRITICAL(&routes_lock);
+    build_index();
+    connected_client = client;
+    count = route_count;
+    taskEXIT_CRITICAL(&routes_lock);
+
+    current_route = NULL;
+    for (int i = 0; i < count; i++) {
+        // A kept session still holds every subscription that went through
+        if (!session_present || !routes[i].subscribed) {
+            subscribe(client, &routes[i]);
+        }
+    }
+}
+
+// A SUBACK return code of 0x80 or more is a refusal, in MQTT 3.1.1 and 5 alike
+static bool suback_granted(esp_mqtt_event_handle_t event) {
+    if (event->event_id != MQTT_EVENT_SUBSCRIBED || event->data_len < 1) {
+        return false;
+    }
+    for (int i = 0; i < event->data_len; i++) {
+        if ((uint8_t)event->data[i] >= 0x80) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void mqtt_dispatch_subscribed(esp_mqtt_event_handle_t event) {
+    const char *topic = NULL;
+    bool granted = suback_granted(event);
+
+    if (event->msg_id <= 0) {
+        return;
+    }
+    taskENTER_CRITICAL(&routes_lock);
+    for (int i = 0; i < route_count; i++) {
+        if (routes[i].subscribe_msg_id == event->msg_id) {
+            routes[i].subscribe_msg_id = 0;
+            routes[i].subscribed = granted;
+            topic = routes[i].topic;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&routes_lock);
+
+    if (topic != NULL && !granted) {
+        ESP_LOGW(TAG, "Subscription to %s failed; retrying on the next connect", topic);
+    }
+}
+
+void mqtt_dispatch_disconnected(void) {
+    taskENTER_CRITICAL(&routes_lock);
+    connected_client = NULL;
+    // Subscriptions still waiting for their SUBACK are sent again on the next connect
+    for (int i = 0; i < route_count; i++) {
+        routes[i].subscribe_msg_id = 0;
+    }
+    taskEXIT_CRITICAL(&routes_lock);
+    // A message cut off by the disconnect is not continued on the next connection
+    current_route = NULL;
+}
+
+void mqtt_dispatch_data(esp_mqtt_event_handle_t event) {
+    if (event->current_data_offset == 0) {
+        current_route = find_route(event->topic, event->topic_len);
+        if (current_route == NULL) {
+            ESP_LOGW(TAG, "No route for topic %.*s", event->topic_len, event->topic);
+        }
+    }
+    if (current_route == NULL) {
+        return;
+    }
+
+    const mqtt_chunk_t chunk = {
+        .event = event,
+        .data = event->data,
+        .len = event->data_len,
+        .offset = event->current_data_offset,
+        .total = event->total_data_len,
+    };
+    current_route->handler(&chunk, current_route->ctx);
+    if (mqtt_chunk_is_last(&chunk)) {
+        current_route = NULL;
+    }
+}
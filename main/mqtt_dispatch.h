@@ -0,0 +1,42 @@
+#ifndef MQTT_DISPATCH_H
+#define MQTT_DISPATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mqtt_client.h"
+
+// Routes incoming MQTT data to handlers by exact topic. The lookup index is rebuilt on every
+// connect, when all routes are subscribed, or if the broker kept the session only those it
+// never acknowledged. Payloads larger than the MQTT buffer arrive as
+// several data events, and only the first one carries the topic; the route found for it
+// receives every fragment in order.
+
+#define MQTT_DISPATCH_MAX_ROUTES 8
+
+typedef struct {
+    esp_mqtt_event_handle_t event;
+    const char *data;
+    size_t len;
+    size_t offset;  // Of this fragment within the message
+    size_t total;   // Length of the whole message
+} mqtt_chunk_t;
+
+static inline bool mqtt_chunk_is_first(const mqtt_chunk_t *chunk) { return chunk->offset == 0; }
+static inline bool mqtt_chunk_is_last(const mqtt_chunk_t *chunk) {
+    return chunk->offset + chunk->len >= chunk->total;
+}
+
+typedef void (*mqtt_topic_handler_t)(const mqtt_chunk_t *chunk, void *ctx);
+
+// `topic` must stay valid for as long as the route exists. Routes added while connected are
+// subscribed straight away.
+bool mqtt_dispatch_register(const char *topic, int qos, mqtt_topic_handler_t handler, void *ctx);
+void mqtt_dispatch_connected(esp_mqtt_client_handle_t client, bool session_present);
+// For MQTT_EVENT_SUBSCRIBED, and MQTT_EVENT_DELETED when the client gave up waiting for the
+// SUBACK. A route only counts as subscribed once the broker granted it.
+void mqtt_dispatch_subscribed(esp_mqtt_event_handle_t event);
+void mqtt_dispatch_disconnected(void);
+void mqtt_dispatch_data(esp_mqtt_event_handle_t event);
+
+#endif  // MQTT_DISPATCH_H
@@ -0,0 +1,455 @@
+#include "mqtt_outbox.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "MQTT_OUTBOX";
+
+#define MQTT_OUTBOX_MAX_TOPIC 127
+// Each record: topic length (1 byte), format (1 byte), payload length (2 bytes, little endian),
+// topic, payload
+#define MQTT_OUTBOX_HEADER 4
+#define MQTT_OUTBOX_NVS_NAMESPACE "mqtt_outbox"
+// The largest record the ring takes
+#define MQTT_OUTBOX_MAX_RECORD \
+    (CONFIG_MQTT_OUTBOX_BATCH_SIZE + MQTT_OUTBOX_HEADER + MQTT_OUTBOX_MAX_TOPIC)
+
+_Static_assert(CONFIG_MQTT_OUTBOX_SIZE >= MQTT_OUTBOX_MAX_RECORD,
+               "The outbox must hold at least one message of the largest batch size");
+
+static esp_mqtt_client_handle_t outbox_client;  // NULL while offline
+static SemaphoreHandle_t outbox_mutex;
+static StaticSemaphore_t outbox_mutex_buffer;
+
+static uint8_t ring[CONFIG_MQTT_OUTBOX_SIZE];
+static size_t ring_head;  // Oldest byte
+static size_t ring_used;
+static uint32_t ring_records;
+// Bytes at the head of the ring that were loaded from a spill slot. They are older than every
+// slot still in NVS; everything else in the ring is newer than all of them.
+static size_t ring_slot_bytes;
+
+// Flash writes and the backlog are handled by a low-priority task, so the esp_timer and MQTT
+// tasks that publish never wait for flash
+static TaskHandle_t outbox_task;
+static StaticTask_t outbox_task_buffer;
+static StackType_t outbox_task_stack[CONFIG_MQTT_OUTBOX_TASK_STACK_SIZE];
+
+// Consecutive records for one topic on their way out
+static uint8_t batch[CONFIG_MQTT_OUTBOX_BATCH_SIZE];
+static size_t batch_len;
+static char batch_topic[MQTT_OUTBOX_MAX_TOPIC + 1];
+static telemetry_format_t batch_format;
+static uint32_t batch_records;
+static size_t batch_ring_bytes;
+
+static uint32_t dropped;
+static uint32_t spilled;
+static uint32_t batches_sent;
+
+#if CONFIG_MQTT_OUTBOX_NVS_SPILL
+// Spill slots form a queue in NVS: count slots starting at first, wrapping at the maximum.
+// While offline the last slot is kept free, so on reconnect what is in RAM can be put
+// behind the older slots before they are loaded back.
+static uint8_t spill_first;
+static uint8_t spill_count;
+#define MQTT_OUTBOX_SLOTS CONFIG_MQTT_OUTBOX_NVS_SLOTS
+#define MQTT_OUTBOX_OFFLINE_SLOTS (CONFIG_MQTT_OUTBOX_NVS_SLOTS - 1)
+#endif
+
+static void ring_write(size_t offset, const void *src, size_t len) {
+    size_t pos = (ring_head + offset) % sizeof(ring);
+    size_t first = len < sizeof(ring) - pos ? len : sizeof(ring) - pos;
+
+    memcpy(ring + pos, src, first);
+    memcpy(ring, (const uint8_t *)src + first, len - first);
+}
+
+static void ring_read(size_t offset, void *dst, size_t len) {
+    size_t pos = (ring_head + offset) % sizeof(ring);
+    size_t first = len < sizeof(ring) - pos ? len : sizeof(ring) - pos;
+
+    memcpy(dst, ring + pos, first);
+    memcpy((uint8_t *)dst + first, ring, len - first);
+}
+
+static size_t record_at(size_t offset, uint8_t *topic_len, uint16_t *data_len) {
+    uint8_t header[MQTT_OUTBOX_HEADER];
+
+    ring_read(offset, header, sizeof(header));
+    *topic_len = header[0];
+    *data_len = header[2] | (header[3] << 8);
+    return MQTT_OUTBOX_HEADER + *topic_len + *data_len;
+}
+
+static telemetry_format_t record_format(size_t offset) {
+    uint8_t header[MQTT_OUTBOX_HEADER];
+
+    ring_read(offset, header, sizeof(header));
+    return header[1];
+}
+
+static void ring_consume(size_t bytes, uint32_t records) {
+    ring_head = (ring_head + bytes) % sizeof(ring);
+    ring_used -= bytes;
+    ring_records -= records;
+    ring_slot_bytes = bytes < ring_slot_bytes ? ring_slot_bytes - bytes : 0;
+    if (ring_used == 0) {
+        ring_head = 0;
+    }
+}
+
+static void drop_oldest(void) {
+    uint8_t topic_len;
+    uint16_t data_len;
+
+    ring_consume(record_at(0, &topic_len, &data_len), 1);
+    dropped++;
+}
+
+#if CONFIG_MQTT_OUTBOX_NVS_SPILL
+static void spill_key(uint8_t slot, char *key, size_t size) {
+    snprintf(key, size, "spill_%u", (unsigned)(slot % CONFIG_MQTT_OUTBOX_NVS_SLOTS));
+}
+
+static void reverse(uint8_t *p, size_t len) {
+    for (size_t i = 0; i < len / 2; i++) {
+        uint8_t tmp = p[i];
+        p[i] = p[len - 1 - i];
+        p[len - 1 - i] = tmp;
+    }
+}
+
+static void save_spill_queue(nvs_handle_t nvs) {
+    nvs_set_u8(nvs, "first", spill_first);
+    nvs_set_u8(nvs, "count", spill_count);
+    nvs_commit(nvs);
+}
+
+static bool spill_pending(void) { return spill_count > 0; }
+
+// Spill once the next message might not fit, while offline and with RAM all newer than NVS
+static bool spill_wanted(void) {
+    return outbox_client == NULL && ring_slot_bytes == 0 &&
+           spill_count < MQTT_OUTBOX_OFFLINE_SLOTS &&
+           sizeof(ring) - ring_used < MQTT_OUTBOX_MAX_RECORD;
+}
+
+// Moves the whole ring into the next free NVS slot, using at most max_slots. One flash write
+// per ring full keeps wear low even through a long outage.
+static bool spill_ring(uint8_t max_slots) {
+    nvs_handle_t nvs;
+    char key[16];
+
+    if (spill_count >= max_slots || ring_used == 0 || ring_slot_bytes != 0) {
+        return false;
+    }
+    if (nvs_open(MQTT_OUTBOX_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return false;
+    }
+
+    // Rotate the contents to the start of the ring so they can be stored in one blob
+    reverse(ring, ring_head);
+    reverse(ring + ring_head, sizeof(ring) - ring_head);
+    reverse(ring, sizeof(ring));
+    ring_head = 0;
+
+    spill_key(spill_first + spill_count, key, sizeof(key));
+    esp_err_t ret = nvs_set_blob(nvs, key, ring, ring_used);
+    if (ret == ESP_OK) {
+        spill_count++;
+        save_spill_queue(nvs);
+        spilled++;
+        ring_consume(ring_used, ring_records);
+    } else {
+        ESP_LOGW(TAG, "Failed to spill to NVS: %s", esp_err_to_name(ret));
+    }
+    nvs_close(nvs);
+    return ret == ESP_OK;
+}
+
+// Counts the records of a slot just loaded into the ring, checking that they fill it exactly
+static esp_err_t count_spilled_records(void) {
+    size_t offset = 0;
+
+    while (offset < ring_used) {
+        uint8_t topic_len;
+        uint16_t data_len;
+
+        if (ring_used - offset < MQTT_OUTBOX_HEADER) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        size_t record_len = record_at(offset, &topic_len, &data_len);
+        offset += record_len;
+        if (topic_len > MQTT_OUTBOX_MAX_TOPIC || record_len > MQTT_OUTBOX_MAX_RECORD ||
+            offset > ring_used) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        ring_records++;
+    }
+    return ESP_OK;
+}
+
+// Loads the oldest spilled slot into the empty ring; returns false if NVS could not be read
+static bool load_spill_slot(void) {
+    nvs_handle_t nvs;
+    char key[16];
+    size_t len = sizeof(ring);
+
+    if (spill_count == 0 || ring_used != 0) {
+        return false;
+    }
+    if (nvs_open(MQTT_OUTBOX_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return false;
+    }
+
+    spill_key(spill_first, key, sizeof(key));
+    esp_err_t ret = nvs_get_blob(nvs, key, ring, &len);
+    if (ret == ESP_OK) {
+        ring_head = 0;
+        ring_used = len;
+        ring_slot_bytes = len;
+        ret = count_spilled_records();
+    }
+    if (ret != ESP_OK) {
+        // What it held cannot be trusted or counted, so the slot counts as one dropped message
+        ESP_LOGW(TAG, "Dropping unreadable spill slot %s: %s", key, esp_err_to_name(ret));
+        ring_consume(ring_used, ring_records);
+        dropped++;
+    }
+    // Once in RAM the slot is sent ahead of the rest
+    nvs_erase_key(nvs, key);
+    spill_first = (spill_first + 1) % CONFIG_MQTT_OUTBOX_NVS_SLOTS;
+    spill_count--;
+    save_spill_queue(nvs);
+    nvs_close(nvs);
+    return true;
+}
+#else
+#define MQTT_OUTBOX_SLOTS 0
+#define MQTT_OUTBOX_OFFLINE_SLOTS 0
+static bool spill_pending(void) { return false; }
+static bool spill_wanted(void) { return false; }
+static bool spill_ring(uint8_t max_slots) { return false; }
+static bool load_spill_slot(void) { return false; }
+#endif
+
+static void ring_push(const char *topic, size_t topic_len, const uint8_t *data, size_t len,
+                      telemetry_format_t format) {
+    size_t need = MQTT_OUTBOX_HEADER + topic_len + len;
+    uint8_t header[MQTT_OUTBOX_HEADER] = {topic_len, format, len & 0xFF, len >> 8};
+
+    // The outbox task spills before it comes to this, unless it has not run yet
+    while (sizeof(ring) - ring_used < need) {
+        drop_oldest();
+    }
+    ring_write(ring_used, header, sizeof(header));
+    ring_write(ring_used + sizeof(header), topic, topic_len);
+    ring_write(ring_used + sizeof(header) + topic_len, data, len);
+    ring_used += need;
+    ring_records++;
+}
+
+static bool send_batch(void) {
+    const uint8_t *data = batch;
+    size_t len = batch_len;
+
+    if (batch_records == 0) {
+        return true;
+    }
+    // A single message goes out as it was published, without the array around it
+    if (batch_records == 1) {
+        data++;
+        len--;
+    } else if (batch_format == TELEMETRY_FORMAT_CBOR) {
+        batch[len++] = 0xFF;  // Break, closing the indefinite-length array
+    } else {
+        batch[len++] = ']';
+    }
+    if (esp_mqtt_client_enqueue(outbox_client, batch_topic, (const char *)data, len, 0, 0, true) <
+        0) {
+        return false;
+    }
+    ring_consume(batch_ring_bytes, batch_records);
+    batches_sent++;
+    batch_records = 0;
+    batch_ring_bytes = 0;
+    return true;
+}
+
+// Sends the records in the first `limit` bytes of the ring
+static bool flush_ring(size_t limit) {
+    size_t offset = 0;
+
+    batch_records = 0;
+    batch_ring_bytes = 0;
+    while (offset < limit) {
+        uint8_t topic_len;
+        uint16_t data_len;
+        char topic[MQTT_OUTBOX_MAX_TOPIC + 1];
+        size_t record_len = record_at(offset, &topic_len, &data_len);
+        telemetry_format_t format = record_format(offset);
+
+        ring_read(offset + MQTT_OUTBOX_HEADER, topic, topic_len);
+        topic[topic_len] = '\0';
+
+        if (batch_records > 0 &&
+            (strcmp(topic, batch_topic) != 0 || format != batch_format ||
+             batch_len + data_len + MQTT_OUTBOX_BATCH_FRAMING > sizeof(batch))) {
+            size_t sent = batch_ring_bytes;
+            if (!send_batch()) {
+                return false;
+            }
+            limit -= sent;
+            offset = 0;
+            continue;
+        }
+        if (batch_records == 0) {
+            strcpy(batch_topic, topic);
+            batch_format = format;
+            // CBOR items follow each other without separators
+            batch[0] = format == TELEMETRY_FORMAT_CBOR ? 0x9F : '[';
+            batch_len = 1;
+        } else if (format != TELEMETRY_FORMAT_CBOR) {
+            batch[batch_len++] = ',';
+        }
+        ring_read(offset + MQTT_OUTBOX_HEADER + topic_len, batch + batch_len, data_len);
+        batch_len += data_len;
+        batch_records++;
+        batch_ring_bytes += record_len;
+        offset += record_len;
+    }
+    return send_batch();
+}
+
+// One step of sending the backlog oldest first: what was loaded from a slot, then each
+// remaining slot once RAM has been put behind it, then RAM. Returns true while there is more.
+static bool flush_step(void) {
+    if (outbox_client == NULL) {
+        return false;
+    }
+    if (ring_slot_bytes > 0) {
+        return flush_ring(ring_slot_bytes);
+    }
+    if (spill_pending()) {
+        if (ring_used > 0 && !spill_ring(MQTT_OUTBOX_SLOTS)) {
+            // Out of order is better than not at all
+            return flush_ring(ring_used);
+        }
+        return load_spill_slot();
+    }
+    if (ring_used > 0) {
+        flush_ring(ring_used);
+    }
+    return false;
+}
+
+// The mutex is let go between steps, so a publisher waits for one flash access at most
+static void outbox_task_fn(void *pvParameter) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        bool more = true;
+        while (more) {
+            xSemaphoreTake(outbox_mutex, portMAX_DELAY);
+            if (spill_wanted()) {
+                spill_ring(MQTT_OUTBOX_OFFLINE_SLOTS);
+            }
+            more = flush_step();
+            uint32_t held_back = ring_records;
+            bool stalled = !more && outbox_client != NULL && held_back > 0;
+            xSemaphoreGive(outbox_mutex);
+
+            if (stalled) {
+                ESP_LOGW(TAG, "MQTT client is full, %" PRIu32 " messages still held back",
+                         held_back);
+            }
+        }
+    }
+}
+
+void mqtt_outbox_publish(const char *topic, const uint8_t *data, size_t len,
+                         telemetry_format_t format) {
+    size_t topic_len = strlen(topic);
+    bool wake;
+
+    xSemaphoreTake(outbox_mutex, portMAX_DELAY);
+    // Straight out only when nothing older is still waiting
+    if (outbox_client != NULL && ring_used == 0 && !spill_pending() &&
+        esp_mqtt_client_enqueue(outbox_client, topic, (const char *)data, len, 0, 0, true) >= 0) {
+        xSemaphoreGive(outbox_mutex);
+        return;
+    }
+    // Anything that could not be sent on its own in one batch is not kept
+    if (topic_len > MQTT_OUTBOX_MAX_TOPIC || len > MQTT_OUTBOX_MAX_MESSAGE) {
+        dropped++;
+        ESP_LOGW(TAG, "Dropping %u byte message for %s", (unsigned)len, topic);
+    } else {
+        ring_push(topic, topic_len, data, len, format);
+    }
+    wake = outbox_client != NULL || spill_wanted();
+    xSemaphoreGive(outbox_mutex);
+
+    if (wake && outbox_task != NULL) {
+        xTaskNotifyGive(outbox_task);
+    }
+}
+
+void mqtt_outbox_set_connected(esp_mqtt_client_handle_t client) {
+    xSemaphoreTake(outbox_mutex, portMAX_DELAY);
+    outbox_client = client;
+    xSemaphoreGive(outbox_mutex);
+
+    if (client != NULL && outbox_task != NULL) {
+        xTaskNotifyGive(outbox_task);
+    }
+}
+
+void mqtt_outbox_get_stats(mqtt_outbox_stats_t *stats) {
+    xSemaphoreTake(outbox_mutex, portMAX_DELAY);
+    stats->buffered = ring_records;
+    stats->dropped = dropped;
+    stats->spilled = spilled;
+    stats->batches_sent = batches_sent;
+    xSemaphoreGive(outbox_mutex);
+}
+
+void mqtt_outbox_write_telemetry(telemetry_writer_t *writer) {
+    mqtt_outbox_stats_t stats;
+    mqtt_outbox_get_stats(&stats);
+
+    telemetry_write_uint(writer, "buffered", stats.buffered);
+    telemetry_write_uint(writer, "dropped", stats.dropped);
+    telemetry_write_uint(writer, "spilled", stats.spilled);
+    telemetry_write_uint(writer, "batches_sent", stats.batches_sent);
+#if CONFIG_MQTT_OUTBOX_NVS_SPILL
+    telemetry_write_uint(writer, "nvs_slots", spill_count);
+#endif
+}
+
+void init_mqtt_outbox(void) {
+    outbox_mutex = xSemaphoreCreateMutexStatic(&outbox_mutex_buffer);
+    outbox_task = xTaskCreateStatic(&outbox_task_fn, "mqtt_outbox",
+                                    CONFIG_MQTT_OUTBOX_TASK_STACK_SIZE, NULL, 1,
+                                    outbox_task_stack, &outbox_task_buffer);
+
+#if CONFIG_MQTT_OUTBOX_NVS_SPILL
+    // Slots spilled before a reboot are sent with the rest on the next connect
+    nvs_handle_t nvs;
+    if (nvs_open(MQTT_OUTBOX_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        nvs_get_u8(nvs, "first", &spill_first);
+        nvs_get_u8(nvs, "count", &spill_count);
+        nvs_close(nvs);
+    }
+    if (spill_count > 0) {
+        ESP_LOGI(TAG, "%u spilled outbox slots waiting in NVS", spill_count);
+    }
+#endif
+}
@@ -0,0 +1,44 @@
+#ifndef MQTT_OUTBOX_H
+#define MQTT_OUTBOX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mqtt_client.h"
+#include "sdkconfig.h"
+#include "telemetry_writer.h"
+
+// Holds periodic messages (telemetry, heartbeats) while the broker is unreachable, in a fixed
+// ring of CONFIG_MQTT_OUTBOX_SIZE bytes. When the ring fills up it is either spilled to NVS,
+// where it also survives a reboot, or the oldest messages are dropped. Once connected again
+// everything is sent oldest first, NVS before RAM, with consecutive messages for the same
+// topic and format joined into one JSON or CBOR array of up to CONFIG_MQTT_OUTBOX_BATCH_SIZE
+// bytes. Messages published while a backlog is still waiting queue up behind it. Spills and
+// the backlog are handled by a low-priority task of the outbox's own.
+
+// Room for the array around a batch: a separator and the closing bracket for JSON, the break
+// byte for CBOR
+#define MQTT_OUTBOX_BATCH_FRAMING 2
+// The largest message the outbox keeps. Periodic messages must fit, or every one produced
+// offline is dropped.
+#define MQTT_OUTBOX_MAX_MESSAGE (CONFIG_MQTT_OUTBOX_BATCH_SIZE - MQTT_OUTBOX_BATCH_FRAMING)
+
+typedef struct {
+    uint32_t buffered;  // Messages waiting in RAM
+    uint32_t dropped;
+    uint32_t spilled;   // Ring contents written to NVS
+    uint32_t batches_sent;
+} mqtt_outbox_stats_t;
+
+void init_mqtt_outbox(void);
+// Sends straight away while connected with nothing held back, otherwise keeps the message
+void mqtt_outbox_publish(const char *topic, const uint8_t *data, size_t len,
+                         telemetry_format_t format);
+// The connected client, or NULL while offline. Connecting starts sending the backlog.
+void mqtt_outbox_set_connected(esp_mqtt_client_handle_t client);
+
+void mqtt_outbox_get_stats(mqtt_outbox_stats_t *stats);
+void mqtt_outbox_write_telemetry(telemetry_writer_t *writer);
+
+#endif  // MQTT_OUTBOX_H
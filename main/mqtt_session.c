@@ -0,0 +1,331 @@
+#include "mqtt_session.h"
+
+#include <inttypes.h>
+#include <string.h>
+#include <sys/select.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_tls.h"
+#include "esp_transport.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/ssl.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "MQTT_SESSION";
+
+#define MQTT_SESSION_DEFAULT_PORT 8883
+
+typedef struct {
+    uint32_t count;
+    uint32_t last_ms;
+    uint32_t max_ms;
+    uint32_t heap_peak;  // Most heap the handshake held at once, in bytes
+} handshake_stats_t;
+
+// Only touched from the MQTT task, which runs the transport
+static const mqtt_session_config_t *session_config;
+static const mqtt_session_handlers_t *session_handlers;
+static esp_tls_t *tls;
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+// Ticket from the last successful handshake, offered on the next one
+static esp_tls_client_session_t *cached_session;
+#endif
+
+// Written from the MQTT task, read by telemetry
+static SemaphoreHandle_t stats_mutex;
+static StaticSemaphore_t stats_mutex_buffer;
+static handshake_stats_t full_handshakes;
+static handshake_stats_t ticket_handshakes;
+static uint32_t failed_handshakes;
+static uint32_t mqtt_sessions_kept;
+
+// esp-tls cannot tell whether the broker took the ticket, so handshakes are split by whether
+// one was offered. A refused ticket costs a full handshake on the ticket side.
+static void record_handshake(bool ticket_offered, int64_t elapsed_us, size_t heap_peak) {
+    uint32_t ms = elapsed_us / 1000;
+
+    xSemaphoreTake(stats_mutex, portMAX_DELAY);
+    handshake_stats_t *stats = ticket_offered ? &ticket_handshakes : &full_handshakes;
+    stats->count++;
+    stats->last_ms = ms;
+    if (ms > stats->max_ms) {
+        stats->max_ms = ms;
+    }
+    if (heap_peak > stats->heap_peak) {
+        stats->heap_peak = heap_peak;
+    }
+    xSemaphoreGive(stats_mutex);
+}
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+// Only a broker that answered and turned the handshake down says anything about the ticket.
+// DNS, TCP and socket errors and timeouts do not, and the next attempt can still resume.
+static bool handshake_rejected(esp_tls_t *failed) {
+    esp_tls_error_handle_t error;
+
+    if (esp_tls_get_error_handle(failed, &error) != ESP_OK || error == NULL) {
+        return true;
+    }
+    if (error->last_error != ESP_ERR_MBEDTLS_SSL_HANDSHAKE_FAILED) {
+        return false;
+    }
+    // esp-tls stores mbedTLS codes with the sign flipped
+    int code = error->esp_tls_error_code > 0 ? -error->esp_tls_error_code
+                                             : error->esp_tls_error_code;
+    switch (code) {
+        case MBEDTLS_ERR_NET_RECV_FAILED:
+        case MBEDTLS_ERR_NET_SEND_FAILED:
+        case MBEDTLS_ERR_NET_CONN_RESET:
+        case MBEDTLS_ERR_SSL_TIMEOUT:
+            return false;
+        default:
+            return true;
+    }
+}
+#endif
+
+static int tls_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms) {
+    const mqtt_session_config_t *config = session_config;
+    esp_tls_cfg_t cfg = {
+        .cacert_buf = config->ca_certificate,
+        .cacert_bytes = strlen((const char *)config->ca_certificate) + 1,
+        .clientcert_buf = config->certificate,
+        .clientcert_bytes = strlen((const char *)config->certificate) + 1,
+        .clientkey_buf = config->private_key,
+        .clientkey_bytes = strlen((const char *)config->private_key) + 1,
+        .timeout_ms = timeout_ms,
+    };
+    bool ticket_offered = false;
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    cfg.client_session = cached_session;
+    ticket_offered = cached_session != NULL;
+#endif
+    tls = esp_tls_init();
+    if (tls == NULL) {
+        return -1;
+    }
+
+    // Track the heap's low point over the handshake alone
+    size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    heap_caps_monitor_local_minimum_free_size_start();
+    int64_t start_us = esp_timer_get_time();
+    int ret = esp_tls_conn_new_sync(host, strlen(host), port, &cfg, tls);
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+    size_t free_low = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    heap_caps_monitor_local_minimum_free_size_stop();
+
+    if (ret <= 0) {
+        xSemaphoreTake(stats_mutex, portMAX_DELAY);
+        failed_handshakes++;
+        xSemaphoreGive(stats_mutex);
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+        // A ticket the broker refused starts the next attempt from a full handshake
+        if (cached_session != NULL && handshake_rejected(tls)) {
+            esp_tls_free_client_session(cached_session);
+            cached_session = NULL;
+        }
+#endif
+        esp_tls_conn_destroy(tls);
+        tls = NULL;
+        return -1;
+    }
+    record_handshake(ticket_offered, elapsed_us,
+                     free_before > free_low ? free_before - free_low : 0);
+    ESP_LOGI(TAG, "TLS handshake %s took %" PRId64 " ms",
+             ticket_offered ? "with a ticket" : "without a ticket", elapsed_us / 1000);
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    esp_tls_client_session_t *session = esp_tls_get_client_session(tls);
+    if (session != NULL) {
+        if (cached_session != NULL) {
+            esp_tls_free_client_session(cached_session);
+        }
+        cached_session = session;
+    }
+#endif
+    return 0;
+}
+
+// mbedTLS may already hold decrypted bytes the socket no longer shows
+static int tls_poll(int timeout_ms, bool write) {
+    int sockfd;
+    fd_set ready, errors;
+    struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+
+    if (tls == NULL || esp_tls_get_conn_sockfd(tls, &sockfd) != ESP_OK) {
+        return -1;
+    }
+    if (!write && esp_tls_get_bytes_avail(tls) > 0) {
+        return 1;
+    }
+    FD_ZERO(&ready);
+    FD_SET(sockfd, &ready);
+    FD_ZERO(&errors);
+    FD_SET(sockfd, &errors);
+    int ret = select(sockfd + 1, write ? NULL : &ready, write ? &ready : NULL, &errors,
+                     timeout_ms < 0 ? NULL : &timeout);
+    if (ret > 0 && FD_ISSET(sockfd, &errors)) {
+        return -1;
+    }
+    return ret;
+}
+
+static int tls_poll_read(esp_transport_handle_t t, int timeout_ms) {
+    return tls_poll(timeout_ms, false);
+}
+
+static int tls_poll_write(esp_transport_handle_t t, int timeout_ms) {
+    return tls_poll(timeout_ms, true);
+}
+
+static int tls_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms) {
+    int ready = tls_poll(timeout_ms, false);
+    if (ready <= 0) {
+        return ready == 0 ? ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT
+                          : ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+    int ret = esp_tls_conn_read(tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_TIMEOUT) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    if (ret == 0) {
+        return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+    }
+    return ret < 0 ? ERR_TCP_TRANSPORT_CONNECTION_FAILED : ret;
+}
+
+static int tls_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms) {
+    int ready = tls_poll(timeout_ms, true);
+    if (ready <= 0) {
+        return ready;
+    }
+    int ret = esp_tls_conn_write(tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_WRITE) {
+        return 0;
+    }
+    return ret < 0 ? -1 : ret;
+}
+
+static int tls_close(esp_transport_handle_t t) {
+    if (tls != NULL) {
+        esp_tls_conn_destroy(tls);
+        tls = NULL;
+    }
+    return 0;
+}
+
+static esp_transport_handle_t new_tls_transport(void) {
+    esp_transport_handle_t transport = esp_transport_init();
+    if (transport == NULL) {
+        return NULL;
+    }
+    esp_transport_set_func(transport, tls_connect, tls_read, tls_write, tls_close, tls_poll_read,
+                           tls_poll_write, tls_close);
+    esp_transport_set_default_port(transport, MQTT_SESSION_DEFAULT_PORT);
+    return transport;
+}
+
+static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id,
+                               void *event_data) {
+    esp_mqtt_event_handle_t event = event_data;
+
+    switch ((esp_mqtt_event_id_t)event_id) {
+        case MQTT_EVENT_CONNECTED:
+            if (event->session_present) {
+                xSemaphoreTake(stats_mutex, portMAX_DELAY);
+                mqtt_sessions_kept++;
+                xSemaphoreGive(stats_mutex);
+            }
+            session_handlers->connected(event);
+            break;
+        case MQTT_EVENT_DISCONNECTED:
+            session_handlers->disconnected(event);
+            break;
+        case MQTT_EVENT_DATA:
+            session_handlers->data(event);
+            break;
+        case MQTT_EVENT_SUBSCRIBED:
+        case MQTT_EVENT_DELETED:
+            session_handlers->subscribed(event);
+            break;
+        case MQTT_EVENT_ERROR:
+            session_handlers->error(event);
+            break;
+        default:
+            break;
+    }
+}
+
+esp_mqtt_client_handle_t mqtt_session_start(const mqtt_session_config_t *config,
+                                            const mqtt_session_handlers_t *handlers) {
+    session_config = config;
+    session_handlers = handlers;
+    stats_mutex = xSemaphoreCreateMutexStatic(&stats_mutex_buffer);
+
+    esp_transport_handle_t transport = new_tls_transport();
+    if (transport == NULL) {
+        ESP_LOGE(TAG, "Failed to create the TLS transport");
+        return NULL;
+    }
+    esp_mqtt_client_config_t mqtt_config = {
+        .broker.address.uri = config->broker_uri,
+        .network.transport = transport,
+        // The connection supervisor restarts the client with backoff
+        .network.disable_auto_reconnect = true,
+#ifdef CONFIG_MQTT_PERSISTENT_SESSION
+        .session.disable_clean_session = true,
+#endif
+    };
+    // The broker only finds the session again under the same client ID
+    if (strlen(CONFIG_MQTT_CLIENT_ID) > 0) {
+        mqtt_config.credentials.client_id = CONFIG_MQTT_CLIENT_ID;
+    }
+
+    esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_config);
+    if (client == NULL) {
+        ESP_LOGE(TAG, "Failed to create the MQTT client");
+        return NULL;
+    }
+    esp_mqtt_client_register_event(client, (esp_mqtt_event_id_t)ESP_EVENT_ANY_ID,
+                                   mqtt_event_handler, NULL);
+    esp_err_t ret = esp_mqtt_client_start(client);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start the MQTT client: %s", esp_err_to_name(ret));
+    }
+    return client;
+}
+
+static void write_handshakes(telemetry_writer_t *writer, const char *key,
+                             const handshake_stats_t *stats) {
+    telemetry_begin_object(writer, key);
+    telemetry_write_uint(writer, "n", stats->count);
+    telemetry_write_uint(writer, "last_ms", stats->last_ms);
+    telemetry_write_uint(writer, "max_ms", stats->max_ms);
+    telemetry_write_uint(writer, "heap_peak", stats->heap_peak);
+    telemetry_end_object(writer);
+}
+
+void mqtt_session_write_telemetry(telemetry_writer_t *writer) {
+    handshake_stats_t full, ticket;
+    uint32_t failed, sessions_kept;
+
+    if (stats_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(stats_mutex, portMAX_DELAY);
+    full = full_handshakes;
+    ticket = ticket_handshakes;
+    failed = failed_handshakes;
+    sessions_kept = mqtt_sessions_kept;
+    xSemaphoreGive(stats_mutex);
+
+    write_handshakes(writer, "full", &full);
+    write_handshakes(writer, "ticket_offered", &ticket);
+    telemetry_write_uint(writer, "failed", failed);
+    telemetry_write_uint(writer, "sessions_kept", sessions_kept);
+}
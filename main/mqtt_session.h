@@ -0,0 +1,42 @@
+#ifndef MQTT_SESSION_H
+#define MQTT_SESSION_H
+
+#include <stdint.h>
+
+#include "mqtt_client.h"
+#include "telemetry_writer.h"
+
+// Owns the MQTT client and its TLS connection. The connection goes through esp-tls with a
+// cached TLS session ticket, so a reconnect resumes the previous session instead of running
+// the full mutual-TLS handshake with the device certificate. The MQTT session is persistent
+// (clean session off): when the broker still has it, the subscriptions made on the previous
+// connection are kept and need not be sent again.
+
+typedef struct {
+    const char *broker_uri;
+    const uint8_t *ca_certificate;  // PEM, verifies the broker
+    const uint8_t *certificate;     // PEM, the device's own
+    const uint8_t *private_key;
+} mqtt_session_config_t;
+
+typedef void (*mqtt_session_handler_t)(esp_mqtt_event_handle_t event);
+
+typedef struct {
+    mqtt_session_handler_t connected;
+    mqtt_session_handler_t disconnected;
+    mqtt_session_handler_t data;
+    mqtt_session_handler_t error;
+    // SUBACKs, and messages the client dropped from its outbox unanswered
+    mqtt_session_handler_t subscribed;
+} mqtt_session_handlers_t;
+
+// Creates and starts the client; reconnecting is left to the connection supervisor
+esp_mqtt_client_handle_t mqtt_session_start(const mqtt_session_config_t *config,
+                                            const mqtt_session_handlers_t *handlers);
+
+// Handshake count, time and heap use, for full handshakes and for those that offered a
+// session ticket. A ticket the broker turns down costs a full handshake under
+// "ticket_offered".
+void mqtt_session_write_telemetry(telemetry_writer_t *writer);
+
+#endif  // MQTT_SESSION_H
@@ -0,0 +1,116 @@
+#include "occupancy.h"
+
+#include <time.h>
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "sdkconfig.h"
+
+// Before SNTP has set the clock motion cannot be placed in an hour bucket
+#define OCCUPANCY_MIN_VALID_YEAR 2024
+
+typedef struct {
+    int64_t since_us;  // Start of the interval
+    uint32_t motion_events;
+    uint32_t activations;
+    uint32_t retriggers;
+    uint32_t unplaced_motion;  // Motion while the clock was not set yet
+    uint16_t motion_by_hour[OCCUPANCY_HOURS];
+    int64_t on_us;
+    uint64_t output_ms;  // Strip output integrated over time, 8.8 channel value milliseconds
+} occupancy_counters_t;
+
+// Written by the LED task, read and reset by telemetry
+static SemaphoreHandle_t occupancy_mutex;
+static StaticSemaphore_t occupancy_mutex_buffer;
+static occupancy_counters_t counters;
+static uint32_t current_output;
+static int64_t output_since_us;
+
+static void accumulate_output(int64_t now_us) {
+    int64_t elapsed_us = now_us - output_since_us;
+
+    if (current_output > 0 && elapsed_us > 0) {
+        counters.on_us += elapsed_us;
+        counters.output_ms += (uint64_t)current_output * elapsed_us / 1000;
+    }
+    output_since_us = now_us;
+}
+
+static int local_hour(void) {
+    time_t now = time(NULL);
+    struct tm local;
+
+    localtime_r(&now, &local);
+    if (local.tm_year + 1900 < OCCUPANCY_MIN_VALID_YEAR) {
+        return -1;
+    }
+    return local.tm_hour;
+}
+
+void occupancy_record_motion(bool activation, bool retrigger) {
+    int hour = local_hour();
+
+    if (occupancy_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(occupancy_mutex, portMAX_DELAY);
+    counters.motion_events++;
+    counters.activations += activation;
+    counters.retriggers += retrigger;
+    if (hour < 0) {
+        counters.unplaced_motion++;
+    } else if (counters.motion_by_hour[hour] < UINT16_MAX) {
+        counters.motion_by_hour[hour]++;
+    }
+    xSemaphoreGive(occupancy_mutex);
+}
+
+void occupancy_set_output(uint32_t output, int64_t now_us) {
+    if (occupancy_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(occupancy_mutex, portMAX_DELAY);
+    accumulate_output(now_us);
+    current_output = output;
+    xSemaphoreGive(occupancy_mutex);
+}
+
+// Each channel draws CONFIG_LED_CHANNEL_CURRENT_MA at a value of 255
+static uint64_t energy_mwh(uint64_t output_ms) {
+    uint64_t ma_ms = output_ms * CONFIG_LED_CHANNEL_CURRENT_MA / (256 * 255);
+    uint64_t mw_ms = ma_ms * CONFIG_LED_SUPPLY_MV / 1000;
+    return mw_ms / (60 * 60 * 1000);
+}
+
+void occupancy_write_telemetry(telemetry_writer_t *writer) {
+    occupancy_counters_t snapshot;
+    int64_t now_us = esp_timer_get_time();
+
+    xSemaphoreTake(occupancy_mutex, portMAX_DELAY);
+    // Light that is on right now counts up to this report
+    accumulate_output(now_us);
+    snapshot = counters;
+    counters = (occupancy_counters_t){.since_us = now_us};
+    xSemaphoreGive(occupancy_mutex);
+
+    telemetry_write_uint(writer, "interval_s", (now_us - snapshot.since_us) / (1000 * 1000));
+    telemetry_write_uint(writer, "motion_events", snapshot.motion_events);
+    telemetry_write_uint(writer, "activations", snapshot.activations);
+    telemetry_write_uint(writer, "retriggers", snapshot.retriggers);
+    telemetry_write_uint(writer, "on_s", snapshot.on_us / (1000 * 1000));
+    telemetry_write_uint(writer, "energy_mwh", energy_mwh(snapshot.output_ms));
+    telemetry_write_uint(writer, "unplaced_motion", snapshot.unplaced_motion);
+    telemetry_begin_array(writer, "motion_by_hour");
+    for (int hour = 0; hour < OCCUPANCY_HOURS; hour++) {
+        telemetry_write_uint(writer, NULL, snapshot.motion_by_hour[hour]);
+    }
+    telemetry_end_array(writer);
+}
+
+void init_occupancy(void) {
+    occupancy_mutex = xSemaphoreCreateMutexStatic(&occupancy_mutex_buffer);
+    counters.since_us = esp_timer_get_time();
+    output_since_us = counters.since_us;
+}
@@ -0,0 +1,26 @@
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "telemetry_writer.h"
+
+// How the hallway was used since the last report: motion events, retriggers, how often and
+// for how long the lights were on, and an estimate of the energy they drew, plus motion
+// counts per hour of the day. Fed by the LED task into fixed-size counters that are reset
+// every time they are written to telemetry.
+
+#define OCCUPANCY_HOURS 24
+
+void init_occupancy(void);
+
+// Motion accepted by the state machine; activation means it turned the lights on from off
+void occupancy_record_motion(bool activation, bool retrigger);
+// The strip's output changed. output is the sum of all channel values on the strip in 8.8
+// fixed point, as sent to the LEDs.
+void occupancy_set_output(uint32_t output, int64_t now_us);
+
+void occupancy_write_telemetry(telemetry_writer_t *writer);
+
+#endif  // OCCUPANCY_H
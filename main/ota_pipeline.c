@@ -0,0 +1,341 @@
+#include "ota_pipeline.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "esp_crt_bundle.h"
+#include "esp_http_client.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "led_handler.h"
+#include "sdkconfig.h"
+
+static const char *TAG = "OTA_PIPELINE";
+
+#define OTA_RETRY_BASE_MS 1000
+#define OTA_RETRY_MAX_SHIFT 5
+#define OTA_ANIMATION_POLL_MS 20
+// Time for the last log lines and telemetry to leave before the restart
+#define OTA_RESTART_DELAY_MS 2000
+
+#define OTA_HTTPS_SCHEME "https://"
+#define OTA_HTTP_SCHEME "http://"
+
+typedef enum {
+    OTA_STATE_IDLE,
+    OTA_STATE_DOWNLOADING,
+    OTA_STATE_FAILED,
+    OTA_STATE_DONE,
+} ota_state_t;
+
+typedef struct {
+    ota_state_t state;
+    uint32_t written;
+    uint32_t image_size;  // 0 until the server has said
+    uint32_t retries;
+    uint32_t resumes;  // Reconnects the server answered with the rest of the image
+    uint32_t write_stalls;
+    uint32_t max_write_ms;
+    uint32_t deferred_ms;  // Spent waiting for animations before writing
+    int64_t started_us;
+    int64_t elapsed_us;
+    esp_err_t error;
+} ota_stats_t;
+
+static StaticTask_t ota_task_buffer;
+static StackType_t ota_task_stack[CONFIG_OTA_TASK_STACK_SIZE];
+static TaskHandle_t ota_task;
+
+// A new request is only taken while no download runs, so the task reads the URL unlocked
+static SemaphoreHandle_t ota_mutex;
+static StaticSemaphore_t ota_mutex_buffer;
+static char request_url[OTA_PIPELINE_MAX_URL];
+static ota_stats_t stats;
+
+// Owned by the OTA task
+static uint8_t chunk[CONFIG_OTA_CHUNK_SIZE];
+static uint32_t image_written;
+static uint32_t image_size;
+
+static const char *state_name(ota_state_t state) {
+    switch (state) {
+        case OTA_STATE_DOWNLOADING:
+            return "downloading";
+        case OTA_STATE_FAILED:
+            return "failed";
+        case OTA_STATE_DONE:
+            return "done";
+        default:
+            return "idle";
+    }
+}
+
+// An animation owns the CPU until it is over; a flash write would freeze it mid-frame
+static esp_err_t write_chunk(esp_ota_handle_t ota, const uint8_t *data, size_t len) {
+    int64_t wait_start_us = esp_timer_get_time();
+
+    while (led_handler_animating()) {
+        vTaskDelay(pdMS_TO_TICKS(OTA_ANIMATION_POLL_MS));
+    }
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t ret = esp_ota_write(ota, data, len);
+    uint32_t write_ms = (esp_timer_get_time() - start_us) / 1000;
+
+    if (ret == ESP_OK) {
+        image_written += len;
+    }
+    xSemaphoreTake(ota_mutex, portMAX_DELAY);
+    stats.deferred_ms += (start_us - wait_start_us) / 1000;
+    stats.write_stalls += write_ms > CONFIG_OTA_STALL_MS;
+    if (write_ms > stats.max_write_ms) {
+        stats.max_write_ms = write_ms;
+    }
+    stats.written = image_written;
+    xSemaphoreGive(ota_mutex);
+    return ret;
+}
+
+// One HTTP request for the part of the image not yet in flash. Sets *retry when the request
+// failed in a way that another attempt may fix.
+static esp_err_t fetch(esp_ota_handle_t ota, const esp_partition_t *partition, bool *retry) {
+    esp_http_client_config_t config = {
+        .url = request_url,
+        .timeout_ms = CONFIG_OTA_HTTP_TIMEOUT_MS,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    uint32_t skip = 0;
+    esp_err_t ret;
+
+    *retry = true;
+    if (client == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (image_written > 0) {
+        char range[32];
+        snprintf(range, sizeof(range), "bytes=%" PRIu32 "-", image_written);
+        esp_http_client_set_header(client, "Range", range);
+    }
+    ret = esp_http_client_open(client, 0);
+    if (ret != ESP_OK) {
+        goto out;
+    }
+
+    int64_t length = esp_http_client_fetch_headers(client);
+    if (length < 0) {
+        ret = ESP_FAIL;
+        goto out;
+    }
+    int status = esp_http_client_get_status_code(client);
+    if (status == 206) {
+        xSemaphoreTake(ota_mutex, portMAX_DELAY);
+        stats.resumes++;
+        xSemaphoreGive(ota_mutex);
+        if (image_size == 0 && length > 0) {
+            image_size = image_written + length;
+        }
+    } else if (status == 200) {
+        // The server ignored the range; read past what is already written
+        skip = image_written;
+        if (length > 0) {
+            image_size = length;
+        }
+    } else {
+        ESP_LOGE(TAG, "Server answered %d", status);
+        ret = ESP_ERR_INVALID_RESPONSE;
+        *retry = status >= 500;
+        goto out;
+    }
+    if (image_size > partition->size) {
+        ESP_LOGE(TAG, "Image of %" PRIu32 " bytes does not fit the slot", image_size);
+        ret = ESP_ERR_INVALID_SIZE;
+        *retry = false;
+        goto out;
+    }
+    xSemaphoreTake(ota_mutex, portMAX_DELAY);
+    stats.image_size = image_size;
+    xSemaphoreGive(ota_mutex);
+
+    while (image_size == 0 || image_written < image_size) {
+        int len = esp_http_client_read(client, (char *)chunk, sizeof(chunk));
+        if (len < 0) {
+            ret = ESP_FAIL;
+            goto out;
+        }
+        if (len == 0) {
+            // A server that sent no length is done when it says so
+            if (image_size == 0 && esp_http_client_is_complete_data_received(client)) {
+                image_size = image_written;
+                break;
+            }
+            ret = ESP_ERR_TIMEOUT;
+            goto out;
+        }
+        size_t skipped = skip < (uint32_t)len ? skip : (uint32_t)len;
+        skip -= skipped;
+        if (skipped == (size_t)len) {
+            continue;
+        }
+        ret = write_chunk(ota, chunk + skipped, len - skipped);
+        if (ret != ESP_OK) {
+            *retry = false;
+            goto out;
+        }
+    }
+    ret = ESP_OK;
+
+out:
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+    return ret;
+}
+
+static esp_err_t download(void) {
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+    esp_ota_handle_t ota;
+    esp_err_t ret;
+
+    if (partition == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    image_written = 0;
+    image_size = 0;
+    // Sectors are erased as the writes reach them, never the whole slot at once
+    ret = esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &ota);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    for (uint32_t attempt = 0;; attempt++) {
+        bool retry;
+        ret = fetch(ota, partition, &retry);
+        if (ret == ESP_OK || !retry || attempt >= CONFIG_OTA_MAX_RETRIES) {
+            break;
+        }
+        uint32_t shift = attempt < OTA_RETRY_MAX_SHIFT ? attempt : OTA_RETRY_MAX_SHIFT;
+        ESP_LOGW(TAG, "Download stopped at %" PRIu32 " bytes (%s), retrying in %" PRIu32 " ms",
+                 image_written, esp_err_to_name(ret), (uint32_t)OTA_RETRY_BASE_MS << shift);
+        xSemaphoreTake(ota_mutex, portMAX_DELAY);
+        stats.retries++;
+        xSemaphoreGive(ota_mutex);
+        vTaskDelay(pdMS_TO_TICKS(OTA_RETRY_BASE_MS << shift));
+    }
+    if (ret != ESP_OK) {
+        esp_ota_abort(ota);
+        return ret;
+    }
+    // Checks the image before it may be booted
+    ret = esp_ota_end(ota);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    return esp_ota_set_boot_partition(partition);
+}
+
+static void ota_pipeline_task(void *arg) {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        ESP_LOGI(TAG, "Downloading %s", request_url);
+
+        esp_err_t ret = download();
+
+        xSemaphoreTake(ota_mutex, portMAX_DELAY);
+        stats.state = ret == ESP_OK ? OTA_STATE_DONE : OTA_STATE_FAILED;
+        stats.error = ret;
+        stats.elapsed_us = esp_timer_get_time() - stats.started_us;
+        xSemaphoreGive(ota_mutex);
+
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "OTA update failed: %s", esp_err_to_name(ret));
+            continue;
+        }
+        ESP_LOGI(TAG, "OTA update of %" PRIu32 " bytes done, restarting", image_written);
+        vTaskDelay(pdMS_TO_TICKS(OTA_RESTART_DELAY_MS));
+        esp_restart();
+    }
+}
+
+static bool has_scheme(const char *url, size_t len, const char *scheme) {
+    size_t scheme_len = strlen(scheme);
+    return len > scheme_len && strncasecmp(url, scheme, scheme_len) == 0;
+}
+
+bool ota_pipeline_request(const char *url, size_t len) {
+    if (len == 0) {
+        url = CONFIG_OTA_FIRMWARE_URL;
+        len = strlen(url);
+    }
+    if (len == 0 || len >= OTA_PIPELINE_MAX_URL) {
+        ESP_LOGE(TAG, "No usable firmware URL in the OTA request");
+        return false;
+    }
+    bool allowed = has_scheme(url, len, OTA_HTTPS_SCHEME);
+#ifdef CONFIG_OTA_ALLOW_HTTP
+    allowed = allowed || has_scheme(url, len, OTA_HTTP_SCHEME);
+#endif
+    if (!allowed) {
+        ESP_LOGE(TAG, "Refusing a firmware URL that is not https://");
+        return false;
+    }
+
+    xSemaphoreTake(ota_mutex, portMAX_DELAY);
+    if (stats.state == OTA_STATE_DOWNLOADING) {
+        xSemaphoreGive(ota_mutex);
+        ESP_LOGW(TAG, "OTA update already running");
+        return false;
+    }
+    memcpy(request_url, url, len);
+    request_url[len] = '\0';
+    stats = (ota_stats_t){
+        .state = OTA_STATE_DOWNLOADING,
+        .started_us = esp_timer_get_time(),
+    };
+    xSemaphoreGive(ota_mutex);
+
+    xTaskNotifyGive(ota_task);
+    return true;
+}
+
+void ota_pipeline_write_telemetry(telemetry_writer_t *writer) {
+    ota_stats_t snapshot;
+
+    xSemaphoreTake(ota_mutex, portMAX_DELAY);
+    snapshot = stats;
+    xSemaphoreGive(ota_mutex);
+
+    int64_t elapsed_us = snapshot.state == OTA_STATE_DOWNLOADING
+                             ? esp_timer_get_time() - snapshot.started_us
+                             : snapshot.elapsed_us;
+    uint32_t elapsed_ms = elapsed_us / 1000;
+
+    telemetry_write_string(writer, "state", state_name(snapshot.state));
+    if (snapshot.state == OTA_STATE_IDLE) {
+        return;
+    }
+    telemetry_write_uint(writer, "written", snapshot.written);
+    telemetry_write_uint(writer, "image_size", snapshot.image_size);
+    telemetry_write_uint(writer, "elapsed_s", elapsed_ms / 1000);
+    telemetry_write_uint(writer, "kbps",
+                         elapsed_ms > 0 ? (uint64_t)snapshot.written * 8 / elapsed_ms : 0);
+    telemetry_write_uint(writer, "retries", snapshot.retries);
+    telemetry_write_uint(writer, "resumes", snapshot.resumes);
+    telemetry_write_uint(writer, "write_stalls", snapshot.write_stalls);
+    telemetry_write_uint(writer, "max_write_ms", snapshot.max_write_ms);
+    telemetry_write_uint(writer, "deferred_ms", snapshot.deferred_ms);
+    if (snapshot.state == OTA_STATE_FAILED) {
+        telemetry_write_string(writer, "error", esp_err_to_name(snapshot.error));
+    }
+}
+
+void init_ota_pipeline(void) {
+    ota_mutex = xSemaphoreCreateMutexStatic(&ota_mutex_buffer);
+    ota_task = xTaskCreateStatic(&ota_pipeline_task, "ota_pipeline", CONFIG_OTA_TASK_STACK_SIZE,
+                                 NULL, CONFIG_OTA_TASK_PRIORITY, ota_task_stack, &ota_task_buffer);
+}
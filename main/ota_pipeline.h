@@ -0,0 +1,27 @@
+#ifndef OTA_PIPELINE_H
+#define OTA_PIPELINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "telemetry_writer.h"
+
+// Downloads a firmware image into the next OTA slot and boots it. The request is copied, so
+// the MQTT event that carried it can go away. The image streams through one chunk buffer,
+// each chunk written to flash before the next is read, and a dropped connection picks up
+// where it stopped with an HTTP Range request. The task runs below the LED task and holds
+// off flash writes while an animation runs, because a write stalls every task that runs
+// from flash.
+
+#define OTA_PIPELINE_MAX_URL 256
+
+void init_ota_pipeline(void);
+
+// `url` need not be NUL-terminated; an empty one means CONFIG_OTA_FIRMWARE_URL. Returns
+// false while a download is running or when the URL does not fit.
+bool ota_pipeline_request(const char *url, size_t len);
+
+// Progress and throughput of the current or last download, retries and flash write stalls
+void ota_pipeline_write_telemetry(telemetry_writer_t *writer);
+
+#endif  // OTA_PIPELINE_H
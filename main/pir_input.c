@@ -0,0 +1,54 @@
+#include "pir_input.h"
+
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#if CONFIG_LED_MOTION_SENSOR_COUNT > 1
+#include "driver/gpio.h"
+#include "esp_timer.h"
+#include "led_handler.h"
+#endif
+
+static const char *TAG = "PIR_INPUT";
+
+#if CONFIG_LED_MOTION_SENSOR_COUNT > 1
+
+#define PIR1_GPIO ((gpio_num_t)CONFIG_LED_MOTION_SENSOR1_GPIO)
+
+// The line stays active for as long as motion goes on, so its release counts as motion too
+// and the shine time runs from the last of it
+static void pir1_isr(void *arg) {
+    led_handler_post_motion_from_isr(LED_MOTION_SENSOR(1), esp_timer_get_time());
+}
+
+void init_pir_input(void) {
+    const gpio_config_t config = {
+        .pin_bit_mask = 1ULL << PIR1_GPIO,
+        .mode = GPIO_MODE_INPUT,
+        .intr_type = PIR_INPUT_SENSOR1_INTR_TYPE,
+    };
+
+    esp_err_t ret = gpio_config(&config);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure GPIO %d: %s", PIR1_GPIO, esp_err_to_name(ret));
+        return;
+    }
+    // The motion sensor manager may have installed the service already
+    ret = gpio_install_isr_service(0);
+    if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(TAG, "Failed to install the GPIO interrupt service: %s", esp_err_to_name(ret));
+        return;
+    }
+    ret = gpio_isr_handler_add(PIR1_GPIO, pir1_isr, NULL);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to attach the second PIR: %s", esp_err_to_name(ret));
+        return;
+    }
+    ESP_LOGI(TAG, "Second PIR on GPIO %d is motion sensor 1", PIR1_GPIO);
+}
+
+#else
+
+void init_pir_input(void) {}
+
+#endif  // CONFIG_LED_MOTION_SENSOR_COUNT > 1
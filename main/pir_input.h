@@ -0,0 +1,14 @@
+#ifndef PIR_INPUT_H
+#define PIR_INPUT_H
+
+// The second PIR (LED_MOTION_SENSOR_COUNT 2), read straight off its pin. Its edges reach the
+// LED task as motion sensor 1, stamped in the interrupt. The first PIR belongs to the motion
+// sensor manager component.
+
+// The interrupt the second PIR's pin is configured with
+#define PIR_INPUT_SENSOR1_INTR_TYPE GPIO_INTR_ANYEDGE
+
+// Call once the LED handler is up; does nothing with a single sensor
+void init_pir_input(void);
+
+#endif  // PIR_INPUT_H
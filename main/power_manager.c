@@ -0,0 +1,162 @@
+#include "power_manager.h"
+
+#include <stdatomic.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#ifdef CONFIG_POWER_SAVE
+#include "driver/gpio.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "esp_wifi.h"
+#include "led_handler.h"
+#include "pir_input.h"
+#endif
+
+static const char *TAG = "POWER_MANAGER";
+
+#ifdef CONFIG_POWER_SAVE
+
+#ifdef CONFIG_POWER_PIR_ACTIVE_LOW
+#define PIR_ACTIVE_LEVEL 0
+#else
+#define PIR_ACTIVE_LEVEL 1
+#endif
+#ifdef CONFIG_LED_MOTION_SENSOR1_ACTIVE_LOW
+#define PIR1_ACTIVE_LEVEL 0
+#else
+#define PIR1_ACTIVE_LEVEL 1
+#endif
+
+#if CONFIG_POWER_PIR_INTR_NEGEDGE
+#define PIR_INTR_TYPE GPIO_INTR_NEGEDGE
+#elif CONFIG_POWER_PIR_INTR_ANYEDGE
+#define PIR_INTR_TYPE GPIO_INTR_ANYEDGE
+#else
+#define PIR_INTR_TYPE GPIO_INTR_POSEDGE
+#endif
+
+// Indexed by the LED handler's motion sensor number. intr_type is the interrupt the pin's
+// owner configured, put back after every sleep.
+static const struct {
+    gpio_num_t gpio;
+    int active_level;
+    gpio_int_type_t intr_type;
+} pirs[] = {
+    {(gpio_num_t)CONFIG_POWER_PIR_GPIO, PIR_ACTIVE_LEVEL, PIR_INTR_TYPE},
+#if CONFIG_LED_MOTION_SENSOR_COUNT > 1
+    {(gpio_num_t)CONFIG_LED_MOTION_SENSOR1_GPIO, PIR1_ACTIVE_LEVEL, PIR_INPUT_SENSOR1_INTR_TYPE},
+#endif
+};
+#define PIR_COUNT (sizeof(pirs) / sizeof(pirs[0]))
+
+// Counted by the light sleep callbacks, read and reset by telemetry
+static atomic_uint light_sleeps;
+static atomic_uint pir_wakeups;
+static atomic_llong slept_us;
+static int64_t since_us;
+
+// Light sleep only sees levels, so each pin is armed for the level it is not at now. Waking
+// when a PIR goes quiet is cheap, and lets the next sleep watch for motion again.
+static esp_err_t enter_light_sleep(int64_t sleep_time_us, void *arg) {
+    for (size_t i = 0; i < PIR_COUNT; i++) {
+        int level = gpio_get_level(pirs[i].gpio);
+        gpio_wakeup_enable(pirs[i].gpio, level ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+    }
+    return ESP_OK;
+}
+
+// The sensor's edge may have come and gone while the chip slept, so motion that woke it is
+// handed to the LED task from here
+static esp_err_t exit_light_sleep(int64_t sleep_time_us, void *arg) {
+    bool gpio_wakeup = esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO;
+    uint32_t sensors = 0;
+
+    for (size_t i = 0; i < PIR_COUNT; i++) {
+        gpio_wakeup_disable(pirs[i].gpio);
+        gpio_set_intr_type(pirs[i].gpio, pirs[i].intr_type);
+        if (gpio_wakeup && gpio_get_level(pirs[i].gpio) == pirs[i].active_level) {
+            sensors |= LED_MOTION_SENSOR(i);
+        }
+    }
+
+    atomic_fetch_add(&light_sleeps, 1);
+    atomic_fetch_add(&slept_us, sleep_time_us);
+    if (sensors != 0) {
+        atomic_fetch_add(&pir_wakeups, 1);
+        led_handler_post_wakeup(sensors, esp_timer_get_time());
+    }
+    return ESP_OK;
+}
+
+void init_power_manager(void) {
+    esp_pm_config_t config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_POWER_MIN_CPU_FREQ_MHZ,
+        .light_sleep_enable = true,
+    };
+    esp_pm_sleep_cbs_register_config_t callbacks = {
+        .enter_cb = enter_light_sleep,
+        .exit_cb = exit_light_sleep,
+    };
+
+    since_us = esp_timer_get_time();
+    ESP_ERROR_CHECK(esp_sleep_enable_gpio_wakeup());
+    ESP_ERROR_CHECK(esp_pm_light_sleep_register_cbs(&callbacks));
+
+    esp_err_t ret = esp_pm_configure(&config);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure power management: %s", esp_err_to_name(ret));
+        return;
+    }
+    ESP_LOGI(TAG, "CPU at %d-%d MHz, light sleep when idle, wakeup on %u PIR pins",
+             CONFIG_POWER_MIN_CPU_FREQ_MHZ, CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+             (unsigned)PIR_COUNT);
+}
+
+// Without modem sleep the radio keeps the chip awake
+void power_manager_wifi_started(void) {
+    esp_err_t ret = esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Could not enable WiFi modem sleep: %s", esp_err_to_name(ret));
+    }
+}
+
+void power_manager_write_telemetry(telemetry_writer_t *writer) {
+    int64_t now_us = esp_timer_get_time();
+    int64_t interval_us = now_us - since_us;
+    int64_t asleep_us = atomic_exchange(&slept_us, 0);
+
+    since_us = now_us;
+    if (interval_us <= 0) {
+        interval_us = 1;
+    }
+    if (asleep_us > interval_us) {
+        asleep_us = interval_us;
+    }
+    // Board current averaged over the interval; the LEDs' own draw is in occupancy
+    uint64_t awake_ua_us =
+        (uint64_t)(interval_us - asleep_us) * CONFIG_POWER_AWAKE_CURRENT_MA * 1000;
+    uint64_t asleep_ua_us = (uint64_t)asleep_us * CONFIG_POWER_SLEEP_CURRENT_UA;
+
+    telemetry_write_bool(writer, "enabled", true);
+    telemetry_write_uint(writer, "interval_s", interval_us / (1000 * 1000));
+    telemetry_write_uint(writer, "light_sleeps", atomic_exchange(&light_sleeps, 0));
+    telemetry_write_uint(writer, "pir_wakeups", atomic_exchange(&pir_wakeups, 0));
+    telemetry_write_uint(writer, "asleep_permille", asleep_us * 1000 / interval_us);
+    telemetry_write_uint(writer, "est_current_ua", (awake_ua_us + asleep_ua_us) / interval_us);
+}
+
+#else
+
+void init_power_manager(void) { ESP_LOGI(TAG, "Power management disabled"); }
+
+void power_manager_wifi_started(void) {}
+
+void power_manager_write_telemetry(telemetry_writer_t *writer) {
+    telemetry_write_bool(writer, "enabled", false);
+}
+
+#endif  // CONFIG_POWER_SAVE
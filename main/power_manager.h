@@ -0,0 +1,20 @@
+#ifndef POWER_MANAGER_H
+#define POWER_MANAGER_H
+
+#include "telemetry_writer.h"
+
+// Lets the chip scale its clock down and drop into light sleep whenever no task has work,
+// with FreeRTOS tickless idle skipping the ticks in between. Whatever needs full speed holds
+// an esp_pm lock while it does: the LED task while it animates, the WiFi and RMT drivers on
+// their own. The PIR lines wake the chip, and that wakeup goes straight to the LED task.
+
+// Call once the lighting is up. It does not wait for the network, so the chip sleeps and the
+// PIRs wake it even when WiFi never connects.
+void init_power_manager(void);
+// Puts the WiFi radio in modem sleep; call once WiFi is started
+void power_manager_wifi_started(void);
+
+// Light sleep time and the estimated supply current since the previous report
+void power_manager_write_telemetry(telemetry_writer_t *writer);
+
+#endif  // POWER_MANAGER_H
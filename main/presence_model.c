@@ -0,0 +1,333 @@
+#include "presence_model.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "sdkconfig.h"
+
+#if defined(CONFIG_PRESENCE_MODEL) && !defined(CONFIG_IDF_TARGET_LINUX)
+#include "nvs.h"
+#endif
+
+static const char *TAG = "PRESENCE_MODEL";
+
+#ifdef CONFIG_PRESENCE_MODEL
+
+// Before SNTP has set the clock there is no time of day to learn from
+#define PRESENCE_MIN_VALID_YEAR 2024
+#define PRESENCE_NVS_NAMESPACE "presence"
+#define PRESENCE_NVS_KEY "model"
+#define PRESENCE_TABLE_VERSION 1
+#define PRESENCE_PROBABILITY_MAX 0xFFFF
+// Each day moves a half hour's odds a quarter of the way, so a week back still counts a
+// little. The gap gains are the ones TCP uses for its round trip time (RFC 6298).
+#define PRESENCE_ARRIVAL_GAIN 4
+#define PRESENCE_GAP_GAIN 8
+#define PRESENCE_GAP_DEV_GAIN 4
+#define PRESENCE_MIN_GAP_SAMPLES 16
+// How often to look for the clock while it is not set
+#define PRESENCE_CLOCK_POLL_US (60 * 1000 * 1000)
+
+// The learned part, kept in NVS as one blob
+typedef struct {
+    uint8_t version;
+    uint16_t arrival[PRESENCE_BUCKETS];  // Odds of an arrival, of PRESENCE_PROBABILITY_MAX
+    uint32_t gap_ms;                     // Smoothed gap between motion events while lit
+    uint32_t gap_dev_ms;                 // and its smoothed deviation
+    uint32_t gap_samples;
+} presence_table_t;
+
+typedef struct {
+    uint32_t arrivals;
+    uint32_t predicted;     // Arrivals in a half hour that was called likely
+    uint32_t returns;       // Motion while the lights faded out or soon after they went dark
+    uint32_t likely_slots;  // Half hours called likely
+} presence_counters_t;
+
+// Updated by the LED task, read by telemetry
+static SemaphoreHandle_t model_mutex;
+static StaticSemaphore_t model_mutex_buffer;
+static presence_table_t table = {.version = PRESENCE_TABLE_VERSION};
+static presence_counters_t counters;
+static presence_decision_t current;
+static bool loaded;
+// Half hours since 1970, local time, up to which the table is up to date
+static int64_t folded_slot = -1;
+// Half hours of the day with an arrival since they were last folded in
+static uint64_t arrived;
+// Set when motion closed a half hour, so the next decision saves the table
+static bool unsaved;
+static int64_t last_motion_us = -1;
+static int64_t dark_since_us = -1;
+
+// Half hours since 1970 in local time, or -1 while the clock is not set. *left_s is set to
+// the seconds until the next one starts.
+static int64_t local_slot(int *left_s) {
+    time_t now = time(NULL);
+    struct tm local;
+
+    localtime_r(&now, &local);
+    int year = local.tm_year + 1900;
+    if (year < PRESENCE_MIN_VALID_YEAR) {
+        return -1;
+    }
+    // Leap days between 1970 and the start of this year
+    int before = year - 1;
+    int64_t leap_days =
+        (before / 4 - before / 100 + before / 400) - (1969 / 4 - 1969 / 100 + 1969 / 400);
+    int64_t days = 365LL * (year - 1970) + leap_days + local.tm_yday;
+    int second = local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec;
+    int bucket_s = PRESENCE_BUCKET_MINUTES * 60;
+
+    *left_s = bucket_s - second % bucket_s;
+    return days * PRESENCE_BUCKETS + second / bucket_s;
+}
+
+// Closes every half hour before `slot`. After a quiet spell of more than a day each one is
+// closed once rather than once per day missed, which keeps the update bounded. Returns
+// whether any closed.
+static bool fold(int64_t slot) {
+    if (folded_slot < 0 || slot < folded_slot) {
+        // First look at the clock, or it was set back
+        folded_slot = slot;
+        return false;
+    }
+    int64_t count = slot - folded_slot;
+    if (count > PRESENCE_BUCKETS) {
+        count = PRESENCE_BUCKETS;
+    }
+    for (int64_t s = slot - count; s < slot; s++) {
+        int bucket = s % PRESENCE_BUCKETS;
+        int32_t target = (arrived >> bucket) & 1 ? PRESENCE_PROBABILITY_MAX : 0;
+        table.arrival[bucket] += (target - table.arrival[bucket]) / PRESENCE_ARRIVAL_GAIN;
+        arrived &= ~(1ULL << bucket);
+    }
+    folded_slot = slot;
+    return count > 0;
+}
+
+static void add_gap(int64_t gap_us) {
+    int32_t gap_ms = gap_us / 1000;
+
+    if (table.gap_samples == 0) {
+        table.gap_ms = gap_ms;
+        table.gap_dev_ms = gap_ms / 2;
+    } else {
+        int32_t error = gap_ms - (int32_t)table.gap_ms;
+        table.gap_dev_ms += (abs(error) - (int32_t)table.gap_dev_ms) / PRESENCE_GAP_DEV_GAIN;
+        table.gap_ms += error / PRESENCE_GAP_GAIN;
+    }
+    if (table.gap_samples < UINT32_MAX) {
+        table.gap_samples++;
+    }
+}
+
+#ifndef CONFIG_IDF_TARGET_LINUX
+// ESP_OK once the stored table is in, or when there is none to load. Any other error, such as
+// NVS not being up yet, leaves the table alone so the load can be tried again.
+static esp_err_t load_table(void) {
+    presence_table_t stored;
+    size_t len = sizeof(stored);
+    nvs_handle_t nvs;
+
+    esp_err_t ret = nvs_open(PRESENCE_NVS_NAMESPACE, NVS_READONLY, &nvs);
+    if (ret == ESP_ERR_NVS_NOT_FOUND) {
+        return ESP_OK;
+    }
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = nvs_get_blob(nvs, PRESENCE_NVS_KEY, &stored, &len);
+    nvs_close(nvs);
+    // A table saved by another layout is not worth keeping
+    if (ret == ESP_ERR_NVS_NOT_FOUND || ret == ESP_ERR_NVS_INVALID_LENGTH) {
+        return ESP_OK;
+    }
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (len == sizeof(stored) && stored.version == PRESENCE_TABLE_VERSION) {
+        table = stored;
+        ESP_LOGI(TAG, "Loaded presence model with %" PRIu32 " gaps", stored.gap_samples);
+    }
+    return ESP_OK;
+}
+
+static void save_table(const presence_table_t *snapshot) {
+    nvs_handle_t nvs;
+
+    if (nvs_open(PRESENCE_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    esp_err_t ret = nvs_set_blob(nvs, PRESENCE_NVS_KEY, snapshot, sizeof(*snapshot));
+    if (ret == ESP_OK) {
+        ret = nvs_commit(nvs);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to save the presence model: %s", esp_err_to_name(ret));
+    }
+    nvs_close(nvs);
+}
+#else
+static esp_err_t load_table(void) { return ESP_OK; }
+static void save_table(const presence_table_t *snapshot) {}
+#endif
+
+void presence_model_motion(led_state_t state, int64_t now_us) {
+    int left_s;
+    int64_t slot = local_slot(&left_s);
+
+    if (model_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(model_mutex, portMAX_DELAY);
+    if (!loaded || slot < 0) {
+        xSemaphoreGive(model_mutex);
+        return;
+    }
+    // The LED task may not have woken for the new half hour yet
+    unsaved |= fold(slot);
+    bool returned = state == LED_STATE_RAMPING_DOWN ||
+                    (state == LED_STATE_OFF && dark_since_us >= 0 &&
+                     now_us - dark_since_us <= (int64_t)CONFIG_PRESENCE_RETURN_S * 1000 * 1000);
+    // A return means the shine time was shorter than this gap, which is worth learning from
+    if (last_motion_us >= 0 && (state != LED_STATE_OFF || returned)) {
+        add_gap(now_us - last_motion_us);
+    }
+    if (returned) {
+        counters.returns++;
+    } else if (state == LED_STATE_OFF) {
+        counters.arrivals++;
+        counters.predicted += current.arrival_likely;
+        arrived |= 1ULL << (slot % PRESENCE_BUCKETS);
+    }
+    last_motion_us = now_us;
+    xSemaphoreGive(model_mutex);
+}
+
+void presence_model_lights_out(int64_t now_us) {
+    if (model_mutex == NULL) {
+        return;
+    }
+    xSemaphoreTake(model_mutex, portMAX_DELAY);
+    dark_since_us = now_us;
+    xSemaphoreGive(model_mutex);
+}
+
+void presence_model_decide(int64_t now_us, presence_decision_t *decision) {
+    presence_table_t snapshot;
+    int left_s;
+    int64_t slot = local_slot(&left_s);
+
+    *decision = (presence_decision_t){
+        .ramp_percent = 100,
+        .recheck_us = now_us + PRESENCE_CLOCK_POLL_US,
+    };
+    if (model_mutex == NULL || slot < 0) {
+        return;
+    }
+    xSemaphoreTake(model_mutex, portMAX_DELAY);
+    // The clock survives a soft reset, so this can run before NVS is up. Until the table
+    // loads the model stays out of the way, and nothing overwrites what is stored.
+    if (!loaded) {
+        esp_err_t ret = load_table();
+        if (ret != ESP_OK) {
+            xSemaphoreGive(model_mutex);
+            ESP_LOGW(TAG, "Presence model not loaded yet: %s", esp_err_to_name(ret));
+            return;
+        }
+        loaded = true;
+    }
+    bool closed = fold(slot) || unsaved;
+    unsaved = false;
+    uint32_t odds = table.arrival[slot % PRESENCE_BUCKETS];
+    decision->arrival_permille = odds * 1000 / PRESENCE_PROBABILITY_MAX;
+    decision->arrival_likely = decision->arrival_permille >= CONFIG_PRESENCE_LIKELY_PERCENT * 10;
+    if (decision->arrival_likely) {
+        decision->prelight_percent = CONFIG_PRESENCE_PRELIGHT_PERCENT;
+        decision->ramp_percent = CONFIG_PRESENCE_RAMP_PERCENT;
+    }
+    if (table.gap_samples >= PRESENCE_MIN_GAP_SAMPLES) {
+        uint32_t hold_ms = table.gap_ms + 4 * table.gap_dev_ms;
+        decision->hold_ms = hold_ms > CONFIG_PRESENCE_MIN_SHINE_S * 1000
+                                ? hold_ms
+                                : CONFIG_PRESENCE_MIN_SHINE_S * 1000;
+    }
+    decision->recheck_us = now_us + (int64_t)left_s * 1000 * 1000;
+    if (closed) {
+        counters.likely_slots += decision->arrival_likely;
+    }
+    current = *decision;
+    snapshot = table;
+    xSemaphoreGive(model_mutex);
+
+    // Once per half hour at most, from the LED task between animations
+    if (closed) {
+        save_table(&snapshot);
+    }
+}
+
+void presence_model_write_telemetry(telemetry_writer_t *writer) {
+    presence_table_t learned;
+    presence_counters_t snapshot;
+    presence_decision_t decision;
+    bool active;
+
+    xSemaphoreTake(model_mutex, portMAX_DELAY);
+    learned = table;
+    snapshot = counters;
+    decision = current;
+    active = loaded;
+    counters = (presence_counters_t){0};
+    xSemaphoreGive(model_mutex);
+
+    telemetry_write_bool(writer, "enabled", true);
+    telemetry_write_bool(writer, "active", active);
+    if (!active) {
+        return;
+    }
+    telemetry_write_bool(writer, "likely", decision.arrival_likely);
+    telemetry_write_uint(writer, "arrival_permille", decision.arrival_permille);
+    telemetry_write_uint(writer, "prelight_percent", decision.prelight_percent);
+    telemetry_write_uint(writer, "ramp_percent", decision.ramp_percent);
+    telemetry_write_uint(writer, "hold_s", decision.hold_ms / 1000);
+    telemetry_write_uint(writer, "gap_ms", learned.gap_ms);
+    telemetry_write_uint(writer, "gap_dev_ms", learned.gap_dev_ms);
+    telemetry_write_uint(writer, "gap_samples", learned.gap_samples);
+    telemetry_write_uint(writer, "arrivals", snapshot.arrivals);
+    telemetry_write_uint(writer, "predicted", snapshot.predicted);
+    telemetry_write_uint(writer, "returns", snapshot.returns);
+    telemetry_write_uint(writer, "likely_slots", snapshot.likely_slots);
+    telemetry_begin_array(writer, "arrival_by_half_hour");
+    for (int bucket = 0; bucket < PRESENCE_BUCKETS; bucket++) {
+        telemetry_write_uint(writer, NULL,
+                             (uint32_t)learned.arrival[bucket] * 1000 / PRESENCE_PROBABILITY_MAX);
+    }
+    telemetry_end_array(writer);
+}
+
+void init_presence_model(void) {
+    model_mutex = xSemaphoreCreateMutexStatic(&model_mutex_buffer);
+}
+
+#else
+
+void init_presence_model(void) { ESP_LOGI(TAG, "Presence model disabled"); }
+
+void presence_model_motion(led_state_t state, int64_t now_us) {}
+
+void presence_model_lights_out(int64_t now_us) {}
+
+void presence_model_decide(int64_t now_us, presence_decision_t *decision) {
+    *decision = (presence_decision_t){.ramp_percent = 100, .recheck_us = LED_SM_NO_DEADLINE};
+}
+
+void presence_model_write_telemetry(telemetry_writer_t *writer) {
+    telemetry_write_bool(writer, "enabled", false);
+}
+
+#endif  // CONFIG_PRESENCE_MODEL
@@ -0,0 +1,44 @@
+#ifndef PRESENCE_MODEL_H
+#define PRESENCE_MODEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "led_state_machine.h"
+#include "telemetry_writer.h"
+
+// Learns when the hallway is used and how long people stay. Each half hour of the day has
+// the probability that someone arrives in it, smoothed over the last week or so of days,
+// and the gaps between motion events while the lights are on are smoothed into a mean and
+// a deviation, the way TCP estimates its round trip time. When an arrival is likely the
+// LED task pre-lights the strip and shortens the turn-on animation; the shine time is cut
+// to what the gaps call for. Everything is a fixed-size table updated in constant time, and
+// it is kept in NVS across reboots. Nothing is decided before the clock is set.
+
+#define PRESENCE_BUCKET_MINUTES 30
+#define PRESENCE_BUCKETS (24 * 60 / PRESENCE_BUCKET_MINUTES)
+
+typedef struct {
+    bool arrival_likely;
+    uint16_t arrival_permille;  // For the current half hour
+    uint8_t prelight_percent;   // Of the target brightness, shown while the strip is off
+    uint8_t ramp_percent;       // Of the turn-on animation's usual time
+    uint32_t hold_ms;           // Shine time the gaps call for, 0 until enough were seen
+    int64_t recheck_us;         // When the decision may change without motion
+} presence_decision_t;
+
+void init_presence_model(void);
+
+// Motion the lights reacted to; `state` is the strip's state just before it
+void presence_model_motion(led_state_t state, int64_t now_us);
+// The strip went dark
+void presence_model_lights_out(int64_t now_us);
+
+// Called from the LED task only; may write the model to NVS when a half hour has passed
+void presence_model_decide(int64_t now_us, presence_decision_t *decision);
+
+// The current decision, the learned table and how well the predictions did since the last
+// report
+void presence_model_write_telemetry(telemetry_writer_t *writer);
+
+#endif  // PRESENCE_MODEL_H
@@ -0,0 +1,233 @@
+#include "telemetry_writer.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+// JSON encoding
+
+static void put(telemetry_writer_t *writer, const char *data, size_t len) {
+    if (writer->overflow || writer->len + len > writer->cap) {
+        writer->overflow = true;
+        return;
+    }
+    memcpy(writer->buf + writer->len, data, len);
+    writer->len += len;
+}
+
+static void put_str(telemetry_writer_t *writer, const char *str) { put(writer, str, strlen(str)); }
+
+static void put_quoted(telemetry_writer_t *writer, const char *str) {
+    put(writer, "\"", 1);
+    for (const char *p = str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            put(writer, "\\", 1);
+        }
+        // Control characters have no place in our keys or values
+        if ((unsigned char)*p >= 0x20) {
+            put(writer, p, 1);
+        }
+    }
+    put(writer, "\"", 1);
+}
+
+// CBOR encoding
+
+#define CBOR_UINT 0
+#define CBOR_NEGATIVE 1
+#define CBOR_TEXT 3
+#define CBOR_ARRAY_START 0x9F
+#define CBOR_MAP_START 0xBF
+#define CBOR_FALSE 0xF4
+#define CBOR_TRUE 0xF5
+#define CBOR_BREAK 0xFF
+
+static void put_byte(telemetry_writer_t *writer, uint8_t byte) {
+    put(writer, (const char *)&byte, 1);
+}
+
+// Major type and argument, in the shortest form
+static void put_head(telemetry_writer_t *writer, uint8_t major, uint64_t value) {
+    uint8_t head[9];
+    int bytes;
+
+    if (value < 24) {
+        put_byte(writer, (major << 5) | value);
+        return;
+    }
+    if (value <= UINT8_MAX) {
+        head[0] = (major << 5) | 24;
+        bytes = 1;
+    } else if (value <= UINT16_MAX) {
+        head[0] = (major << 5) | 25;
+        bytes = 2;
+    } else if (value <= UINT32_MAX) {
+        head[0] = (major << 5) | 26;
+        bytes = 4;
+    } else {
+        head[0] = (major << 5) | 27;
+        bytes = 8;
+    }
+    for (int i = 0; i < bytes; i++) {
+        head[1 + i] = value >> (8 * (bytes - 1 - i));
+    }
+    put(writer, (const char *)head, 1 + bytes);
+}
+
+static void put_text(telemetry_writer_t *writer, const char *str) {
+    size_t len = strlen(str);
+    put_head(writer, CBOR_TEXT, len);
+    put(writer, str, len);
+}
+
+static bool is_cbor(const telemetry_writer_t *writer) {
+    return writer->format == TELEMETRY_FORMAT_CBOR;
+}
+
+static void begin_item(telemetry_writer_t *writer, const char *key) {
+    uint8_t bit = 1u << writer->depth;
+
+    if (is_cbor(writer)) {
+        if (key != NULL && !(writer->in_array & bit)) {
+            put_text(writer, key);
+        }
+        return;
+    }
+
+    if (writer->has_items & bit) {
+        put(writer, ",", 1);
+    }
+    writer->has_items |= bit;
+    if (key != NULL && !(writer->in_array & bit)) {
+        put_quoted(writer, key);
+        put(writer, ":", 1);
+    }
+}
+
+static void open_level(telemetry_writer_t *writer, bool array) {
+    if (writer->depth + 1 >= TELEMETRY_WRITER_MAX_DEPTH) {
+        writer->overflow = true;
+        return;
+    }
+    writer->depth++;
+    uint8_t bit = 1u << writer->depth;
+    writer->has_items &= ~bit;
+    if (array) {
+        writer->in_array |= bit;
+    } else {
+        writer->in_array &= ~bit;
+    }
+}
+
+void telemetry_writer_init(telemetry_writer_t *writer, uint8_t *buf, size_t cap) {
+    telemetry_writer_init_format(writer, TELEMETRY_FORMAT_JSON, buf, cap);
+}
+
+void telemetry_writer_init_format(telemetry_writer_t *writer, telemetry_format_t format,
+                                  uint8_t *buf, size_t cap) {
+    writer->format = format;
+    writer->buf = buf;
+    writer->cap = cap;
+    writer->len = 0;
+    writer->depth = 0;
+    writer->in_array = 0;
+    writer->has_items = 0;
+    writer->overflow = false;
+    if (is_cbor(writer)) {
+        put_byte(writer, CBOR_MAP_START);
+    } else {
+        put(writer, "{", 1);
+    }
+}
+
+size_t telemetry_writer_finish(telemetry_writer_t *writer) {
+    if (is_cbor(writer)) {
+        put_byte(writer, CBOR_BREAK);
+    } else {
+        put(writer, "}", 1);
+    }
+    return writer->overflow || writer->depth != 0 ? 0 : writer->len;
+}
+
+void telemetry_begin_object(telemetry_writer_t *writer, const char *key) {
+    begin_item(writer, key);
+    if (is_cbor(writer)) {
+        put_byte(writer, CBOR_MAP_START);
+    } else {
+        put(writer, "{", 1);
+    }
+    open_level(writer, false);
+}
+
+void telemetry_end_object(telemetry_writer_t *writer) {
+    if (is_cbor(writer)) {
+        put_byte(writer, CBOR_BREAK);
+    } else {
+        put(writer, "}", 1);
+    }
+    writer->depth--;
+}
+
+void telemetry_begin_array(telemetry_writer_t *writer, const char *key) {
+    begin_item(writer, key);
+    if (is_cbor(writer)) {
+        put_byte(writer, CBOR_ARRAY_START);
+    } else {
+        put(writer, "[", 1);
+    }
+    open_level(writer, true);
+}
+
+void telemetry_end_array(telemetry_writer_t *writer) {
+    if (is_cbor(writer)) {
+        put_byte(writer, CBOR_BREAK);
+    } else {
+        put(writer, "]", 1);
+    }
+    writer->depth--;
+}
+
+void telemetry_write_uint(telemetry_writer_t *writer, const char *key, uint64_t value) {
+    char num[24];
+    begin_item(writer, key);
+    if (is_cbor(writer)) {
+        put_head(writer, CBOR_UINT, value);
+        return;
+    }
+    snprintf(num, sizeof(num), "%" PRIu64, value);
+    put_str(writer, num);
+}
+
+void telemetry_write_int(telemetry_writer_t *writer, const char *key, int64_t value) {
+    char num[24];
+    begin_item(writer, key);
+    if (is_cbor(writer)) {
+        // Negative integers are stored as -1 - n
+        if (value < 0) {
+            put_head(writer, CBOR_NEGATIVE, (uint64_t)(-1 - value));
+        } else {
+            put_head(writer, CBOR_UINT, (uint64_t)value);
+        }
+        return;
+    }
+    snprintf(num, sizeof(num), "%" PRId64, value);
+    put_str(writer, num);
+}
+
+void telemetry_write_bool(telemetry_writer_t *writer, const char *key, bool value) {
+    begin_item(writer, key);
+    if (is_cbor(writer)) {
+        put_byte(writer, value ? CBOR_TRUE : CBOR_FALSE);
+        return;
+    }
+    put_str(writer, value ? "true" : "false");
+}
+
+void telemetry_write_string(telemetry_writer_t *writer, const char *key, const char *value) {
+    begin_item(writer, key);
+    if (is_cbor(writer)) {
+        put_text(writer, value);
+        return;
+    }
+    put_quoted(writer, value);
+}
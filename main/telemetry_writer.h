@@ -0,0 +1,59 @@
+#ifndef TELEMETRY_WRITER_H
+#define TELEMETRY_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+// Streams a telemetry document straight into a caller-owned buffer, with no allocation.
+// Keys are ignored inside arrays. If the buffer runs out the writer stops writing and
+// reports overflow from telemetry_writer_finish().
+//
+// The document is JSON or CBOR (RFC 8949). CBOR maps and arrays are written with
+// indefinite lengths, so nothing has to be counted ahead of time.
+
+#define TELEMETRY_WRITER_MAX_DEPTH 8
+
+typedef enum {
+    TELEMETRY_FORMAT_JSON = 0,
+    TELEMETRY_FORMAT_CBOR,
+} telemetry_format_t;
+
+// Format picked in Kconfig for device telemetry
+#if CONFIG_TELEMETRY_FORMAT_CBOR
+#define TELEMETRY_FORMAT_DEFAULT TELEMETRY_FORMAT_CBOR
+#else
+#define TELEMETRY_FORMAT_DEFAULT TELEMETRY_FORMAT_JSON
+#endif
+
+typedef struct {
+    telemetry_format_t format;
+    uint8_t *buf;
+    size_t cap;
+    size_t len;
+    int depth;
+    uint8_t in_array;   // Bit per nesting level
+    uint8_t has_items;  // Bit per nesting level
+    bool overflow;
+} telemetry_writer_t;
+
+// Starts a JSON document
+void telemetry_writer_init(telemetry_writer_t *writer, uint8_t *buf, size_t cap);
+void telemetry_writer_init_format(telemetry_writer_t *writer, telemetry_format_t format,
+                                  uint8_t *buf, size_t cap);
+// Returns the encoded length, or 0 if the document did not fit
+size_t telemetry_writer_finish(telemetry_writer_t *writer);
+
+void telemetry_begin_object(telemetry_writer_t *writer, const char *key);
+void telemetry_end_object(telemetry_writer_t *writer);
+void telemetry_begin_array(telemetry_writer_t *writer, const char *key);
+void telemetry_end_array(telemetry_writer_t *writer);
+
+void telemetry_write_uint(telemetry_writer_t *writer, const char *key, uint64_t value);
+void telemetry_write_int(telemetry_writer_t *writer, const char *key, int64_t value);
+void telemetry_write_bool(telemetry_writer_t *writer, const char *key, bool value);
+void telemetry_write_string(telemetry_writer_t *writer, const char *key, const char *value);
+
+#endif  // TELEMETRY_WRITER_H
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""Format deferred log records printed with CONFIG_BINLOG_HOST_FORMAT.
+
+The device prints each record as a hex line:
+
+    BL <level> <timestamp_ms> <tag address> <format address> <arg0> <arg1> <arg2> <arg3>
+
+Tags, format strings and %s arguments are addresses in the firmware image, so they are read
+back from the ELF the device is running. Other lines are passed through unchanged, which
+lets the script sit on the serial monitor output:
+
+    idf.py monitor | scripts/binlog_decode.py build/firmware.elf
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+SHT_NOBITS = 8
+SHF_ALLOC = 0x2
+
+CONVERSION = re.compile(r"%([-+ #0]*\d*(?:\.\d+)?)(?:hh|h|ll|l|z|j|t)?([diouxXcsp%])")
+
+
+class Image:
+    """Loadable sections of a 32-bit little-endian ELF, addressed as on the device."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            data = f.read()
+        if data[:4] != b"\x7fELF" or data[4] != 1:
+            raise ValueError(f"{path} is not a 32-bit ELF file")
+
+        shoff, = struct.unpack_from("<I", data, 0x20)
+        shentsize, shnum = struct.unpack_from("<HH", data, 0x2E)
+        self.sections = []
+        for i in range(shnum):
+            _, sh_type, flags, addr, offset, size = struct.unpack_from(
+                "<IIIIII", data, shoff + i * shentsize)
+            if flags & SHF_ALLOC and sh_type != SHT_NOBITS and size > 0:
+                self.sections.append((addr, data[offset:offset + size]))
+
+    def string(self, addr):
+        for start, content in self.sections:
+            if start <= addr < start + len(content):
+                end = content.find(b"\0", addr - start)
+                return content[addr - start:end].decode("utf-8", "replace")
+        return f"<0x{addr:08x}>"
+
+
+def format_record(image, fmt, args):
+    args = iter(args)
+
+    def convert(match):
+        flags, kind = match.groups()
+        if kind == "%":
+            return "%"
+        value = next(args, 0)
+        if kind == "s":
+            return ("%" + flags + "s") % image.string(value)
+        if kind in "di" and value & 0x80000000:
+            value -= 1 << 32
+        if kind == "p":
+            return f"0x{value:x}"
+        if kind == "c":
+            return chr(value & 0xFF)
+        return ("%" + flags + kind) % value
+
+    return CONVERSION.sub(convert, fmt)
+
+
+def decode_line(image, line):
+    fields = line.split()
+    if len(fields) != 9 or fields[0] != "BL":
+        return line
+    level = fields[1]
+    timestamp, tag, fmt, *args = (int(field, 16) for field in fields[2:])
+    message = format_record(image, image.string(fmt), args)
+    return f"{level} ({timestamp}) {image.string(tag)}: {message}"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("elf", help="firmware ELF the records came from")
+    parser.add_argument("log", nargs="?", type=argparse.FileType("r"), default=sys.stdin,
+                        help="captured output (default: stdin)")
+    args = parser.parse_args()
+
+    image = Image(args.elf)
+    for line in args.log:
+        print(decode_line(image, line.rstrip("\n")), flush=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""Generate the per-channel gamma tables used by main/led_fade.c.
+
+Each table maps a linear intensity index (0..256, in 1/256 steps) to an 8.8 fixed-point
+PWM value already scaled by the maximum brightness and the white point of the chosen
+color temperature. The fractional byte is what the temporal dithering spreads over frames.
+"""
+
+import argparse
+import math
+
+LUT_SIZE = 257
+
+
+def color_temperature_to_rgb(kelvin):
+    # Tanner Helland's fit of the black body curve, good between 1000K and 40000K
+    t = kelvin / 100.0
+    if t <= 66:
+        r = 255.0
+        g = 99.4708025861 * math.log(t) - 161.1195681661
+    else:
+        r = 329.698727446 * math.pow(t - 60, -0.1332047592)
+        g = 288.1221695283 * math.pow(t - 60, -0.0755148492)
+    if t >= 66:
+        b = 255.0
+    elif t <= 19:
+        b = 0.0
+    else:
+        b = 138.5177312231 * math.log(t - 10) - 305.0447927307
+
+    def clamp(v):
+        return min(max(v, 0.0), 255.0) / 255.0
+
+    return clamp(r), clamp(g), clamp(b)
+
+
+def build_table(gamma, max_brightness, channel_scale):
+    table = []
+    for i in range(LUT_SIZE):
+        value = math.pow(i / (LUT_SIZE - 1), gamma) * max_brightness * channel_scale * 256.0
+        table.append(min(int(round(value)), 255 * 256))
+    return table
+
+
+def format_table(name, table):
+    lines = ["static const uint16_t %s[LED_GAMMA_LUT_SIZE] = {" % name]
+    for i in range(0, len(table), 12):
+        lines.append("    " + ", ".join("%5d" % v for v in table[i:i + 12]) + ",")
+    lines.append("};")
+    return "\n".join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--gamma-x100", type=int, required=True)
+    parser.add_argument("--max-brightness", type=int, required=True)
+    parser.add_argument("--color-temperature", type=int, required=True)
+    parser.add_argument("--output", required=True)
+    args = parser.parse_args()
+
+    gamma = args.gamma_x100 / 100.0
+    r, g, b = color_temperature_to_rgb(args.color_temperature)
+
+    body = [
+        "// Generated by scripts/gen_gamma_lut.py, do not edit.",
+        "// gamma %.2f, max brightness %d, %dK" % (gamma, args.max_brightness,
+                                                  args.color_temperature),
+        "#pragma once",
+        "",
+        "#include <stdint.h>",
+        "",
+        "#define LED_GAMMA_LUT_SIZE %d" % LUT_SIZE,
+        "",
+        format_table("led_gamma_lut_r", build_table(gamma, args.max_brightness, r)),
+        "",
+        format_table("led_gamma_lut_g", build_table(gamma, args.max_brightness, g)),
+        "",
+        format_table("led_gamma_lut_b", build_table(gamma, args.max_brightness, b)),
+        "",
+    ]
+    with open(args.output, "w") as f:
+        f.write("\n".join(body))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+"""Turn uploaded motion trace pages into the plain trace read by the simulator in sim/.
+
+Capture the pages with one hex-encoded payload per line, which works for JSON and CBOR
+alike, then ask the device for its trace:
+
+    mosquitto_sub ... -t <motion trace topic> -F %x > pages.hex
+    scripts/motion_trace_export.py pages.hex > trace.txt
+
+Each page holds the number of its first event, that event's uptime and the gaps to the
+events after it. Pages from several uploads may be mixed; events are kept once each, in
+order, with the uptime carried over its 32-bit rollover. The output is one timestamp in
+milliseconds per line.
+"""
+
+import argparse
+import json
+import sys
+
+UPTIME_WRAP = 1 << 32
+
+
+def decode(payload):
+    if payload[:1] in (b"{", b"["):
+        return json.loads(payload)
+    import cbor2  # pip install cbor2
+
+    return cbor2.loads(payload)
+
+
+def pages(lines):
+    for line in lines:
+        line = line.strip()
+        if not line:
+            continue
+        message = decode(bytes.fromhex(line))
+        # Pages held back while offline arrive batched into an array
+        yield from message if isinstance(message, list) else [message]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("pages", nargs="?", type=argparse.FileType("r"), default=sys.stdin,
+                        help="hex payloads, one per line (default: stdin)")
+    args = parser.parse_args()
+
+    events = {}
+    epoch_ms = None
+    lost = 0
+    for page in pages(args.pages):
+        lost += page.get("lost", 0)
+        if "uptime_ms" not in page:
+            continue
+        uptime_ms = page["uptime_ms"]
+        if epoch_ms is None and "epoch_ms" in page:
+            epoch_ms = page["epoch_ms"] - uptime_ms
+        for i, gap in enumerate(page["gaps_ms"]):
+            uptime_ms = (uptime_ms + gap) % UPTIME_WRAP
+            events[page["first"] + i] = uptime_ms
+
+    if lost:
+        print(f"{lost} events were overwritten before they were uploaded", file=sys.stderr)
+    if epoch_ms is not None:
+        print(f"# epoch_ms at boot {epoch_ms}")
+    previous = None
+    offset = 0
+    for number in sorted(events):
+        if previous is not None and number != previous + 1:
+            print(f"# events {previous + 1} to {number - 1} missing")
+        uptime_ms = events[number] + offset
+        if previous is not None and uptime_ms < last_ms:
+            offset += UPTIME_WRAP
+            uptime_ms += UPTIME_WRAP
+        print(uptime_ms)
+        previous = number
+        last_ms = uptime_ms
+
+
+if __name__ == "__main__":
+    main()
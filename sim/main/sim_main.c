@@ -0,0 +1,321 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_timer.h"
+#include "led_state_machine.h"
+#include "sdkconfig.h"
+
+// Replays a motion trace through the firmware's state machine for every candidate policy,
+// on a virtual clock that jumps straight from one event or deadline to the next. The trace
+// is read from stdin, one motion timestamp in milliseconds per line, as written by
+// scripts/motion_trace_export.py. Results are printed as one JSON object per line.
+//
+// The strip is laid out from the firmware's own channel and segment settings, and every
+// segment that follows sensor 0 gets its own state machine, as in the LED handler. The trace
+// only has sensor 0's motion, so segments on the second PIR are left out.
+
+#define SIM_MAX_CANDIDATES 16
+#define SIM_MAX_SEGMENTS 4
+
+typedef enum {
+    SIM_EFFECT_SWEEP,
+    SIM_EFFECT_WIPE,
+    SIM_EFFECT_FADE,
+} sim_effect_t;
+
+static const char *const effect_names[] = {"sweep", "wipe", "fade"};
+
+typedef struct {
+    sim_effect_t effect;
+    uint32_t shine_s;
+    uint32_t pause_ms;  // Sweep and wipe only
+} sim_policy_t;
+
+typedef struct {
+    uint32_t led_count;
+    int effect;        // LED_SEGMENTn_EFFECT: 0 follows the animation, then sweep, wipe, fade
+    uint32_t shine_s;  // 0 follows the policy
+    int motion_sensor;
+} sim_segment_t;
+
+typedef struct {
+    led_sm_t sm;
+    int64_t now_us;
+    int64_t dark_since_us;  // When the lights last went off, or -1
+    int64_t on_us;
+    double level_us;  // Output level integrated over time, full level being 1
+    uint32_t activations;
+    uint32_t off_while_occupied;
+    size_t ramp_samples;
+} sim_run_t;
+
+static int64_t events_us[CONFIG_SIM_MAX_EVENTS];
+static size_t event_count;
+// Scheduled ramp from each motion that started one to full light. This is the state
+// machine's ramp time only: the wakeup, the LED task and the wire time are not modeled.
+static int64_t ramp_us[CONFIG_SIM_MAX_EVENTS];
+
+static sim_segment_t segments[SIM_MAX_SEGMENTS];
+static size_t segment_count;
+
+#define SIM_SEGMENT(n)                                              \
+    {                                                               \
+        .channel = CONFIG_LED_SEGMENT##n##_CHANNEL,                 \
+        .start = CONFIG_LED_SEGMENT##n##_START,                     \
+        .segment = {                                                \
+            .led_count = CONFIG_LED_SEGMENT##n##_LED_COUNT,         \
+            .effect = CONFIG_LED_SEGMENT##n##_EFFECT,               \
+            .shine_s = CONFIG_LED_SEGMENT##n##_SHINE_MINUTES * 60,  \
+            .motion_sensor = CONFIG_LED_SEGMENT##n##_MOTION_SENSOR, \
+        },                                                          \
+    }
+
+// Same layout rules as the LED handler's setup_segments()
+static void setup_segments(void) {
+    static const uint32_t channel_led_counts[] = {
+        CONFIG_MAX_LED_COUNT,
+#if CONFIG_LED_CHANNEL_COUNT > 1
+        CONFIG_LED_CHANNEL1_LED_COUNT,
+#endif
+    };
+    const size_t channel_count = sizeof(channel_led_counts) / sizeof(channel_led_counts[0]);
+
+#if CONFIG_LED_SEGMENT_COUNT == 0
+    for (size_t c = 0; c < channel_count; c++) {
+        segments[segment_count++] = (sim_segment_t){.led_count = channel_led_counts[c]};
+    }
+#else
+    static const struct {
+        size_t channel;
+        uint32_t start;
+        sim_segment_t segment;
+    } configured[] = {
+        SIM_SEGMENT(0),
+#if CONFIG_LED_SEGMENT_COUNT > 1
+        SIM_SEGMENT(1),
+#endif
+#if CONFIG_LED_SEGMENT_COUNT > 2
+        SIM_SEGMENT(2),
+#endif
+#if CONFIG_LED_SEGMENT_COUNT > 3
+        SIM_SEGMENT(3),
+#endif
+    };
+    for (size_t i = 0; i < sizeof(configured) / sizeof(configured[0]); i++) {
+        sim_segment_t segment = configured[i].segment;
+        if (configured[i].channel >= channel_count ||
+            configured[i].start >= channel_led_counts[configured[i].channel]) {
+            continue;
+        }
+        uint32_t channel_leds = channel_led_counts[configured[i].channel];
+        if (configured[i].start + segment.led_count > channel_leds) {
+            segment.led_count = channel_leds - configured[i].start;
+        }
+        segments[segment_count++] = segment;
+    }
+#endif
+}
+
+static size_t parse_list(const char *list, uint32_t *values, size_t max) {
+    size_t count = 0;
+    char *end;
+
+    while (*list != '\0' && count < max) {
+        unsigned long value = strtoul(list, &end, 10);
+        if (end == list) {
+            break;
+        }
+        values[count++] = value;
+        list = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+static bool read_trace(FILE *in) {
+    char line[64];
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (event_count >= CONFIG_SIM_MAX_EVENTS) {
+            fprintf(stderr, "Trace longer than %d events, the rest is ignored\n",
+                    CONFIG_SIM_MAX_EVENTS);
+            break;
+        }
+        int64_t event_us = strtoll(line, NULL, 10) * 1000;
+        if (event_count > 0 && event_us < events_us[event_count - 1]) {
+            fprintf(stderr, "Skipping out of order event at %" PRId64 " ms\n", event_us / 1000);
+            continue;
+        }
+        events_us[event_count++] = event_us;
+    }
+    return event_count > 0;
+}
+
+// A segment with its own effect only takes the policies that try that effect
+static bool segment_takes(const sim_segment_t *segment, const sim_policy_t *policy) {
+    return segment->effect == 0 || (sim_effect_t)(segment->effect - 1) == policy->effect;
+}
+
+// Same pacing as the LED handler's animations, over the segment's own LEDs
+static int64_t ramp_up_us(const sim_segment_t *segment, const sim_policy_t *policy) {
+    switch (policy->effect) {
+        case SIM_EFFECT_SWEEP:
+            return (int64_t)(segment->led_count / 2 + 1) * policy->pause_ms * 1000;
+        case SIM_EFFECT_WIPE:
+            return (int64_t)segment->led_count * policy->pause_ms * 1000;
+        default:
+            return (int64_t)CONFIG_LED_FADE_IN_MS * 1000;
+    }
+}
+
+// The level is constant or a straight ramp between transitions, so the trapezoid is exact
+static void accumulate(sim_run_t *run, int64_t until_us) {
+    int64_t elapsed_us = until_us - run->now_us;
+
+    if (run->sm.state == LED_STATE_OFF || elapsed_us <= 0) {
+        return;
+    }
+    uint32_t from = led_sm_level(&run->sm, run->now_us);
+    uint32_t to = led_sm_level(&run->sm, until_us);
+    run->on_us += elapsed_us;
+    run->level_us += (double)(from + to) / (2.0 * LED_SM_LEVEL_MAX) * elapsed_us;
+}
+
+static void advance(sim_run_t *run, int64_t to_us) {
+    while (run->now_us < to_us) {
+        int64_t deadline = led_sm_next_deadline(&run->sm);
+        int64_t until_us = deadline < to_us ? deadline : to_us;
+
+        if (until_us < run->now_us) {
+            until_us = run->now_us;
+        }
+        accumulate(run, until_us);
+        run->now_us = until_us;
+        if (until_us == deadline) {
+            led_sm_update(&run->sm, until_us);
+            if (run->sm.state == LED_STATE_OFF) {
+                run->dark_since_us = until_us;
+            }
+        }
+    }
+}
+
+static void motion(sim_run_t *run, int64_t event_us) {
+    advance(run, event_us);
+
+    led_state_t previous = run->sm.state;
+    if (previous == LED_STATE_RAMPING_DOWN ||
+        (previous == LED_STATE_OFF && run->dark_since_us >= 0 &&
+         event_us - run->dark_since_us <= (int64_t)CONFIG_SIM_OCCUPIED_GRACE_S * 1000 * 1000)) {
+        run->off_while_occupied++;
+    }
+    run->activations += previous == LED_STATE_OFF;
+    // Only motion that started a ramp waits for the light; during one it changes nothing
+    if (led_sm_motion(&run->sm, event_us)) {
+        ramp_us[run->ramp_samples++] = led_sm_next_deadline(&run->sm) - event_us;
+    }
+}
+
+static int compare_us(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int64_t percentile(const int64_t *sorted, size_t count, int p) {
+    return count > 0 ? sorted[(count - 1) * p / 100] : 0;
+}
+
+// Full-level draw of a segment at the target brightness. Gamma correction is left out, so
+// partial brightness overestimates; it does not change how policies rank.
+static double full_power_mw(const sim_segment_t *segment) {
+    double ma = (double)segment->led_count * 3 * CONFIG_LED_CHANNEL_CURRENT_MA *
+                CONFIG_LED_TARGET_BRIGHTNESS_PERCENT / 100;
+    return ma * CONFIG_LED_SUPPLY_MV / 1000;
+}
+
+static void simulate(size_t index, const sim_policy_t *policy) {
+    const sim_segment_t *segment = &segments[index];
+    uint32_t shine_s = segment->shine_s != 0 ? segment->shine_s : policy->shine_s;
+    led_sm_config_t config = {
+        .ramp_up_us = ramp_up_us(segment, policy),
+        .shine_us = (int64_t)shine_s * 1000 * 1000,
+        .ramp_down_us = (int64_t)CONFIG_LED_FADE_OUT_MS * 1000,
+    };
+    sim_run_t run = {.now_us = events_us[0], .dark_since_us = -1};
+
+    led_sm_init(&run.sm, &config);
+    for (size_t i = 0; i < event_count; i++) {
+        motion(&run, events_us[i]);
+    }
+    // Let the last activation run out
+    advance(&run, run.sm.off_deadline_us == LED_SM_NO_DEADLINE
+                      ? run.now_us
+                      : run.sm.off_deadline_us + config.ramp_down_us);
+
+    qsort(ramp_us, run.ramp_samples, sizeof(ramp_us[0]), compare_us);
+    int64_t span_us = run.now_us - events_us[0];
+    printf("{\"sim\":\"policy\",\"segment\":%u,\"leds\":%" PRIu32 ",\"effect\":\"%s\""
+           ",\"shine_s\":%" PRIu32 ",\"pause_ms\":%" PRIu32 ",\"activations\":%" PRIu32
+           ",\"on_s\":%" PRId64 ",\"on_permille\":%" PRId64 ",\"energy_mwh\":%.1f"
+           ",\"off_while_occupied\":%" PRIu32 ",\"ramp_p50_ms\":%" PRId64
+           ",\"ramp_p90_ms\":%" PRId64 ",\"ramp_p99_ms\":%" PRId64 "}\n",
+           (unsigned)index, segment->led_count, effect_names[policy->effect],
+           shine_s, policy->effect == SIM_EFFECT_FADE ? 0 : policy->pause_ms, run.activations,
+           run.on_us / (1000 * 1000), span_us > 0 ? run.on_us * 1000 / span_us : 0,
+           run.level_us * full_power_mw(segment) / (60.0 * 60 * 1000 * 1000),
+           run.off_while_occupied, percentile(ramp_us, run.ramp_samples, 50) / 1000,
+           percentile(ramp_us, run.ramp_samples, 90) / 1000,
+           percentile(ramp_us, run.ramp_samples, 99) / 1000);
+}
+
+// Every segment that follows sensor 0, under one policy
+static uint32_t simulate_segments(const sim_policy_t *policy) {
+    uint32_t runs = 0;
+
+    for (size_t i = 0; i < segment_count; i++) {
+        if (segments[i].motion_sensor == 0 && segment_takes(&segments[i], policy)) {
+            simulate(i, policy);
+            runs++;
+        }
+    }
+    return runs;
+}
+
+void app_main(void) {
+    uint32_t shines[SIM_MAX_CANDIDATES];
+    uint32_t pauses[SIM_MAX_CANDIDATES];
+    size_t shine_count = parse_list(CONFIG_SIM_SHINE_SECONDS, shines, SIM_MAX_CANDIDATES);
+    size_t pause_count = parse_list(CONFIG_SIM_PAUSE_MS, pauses, SIM_MAX_CANDIDATES);
+    uint32_t runs = 0;
+
+    setup_segments();
+    if (!read_trace(stdin)) {
+        fprintf(stderr, "No motion events on stdin\n");
+        exit(1);
+    }
+    int64_t span_ms = (events_us[event_count - 1] - events_us[0]) / 1000;
+    printf("{\"sim\":\"trace\",\"events\":%u,\"span_s\":%" PRId64 "}\n", (unsigned)event_count,
+           span_ms / 1000);
+
+    int64_t start_us = esp_timer_get_time();
+    for (size_t s = 0; s < shine_count; s++) {
+        for (size_t p = 0; p < pause_count; p++) {
+            runs += simulate_segments(&(sim_policy_t){SIM_EFFECT_SWEEP, shines[s], pauses[p]});
+            runs += simulate_segments(&(sim_policy_t){SIM_EFFECT_WIPE, shines[s], pauses[p]});
+        }
+        runs += simulate_segments(&(sim_policy_t){SIM_EFFECT_FADE, shines[s], 0});
+    }
+    int64_t wall_us = esp_timer_get_time() - start_us;
+
+    // How much faster than real time the whole grid replayed
+    printf("{\"sim\":\"summary\",\"runs\":%" PRIu32 ",\"wall_ms\":%" PRId64
+           ",\"speedup\":%" PRId64 "}\n",
+           runs, wall_us / 1000, wall_us > 0 ? span_ms * 1000 * runs / wall_us : 0);
+    fflush(stdout);
+    exit(0);
+}
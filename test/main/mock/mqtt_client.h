@@ -0,0 +1,34 @@
+#ifndef MQTT_CLIENT_MOCK_H
+#define MQTT_CLIENT_MOCK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Stands in for esp-mqtt, which does not build for the linux target. Every message the
+// outbox hands over is recorded, in order, for the tests to check.
+
+#define MQTT_MOCK_MAX_MESSAGES 64
+#define MQTT_MOCK_MAX_TOPIC 32
+#define MQTT_MOCK_MAX_DATA 4096
+
+typedef struct mqtt_mock_client *esp_mqtt_client_handle_t;
+
+typedef struct {
+    char topic[MQTT_MOCK_MAX_TOPIC];
+    char data[MQTT_MOCK_MAX_DATA];
+    int len;
+} mqtt_mock_message_t;
+
+int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client, const char *topic, const char *data,
+                            int len, int qos, int retain, bool store);
+
+// A client handle to connect the outbox with
+esp_mqtt_client_handle_t mqtt_mock_client(void);
+// Call before anything is published; forgets what was sent so far
+void mqtt_mock_reset(void);
+// While full, enqueueing fails the way it does when esp-mqtt's own outbox is out of room
+void mqtt_mock_set_full(bool full);
+int mqtt_mock_message_count(void);
+const mqtt_mock_message_t *mqtt_mock_message(int index);
+
+#endif  // MQTT_CLIENT_MOCK_H
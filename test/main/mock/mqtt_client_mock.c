@@ -0,0 +1,68 @@
+#include <stdatomic.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "mqtt_client.h"
+
+static struct mqtt_mock_client {
+    int unused;
+} client;
+
+// Written by the outbox task, read by the test task
+static SemaphoreHandle_t mock_mutex;
+static StaticSemaphore_t mock_mutex_buffer;
+static mqtt_mock_message_t messages[MQTT_MOCK_MAX_MESSAGES];
+static int message_count;
+static atomic_bool full;
+
+static void lock(void) { xSemaphoreTake(mock_mutex, portMAX_DELAY); }
+
+int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t handle, const char *topic, const char *data,
+                            int len, int qos, int retain, bool store) {
+    int msg_id;
+
+    if (handle != &client || atomic_load(&full) || len > MQTT_MOCK_MAX_DATA ||
+        strlen(topic) >= MQTT_MOCK_MAX_TOPIC) {
+        return -1;
+    }
+    lock();
+    if (message_count >= MQTT_MOCK_MAX_MESSAGES) {
+        xSemaphoreGive(mock_mutex);
+        return -2;
+    }
+    mqtt_mock_message_t *message = &messages[message_count++];
+    strcpy(message->topic, topic);
+    memcpy(message->data, data, len);
+    message->len = len;
+    msg_id = message_count;
+    xSemaphoreGive(mock_mutex);
+    return msg_id;
+}
+
+esp_mqtt_client_handle_t mqtt_mock_client(void) { return &client; }
+
+void mqtt_mock_reset(void) {
+    if (mock_mutex == NULL) {
+        mock_mutex = xSemaphoreCreateMutexStatic(&mock_mutex_buffer);
+    }
+    lock();
+    message_count = 0;
+    xSemaphoreGive(mock_mutex);
+    atomic_store(&full, false);
+}
+
+void mqtt_mock_set_full(bool value) { atomic_store(&full, value); }
+
+int mqtt_mock_message_count(void) {
+    int count;
+
+    lock();
+    count = message_count;
+    xSemaphoreGive(mock_mutex);
+    return count;
+}
+
+const mqtt_mock_message_t *mqtt_mock_message(int index) {
+    return index < mqtt_mock_message_count() ? &messages[index] : NULL;
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "json_stream.h"
+#include "unity.h"
+
+// Every value as "path=type:text;", so two parses can be compared as strings
+typedef struct {
+    char out[512];
+    size_t len;
+    int32_t brightness;
+} collected_t;
+
+static const char *const type_names[] = {"s", "n", "t", "f", "0", "l"};
+
+static void collect(json_stream_t *stream, json_value_type_t type, const char *text, void *ctx) {
+    collected_t *collected = ctx;
+
+    for (int level = 0; level < stream->depth; level++) {
+        collected->len += snprintf(collected->out + collected->len,
+                                   sizeof(collected->out) - collected->len, "%s%s",
+                                   level > 0 ? "." : "", stream->keys[level]);
+    }
+    collected->len += snprintf(collected->out + collected->len,
+                               sizeof(collected->out) - collected->len, "=%s:%s;",
+                               type_names[type], text);
+    if (json_stream_path_is(stream, "state.desired.brightness")) {
+        json_stream_parse_int(text, &collected->brightness);
+    }
+}
+
+static const char shadow_delta[] =
+    "{\"state\": {\"desired\": {\"power\": \"on\", \"brightness\": 42,"
+    " \"name\": \"caf\\u00e9 \\\"x\\\"\"}, \"list\": [1, -2.5e3, true, false, null]},"
+    " \"version\": 7}";
+
+static bool parse_chunks(const char *doc, size_t split, collected_t *collected) {
+    json_stream_t stream;
+    size_t len = strlen(doc);
+
+    memset(collected, 0, sizeof(*collected));
+    json_stream_init(&stream, collect, collected);
+    if (!json_stream_feed(&stream, doc, split) ||
+        !json_stream_feed(&stream, doc + split, len - split)) {
+        return false;
+    }
+    return json_stream_finish(&stream);
+}
+
+TEST_CASE("json_stream reports every value with its key path", "[json_stream]") {
+    collected_t collected;
+
+    TEST_ASSERT_TRUE(parse_chunks(shadow_delta, strlen(shadow_delta), &collected));
+    TEST_ASSERT_EQUAL_STRING("state.desired.power=s:on;"
+                             "state.desired.brightness=n:42;"
+                             "state.desired.name=s:caf\xc3\xa9 \"x\";"
+                             "state.list.=n:1;"
+                             "state.list.=n:-2.5e3;"
+                             "state.list.=t:true;"
+                             "state.list.=f:false;"
+                             "state.list.=0:null;"
+                             "version=n:7;",
+                             collected.out);
+    TEST_ASSERT_EQUAL_INT32(42, collected.brightness);
+}
+
+TEST_CASE("json_stream gives the same result split at every byte", "[json_stream]") {
+    collected_t whole, split;
+    size_t len = strlen(shadow_delta);
+
+    TEST_ASSERT_TRUE(parse_chunks(shadow_delta, len, &whole));
+    for (size_t at = 0; at <= len; at++) {
+        TEST_ASSERT_TRUE_MESSAGE(parse_chunks(shadow_delta, at, &split), "split parse failed");
+        TEST_ASSERT_EQUAL_STRING(whole.out, split.out);
+    }
+}
+
+TEST_CASE("json_stream takes a document one byte at a time", "[json_stream]") {
+    collected_t whole, bytes = {0};
+    json_stream_t stream;
+
+    TEST_ASSERT_TRUE(parse_chunks(shadow_delta, strlen(shadow_delta), &whole));
+    json_stream_init(&stream, collect, &bytes);
+    for (const char *p = shadow_delta; *p; p++) {
+        TEST_ASSERT_TRUE(json_stream_feed(&stream, p, 1));
+    }
+    TEST_ASSERT_TRUE(json_stream_finish(&stream));
+    TEST_ASSERT_EQUAL_STRING(whole.out, bytes.out);
+}
+
+TEST_CASE("json_stream rejects malformed documents", "[json_stream]") {
+    static const char *const malformed[] = {
+        "{\"a\":}", "{\"a\" 1}", "{\"a\":tru}", "{\"a\":1}}", "[1,2", "{\"a\":\"x}", "",
+    };
+    collected_t collected;
+
+    for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+        TEST_ASSERT_FALSE_MESSAGE(parse_chunks(malformed[i], strlen(malformed[i]), &collected),
+                                  malformed[i]);
+    }
+}
+
+TEST_CASE("json_stream parses integers and nothing else", "[json_stream]") {
+    int32_t value = 0;
+
+    TEST_ASSERT_TRUE(json_stream_parse_int("2147483647", &value));
+    TEST_ASSERT_EQUAL_INT32(INT32_MAX, value);
+    TEST_ASSERT_TRUE(json_stream_parse_int("-2147483648", &value));
+    TEST_ASSERT_EQUAL_INT32(INT32_MIN, value);
+    TEST_ASSERT_FALSE(json_stream_parse_int("2147483648", &value));
+    TEST_ASSERT_FALSE(json_stream_parse_int("4.2", &value));
+    TEST_ASSERT_FALSE(json_stream_parse_int("-", &value));
+}
+
+TEST_CASE("json_stream marks strings that do not fit", "[json_stream]") {
+    char doc[160];
+    char expected[160];
+    collected_t collected;
+
+    // Exactly JSON_STREAM_MAX_TOKEN bytes still fits, one more does not
+    snprintf(doc, sizeof(doc), "{\"a\": \"%0*d\", \"b\": \"%0*d\"}", JSON_STREAM_MAX_TOKEN, 0,
+             JSON_STREAM_MAX_TOKEN + 1, 0);
+    snprintf(expected, sizeof(expected), "a=s:%0*d;b=l:%0*d;", JSON_STREAM_MAX_TOKEN, 0,
+             JSON_STREAM_MAX_TOKEN, 0);
+    TEST_ASSERT_TRUE(parse_chunks(doc, strlen(doc), &collected));
+    TEST_ASSERT_EQUAL_STRING(expected, collected.out);
+}
+
+static void match_longest_key(json_stream_t *stream, json_value_type_t type, const char *text,
+                              void *ctx) {
+    // JSON_STREAM_MAX_KEY - 1 characters, the longest key that fits
+    *(bool *)ctx |= json_stream_path_is(stream, "k.abcdefghijklmnopqrstuvw");
+}
+
+TEST_CASE("json_stream matches no path through a key that does not fit", "[json_stream]") {
+    // A cut-off copy of the longer key would equal the one looked for
+    static const char fits[] = "{\"k\": {\"abcdefghijklmnopqrstuvw\": 1}}";
+    static const char too_long[] = "{\"k\": {\"abcdefghijklmnopqrstuvwxyz\": 1}}";
+    json_stream_t stream;
+    bool matched = false;
+
+    json_stream_init(&stream, match_longest_key, &matched);
+    TEST_ASSERT_TRUE(json_stream_feed(&stream, fits, strlen(fits)));
+    TEST_ASSERT_TRUE(json_stream_finish(&stream));
+    TEST_ASSERT_TRUE(matched);
+
+    matched = false;
+    json_stream_init(&stream, match_longest_key, &matched);
+    TEST_ASSERT_TRUE(json_stream_feed(&stream, too_long, strlen(too_long)));
+    TEST_ASSERT_TRUE(json_stream_finish(&stream));
+    TEST_ASSERT_FALSE(matched);
+}
+
+TEST_CASE("json_stream rejects numbers that do not fit", "[json_stream]") {
+    char doc[JSON_STREAM_MAX_TOKEN + 16];
+    collected_t collected;
+
+    snprintf(doc, sizeof(doc), "{\"n\": 1%0*d}", JSON_STREAM_MAX_TOKEN, 0);
+    TEST_ASSERT_FALSE(parse_chunks(doc, strlen(doc), &collected));
+}
@@ -0,0 +1,106 @@
+#include "led_fade.h"
+#include "led_gamma_lut.h"
+#include "led_renderer.h"
+#include "unity.h"
+
+TEST_CASE("led_fade_scale by full intensity is exact", "[led_fade]") {
+    for (uint32_t x = 0; x <= LED_FADE_INTENSITY_MAX; x++) {
+        TEST_ASSERT_EQUAL_UINT16(x, led_fade_scale(LED_FADE_INTENSITY_MAX, x));
+        TEST_ASSERT_EQUAL_UINT16(x, led_fade_scale(x, LED_FADE_INTENSITY_MAX));
+        TEST_ASSERT_EQUAL_UINT16(0, led_fade_scale(x, 0));
+    }
+    TEST_ASSERT_EQUAL_UINT16(0x4000, led_fade_scale(0x8000, 0x8000));
+}
+
+TEST_CASE("led_fade_ease keeps its end points", "[led_fade]") {
+    TEST_ASSERT_EQUAL_UINT16(0, led_fade_ease(0));
+    TEST_ASSERT_EQUAL_UINT16(LED_FADE_INTENSITY_MAX, led_fade_ease(LED_FADE_INTENSITY_MAX));
+    TEST_ASSERT_UINT16_WITHIN(1, 0x8000, led_fade_ease(0x8000));
+    for (uint32_t p = 1; p <= LED_FADE_INTENSITY_MAX; p++) {
+        TEST_ASSERT_TRUE(led_fade_ease(p) >= led_fade_ease(p - 1));
+    }
+}
+
+TEST_CASE("led_fade_color spans the whole gamma table", "[led_fade]") {
+    led_rgb16_t color;
+
+    led_fade_color(0, &color);
+    TEST_ASSERT_EQUAL_UINT16(led_gamma_lut_r[0], color.r);
+    TEST_ASSERT_EQUAL_UINT16(led_gamma_lut_g[0], color.g);
+    TEST_ASSERT_EQUAL_UINT16(led_gamma_lut_b[0], color.b);
+
+    // Full intensity is the table's last entry, not an interpolation short of it
+    led_fade_color(LED_FADE_INTENSITY_MAX, &color);
+    TEST_ASSERT_EQUAL_UINT16(led_gamma_lut_r[LED_GAMMA_LUT_SIZE - 1], color.r);
+    TEST_ASSERT_EQUAL_UINT16(led_gamma_lut_g[LED_GAMMA_LUT_SIZE - 1], color.g);
+    TEST_ASSERT_EQUAL_UINT16(led_gamma_lut_b[LED_GAMMA_LUT_SIZE - 1], color.b);
+}
+
+TEST_CASE("led_fade_color never gets darker as intensity rises", "[led_fade]") {
+    led_rgb16_t previous, color;
+
+    led_fade_color(0, &previous);
+    for (uint32_t i = 1; i <= LED_FADE_INTENSITY_MAX; i++) {
+        led_fade_color(i, &color);
+        TEST_ASSERT_TRUE(color.r >= previous.r && color.g >= previous.g && color.b >= previous.b);
+        previous = color;
+    }
+}
+
+TEST_CASE("led_fade_settle leaves full brightness nothing to dither", "[led_fade]") {
+    led_rgb16_t color;
+
+    led_fade_color(LED_FADE_INTENSITY_MAX, &color);
+    led_fade_settle(&color);
+    TEST_ASSERT_FALSE(led_fade_needs_dither(&color));
+    TEST_ASSERT_UINT16_WITHIN(0x80, led_gamma_lut_r[LED_GAMMA_LUT_SIZE - 1], color.r);
+    TEST_ASSERT_UINT16_WITHIN(0x80, led_gamma_lut_g[LED_GAMMA_LUT_SIZE - 1], color.g);
+    TEST_ASSERT_UINT16_WITHIN(0x80, led_gamma_lut_b[LED_GAMMA_LUT_SIZE - 1], color.b);
+}
+
+TEST_CASE("led_fade_settle rounds every channel to a whole value", "[led_fade]") {
+    led_rgb16_t color = {.r = 0x0F80, .g = 0x037F, .b = 0xFFC0};
+
+    led_fade_settle(&color);
+    TEST_ASSERT_EQUAL_HEX16(0x1000, color.r);
+    TEST_ASSERT_EQUAL_HEX16(0x0300, color.g);
+    TEST_ASSERT_EQUAL_HEX16(0xFF00, color.b);
+    TEST_ASSERT_FALSE(led_fade_needs_dither(&color));
+}
+
+TEST_CASE("led_fade_settle keeps a dim glow lit", "[led_fade]") {
+    led_rgb16_t color = {.r = 0x0040, .g = 0x0001, .b = 0};
+
+    led_fade_settle(&color);
+    TEST_ASSERT_EQUAL_HEX16(0x0100, color.r);
+    TEST_ASSERT_EQUAL_HEX16(0x0100, color.g);
+    TEST_ASSERT_EQUAL_HEX16(0, color.b);
+}
+
+TEST_CASE("led_fade_settle leaves every held level nothing to dither", "[led_fade]") {
+    led_rgb16_t color;
+
+    for (uint32_t i = 0; i <= LED_FADE_INTENSITY_MAX; i += 7) {
+        led_fade_color(i, &color);
+        led_fade_settle(&color);
+        TEST_ASSERT_FALSE(led_fade_needs_dither(&color));
+    }
+}
+
+TEST_CASE("led_fade_fill dithers the fraction over 16 frames", "[led_fade]") {
+    const led_rgb16_t color = {.r = 0x1080, .g = 0x2000, .b = 0x0040};
+    uint8_t frame[LED_FRAME_BYTES(1)];
+    uint32_t sum_g = 0, sum_r = 0, sum_b = 0;
+
+    TEST_ASSERT_TRUE(led_fade_needs_dither(&color));
+    for (uint32_t n = 0; n < 16; n++) {
+        led_fade_fill(frame, 0, 1, &color, n);
+        sum_g += frame[0];
+        sum_r += frame[1];
+        sum_b += frame[2];
+    }
+    // 16.5, 32 and a quarter over 16 frames
+    TEST_ASSERT_EQUAL_UINT32(16 * 16 + 8, sum_r);
+    TEST_ASSERT_EQUAL_UINT32(16 * 32, sum_g);
+    TEST_ASSERT_EQUAL_UINT32(4, sum_b);
+}
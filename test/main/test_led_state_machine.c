@@ -0,0 +1,142 @@
+#include "led_state_machine.h"
+#include "unity.h"
+
+#define RAMP_UP_US 1000000
+#define SHINE_US 10000000
+#define RAMP_DOWN_US 2000000
+
+static void init_sm(led_sm_t *sm) {
+    const led_sm_config_t config = {
+        .ramp_up_us = RAMP_UP_US,
+        .shine_us = SHINE_US,
+        .ramp_down_us = RAMP_DOWN_US,
+    };
+
+    led_sm_init(sm, &config);
+}
+
+TEST_CASE("led_sm turns on from motion with the ramp as its next deadline", "[led_sm]") {
+    led_sm_t sm;
+
+    init_sm(&sm);
+    TEST_ASSERT_EQUAL_INT64(LED_SM_NO_DEADLINE, led_sm_next_deadline(&sm));
+    TEST_ASSERT_TRUE(led_sm_motion(&sm, 5000));
+    TEST_ASSERT_EQUAL(LED_STATE_RAMPING_UP, sm.state);
+    TEST_ASSERT_EQUAL_INT64(5000 + RAMP_UP_US, led_sm_next_deadline(&sm));
+    TEST_ASSERT_EQUAL_INT64(5000 + RAMP_UP_US + SHINE_US, sm.off_deadline_us);
+    TEST_ASSERT_EQUAL_UINT16(0, led_sm_level(&sm, 5000));
+    TEST_ASSERT_UINT16_WITHIN(1, LED_SM_LEVEL_MAX / 2, led_sm_level(&sm, 5000 + RAMP_UP_US / 2));
+
+    TEST_ASSERT_FALSE(led_sm_update(&sm, 5000 + RAMP_UP_US - 1));
+    TEST_ASSERT_TRUE(led_sm_update(&sm, 5000 + RAMP_UP_US));
+    TEST_ASSERT_EQUAL(LED_STATE_ON, sm.state);
+    TEST_ASSERT_EQUAL_UINT16(LED_SM_LEVEL_MAX, led_sm_level(&sm, 5000 + RAMP_UP_US));
+    TEST_ASSERT_EQUAL_INT64(sm.off_deadline_us, led_sm_next_deadline(&sm));
+}
+
+TEST_CASE("led_sm catches up on every transition due after a late wakeup", "[led_sm]") {
+    led_sm_t sm;
+
+    init_sm(&sm);
+    led_sm_motion(&sm, 0);
+    TEST_ASSERT_TRUE(led_sm_update(&sm, RAMP_UP_US + SHINE_US + RAMP_DOWN_US));
+    TEST_ASSERT_EQUAL(LED_STATE_OFF, sm.state);
+    TEST_ASSERT_EQUAL_INT64(LED_SM_NO_DEADLINE, led_sm_next_deadline(&sm));
+}
+
+TEST_CASE("led_sm retrigger pushes the off deadline out", "[led_sm]") {
+    led_sm_t sm;
+
+    init_sm(&sm);
+    led_sm_motion(&sm, 0);
+    led_sm_update(&sm, RAMP_UP_US);
+
+    // Motion early in the shine time does not shorten it
+    TEST_ASSERT_FALSE(led_sm_motion(&sm, RAMP_UP_US));
+    TEST_ASSERT_EQUAL_INT64(RAMP_UP_US + SHINE_US, sm.off_deadline_us);
+
+    TEST_ASSERT_FALSE(led_sm_motion(&sm, 6000000));
+    TEST_ASSERT_EQUAL_INT64(6000000 + SHINE_US, sm.off_deadline_us);
+    TEST_ASSERT_EQUAL_UINT32(3, sm.motion_events);
+    TEST_ASSERT_EQUAL_UINT32(2, sm.retriggers);
+
+    TEST_ASSERT_FALSE(led_sm_update(&sm, RAMP_UP_US + SHINE_US));
+    TEST_ASSERT_EQUAL(LED_STATE_ON, sm.state);
+    TEST_ASSERT_TRUE(led_sm_update(&sm, 6000000 + SHINE_US));
+    TEST_ASSERT_EQUAL(LED_STATE_RAMPING_DOWN, sm.state);
+}
+
+TEST_CASE("led_sm reverses a ramp down from its current level", "[led_sm]") {
+    led_sm_t sm;
+    int64_t now_us = RAMP_UP_US + SHINE_US;
+
+    init_sm(&sm);
+    led_sm_motion(&sm, 0);
+    led_sm_update(&sm, now_us);
+    TEST_ASSERT_EQUAL(LED_STATE_RAMPING_DOWN, sm.state);
+
+    // A quarter of the way down
+    now_us += RAMP_DOWN_US / 4;
+    uint16_t level = led_sm_level(&sm, now_us);
+    TEST_ASSERT_UINT16_WITHIN(1, LED_SM_LEVEL_MAX * 3 / 4, level);
+
+    TEST_ASSERT_TRUE(led_sm_motion(&sm, now_us));
+    TEST_ASSERT_EQUAL(LED_STATE_RAMPING_UP, sm.state);
+    TEST_ASSERT_UINT16_WITHIN(1, level, led_sm_level(&sm, now_us));
+    TEST_ASSERT_EQUAL_UINT32(1, sm.retriggers);
+
+    // Only the rest of the ramp is left, and the shine time follows it
+    int64_t ramp_end_us = led_sm_next_deadline(&sm);
+    TEST_ASSERT_INT64_WITHIN(100, now_us + RAMP_UP_US / 4, ramp_end_us);
+    TEST_ASSERT_EQUAL_INT64(ramp_end_us + SHINE_US, sm.off_deadline_us);
+}
+
+TEST_CASE("led_sm hold keeps the lights on until released", "[led_sm]") {
+    led_sm_t sm;
+
+    init_sm(&sm);
+    TEST_ASSERT_TRUE(led_sm_hold(&sm, 0));
+    TEST_ASSERT_EQUAL(LED_STATE_RAMPING_UP, sm.state);
+    led_sm_update(&sm, RAMP_UP_US);
+    TEST_ASSERT_EQUAL(LED_STATE_ON, sm.state);
+    TEST_ASSERT_EQUAL_INT64(LED_SM_NO_DEADLINE, led_sm_next_deadline(&sm));
+
+    // Motion must not bring back a deadline during the hold
+    led_sm_motion(&sm, 2 * RAMP_UP_US);
+    TEST_ASSERT_FALSE(led_sm_update(&sm, 100 * SHINE_US));
+    TEST_ASSERT_EQUAL(LED_STATE_ON, sm.state);
+
+    led_sm_release(&sm, 100 * SHINE_US);
+    TEST_ASSERT_EQUAL_INT64(101 * SHINE_US, led_sm_next_deadline(&sm));
+    TEST_ASSERT_TRUE(led_sm_update(&sm, 101 * SHINE_US));
+    TEST_ASSERT_EQUAL(LED_STATE_RAMPING_DOWN, sm.state);
+}
+
+TEST_CASE("led_sm release during the ramp counts the shine time from its end", "[led_sm]") {
+    led_sm_t sm;
+
+    init_sm(&sm);
+    led_sm_hold(&sm, 0);
+    led_sm_release(&sm, RAMP_UP_US / 2);
+    TEST_ASSERT_EQUAL_INT64(RAMP_UP_US + SHINE_US, sm.off_deadline_us);
+}
+
+TEST_CASE("led_sm force off fades out from the current level", "[led_sm]") {
+    led_sm_t sm;
+
+    init_sm(&sm);
+    TEST_ASSERT_FALSE(led_sm_force_off(&sm, 0));
+
+    led_sm_motion(&sm, 0);
+    uint16_t level = led_sm_level(&sm, RAMP_UP_US / 2);
+    TEST_ASSERT_TRUE(led_sm_force_off(&sm, RAMP_UP_US / 2));
+    TEST_ASSERT_EQUAL(LED_STATE_RAMPING_DOWN, sm.state);
+    TEST_ASSERT_UINT16_WITHIN(1, level, led_sm_level(&sm, RAMP_UP_US / 2));
+    TEST_ASSERT_EQUAL_INT64(LED_SM_NO_DEADLINE, sm.off_deadline_us);
+    TEST_ASSERT_FALSE(led_sm_force_off(&sm, RAMP_UP_US / 2));
+
+    // Half the level is left, so half the fade-out
+    TEST_ASSERT_INT64_WITHIN(100, RAMP_UP_US / 2 + RAMP_DOWN_US / 2, led_sm_next_deadline(&sm));
+    TEST_ASSERT_TRUE(led_sm_update(&sm, RAMP_UP_US / 2 + RAMP_DOWN_US / 2 + 100));
+    TEST_ASSERT_EQUAL(LED_STATE_OFF, sm.state);
+}
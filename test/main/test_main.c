@@ -0,0 +1,20 @@
+#include <stdlib.h>
+
+#include "esp_log.h"
+#include "unity.h"
+#include "unity_test_runner.h"
+
+// Runs every TEST_CASE once and exits with the number of failures, so the ELF can gate a CI job
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void app_main(void) {
+    // Modules warn about what the tests do to them on purpose
+    esp_log_level_set("*", ESP_LOG_NONE);
+
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    exit(UNITY_END());
+}
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "json_stream.h"
+#include "mqtt_client.h"
+#include "mqtt_outbox.h"
+#include "unity.h"
+
+// The outbox keeps its state across tests, as it does across outages. Each test starts
+// offline with nothing held back and leaves it that way.
+
+#define TOPIC_A "test/a"
+#define TOPIC_B "test/b"
+#define DRAIN_TIMEOUT_MS 2000
+
+static mqtt_outbox_stats_t before;
+
+static void start_offline(void) {
+    static bool initialised;
+
+    if (!initialised) {
+        mqtt_mock_reset();
+        init_mqtt_outbox();
+        initialised = true;
+    }
+    mqtt_outbox_set_connected(NULL);
+    mqtt_mock_reset();
+    mqtt_outbox_get_stats(&before);
+    TEST_ASSERT_EQUAL_UINT32(0, before.buffered);
+}
+
+// The outbox task sends the backlog at the lowest priority, so give it time to run
+static void drain(void) {
+    mqtt_outbox_stats_t stats;
+
+    for (int waited_ms = 0; waited_ms < DRAIN_TIMEOUT_MS; waited_ms += 10) {
+        mqtt_outbox_get_stats(&stats);
+        if (stats.buffered == 0) {
+            return;
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    TEST_FAIL_MESSAGE("The outbox did not send its backlog");
+}
+
+// With pad, the message is padded out to about that many bytes
+static void publish_json(const char *topic, int n, size_t pad) {
+    char payload[1100];
+    int len = pad == 0 ? snprintf(payload, sizeof(payload), "{\"n\":%d}", n)
+                       : snprintf(payload, sizeof(payload), "{\"n\":%d,\"pad\":\"%0*d\"}", n,
+                                  (int)pad, 0);
+
+    mqtt_outbox_publish(topic, (const uint8_t *)payload, len, TELEMETRY_FORMAT_JSON);
+}
+
+static void publish_cbor(const char *topic, int n) {
+    telemetry_writer_t writer;
+    uint8_t payload[16];
+
+    telemetry_writer_init_format(&writer, TELEMETRY_FORMAT_CBOR, payload, sizeof(payload));
+    telemetry_write_uint(&writer, "n", n);
+    mqtt_outbox_publish(topic, payload, telemetry_writer_finish(&writer), TELEMETRY_FORMAT_CBOR);
+}
+
+typedef struct {
+    int values[64];
+    int count;
+} numbers_t;
+
+static void collect_n(json_stream_t *stream, json_value_type_t type, const char *text,
+                      void *ctx) {
+    numbers_t *numbers = ctx;
+    int32_t value;
+
+    if (strcmp(json_stream_key(stream), "n") == 0 && json_stream_parse_int(text, &value) &&
+        numbers->count < 64) {
+        numbers->values[numbers->count++] = value;
+    }
+}
+
+// The "n" of every JSON message sent, batches unpacked, in the order they went out
+static void sent_numbers(numbers_t *numbers) {
+    memset(numbers, 0, sizeof(*numbers));
+    for (int i = 0; i < mqtt_mock_message_count(); i++) {
+        const mqtt_mock_message_t *message = mqtt_mock_message(i);
+        json_stream_t stream;
+
+        json_stream_init(&stream, collect_n, numbers);
+        json_stream_feed(&stream, message->data, message->len);
+        TEST_ASSERT_TRUE(json_stream_finish(&stream));
+    }
+}
+
+TEST_CASE("mqtt_outbox sends straight away while connected", "[mqtt_outbox]") {
+    static const char payload[] = "{\"n\":0}";
+    mqtt_outbox_stats_t after;
+
+    start_offline();
+    mqtt_outbox_set_connected(mqtt_mock_client());
+    mqtt_outbox_publish(TOPIC_A, (const uint8_t *)payload, strlen(payload),
+                        TELEMETRY_FORMAT_JSON);
+
+    TEST_ASSERT_EQUAL_INT(1, mqtt_mock_message_count());
+    TEST_ASSERT_EQUAL_STRING(TOPIC_A, mqtt_mock_message(0)->topic);
+    TEST_ASSERT_EQUAL_INT(strlen(payload), mqtt_mock_message(0)->len);
+    TEST_ASSERT_EQUAL_MEMORY(payload, mqtt_mock_message(0)->data, strlen(payload));
+    mqtt_outbox_get_stats(&after);
+    TEST_ASSERT_EQUAL_UINT32(before.batches_sent, after.batches_sent);
+}
+
+TEST_CASE("mqtt_outbox sends one held-back message as it was published", "[mqtt_outbox]") {
+    static const char payload[] = "{\"n\":0}";
+
+    start_offline();
+    mqtt_outbox_publish(TOPIC_A, (const uint8_t *)payload, strlen(payload),
+                        TELEMETRY_FORMAT_JSON);
+    TEST_ASSERT_EQUAL_INT(0, mqtt_mock_message_count());
+    mqtt_outbox_set_connected(mqtt_mock_client());
+    drain();
+
+    TEST_ASSERT_EQUAL_INT(1, mqtt_mock_message_count());
+    TEST_ASSERT_EQUAL_INT(strlen(payload), mqtt_mock_message(0)->len);
+    TEST_ASSERT_EQUAL_MEMORY(payload, mqtt_mock_message(0)->data, strlen(payload));
+}
+
+TEST_CASE("mqtt_outbox batches the backlog by topic and format, in order", "[mqtt_outbox]") {
+    static const uint8_t cbor_batch[] = {
+        0x9F, 0xBF, 0x61, 'n', 0x00, 0xFF, 0xBF, 0x61, 'n', 0x01, 0xFF, 0xFF,
+    };
+    mqtt_outbox_stats_t after;
+
+    start_offline();
+    publish_json(TOPIC_A, 0, 0);
+    publish_json(TOPIC_A, 1, 0);
+    publish_cbor(TOPIC_B, 0);
+    publish_cbor(TOPIC_B, 1);
+    publish_json(TOPIC_A, 2, 0);
+    publish_json(TOPIC_A, 3, 0);
+    mqtt_outbox_set_connected(mqtt_mock_client());
+    drain();
+
+    TEST_ASSERT_EQUAL_INT(3, mqtt_mock_message_count());
+    const mqtt_mock_message_t *first = mqtt_mock_message(0);
+    TEST_ASSERT_EQUAL_STRING(TOPIC_A, first->topic);
+    TEST_ASSERT_EQUAL_INT(strlen("[{\"n\":0},{\"n\":1}]"), first->len);
+    TEST_ASSERT_EQUAL_MEMORY("[{\"n\":0},{\"n\":1}]", first->data, first->len);
+    const mqtt_mock_message_t *second = mqtt_mock_message(1);
+    TEST_ASSERT_EQUAL_STRING(TOPIC_B, second->topic);
+    TEST_ASSERT_EQUAL_INT(sizeof(cbor_batch), second->len);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(cbor_batch, second->data, sizeof(cbor_batch));
+    TEST_ASSERT_EQUAL_STRING(TOPIC_A, mqtt_mock_message(2)->topic);
+
+    mqtt_outbox_get_stats(&after);
+    TEST_ASSERT_EQUAL_UINT32(before.batches_sent + 3, after.batches_sent);
+}
+
+TEST_CASE("mqtt_outbox keeps batches within the batch size", "[mqtt_outbox]") {
+    numbers_t numbers;
+
+    start_offline();
+    for (int n = 0; n < 7; n++) {
+        publish_json(TOPIC_A, n, 1000);
+    }
+    mqtt_outbox_set_connected(mqtt_mock_client());
+    drain();
+
+    TEST_ASSERT_TRUE(mqtt_mock_message_count() > 1);
+    for (int i = 0; i < mqtt_mock_message_count(); i++) {
+        TEST_ASSERT_TRUE(mqtt_mock_message(i)->len <= CONFIG_MQTT_OUTBOX_BATCH_SIZE);
+    }
+    sent_numbers(&numbers);
+    TEST_ASSERT_EQUAL_INT(7, numbers.count);
+    for (int n = 0; n < 7; n++) {
+        TEST_ASSERT_EQUAL_INT(n, numbers.values[n]);
+    }
+}
+
+TEST_CASE("mqtt_outbox queues new messages behind the backlog", "[mqtt_outbox]") {
+    numbers_t numbers;
+
+    start_offline();
+    publish_json(TOPIC_A, 0, 0);
+    publish_json(TOPIC_A, 1, 0);
+    // The client has no room, so the backlog stays put after connecting
+    mqtt_mock_set_full(true);
+    mqtt_outbox_set_connected(mqtt_mock_client());
+    vTaskDelay(pdMS_TO_TICKS(50));
+    TEST_ASSERT_EQUAL_INT(0, mqtt_mock_message_count());
+
+    // Now there is room, but the new message must not overtake the older ones
+    mqtt_mock_set_full(false);
+    publish_json(TOPIC_A, 2, 0);
+    drain();
+
+    sent_numbers(&numbers);
+    TEST_ASSERT_EQUAL_INT(3, numbers.count);
+    for (int n = 0; n < 3; n++) {
+        TEST_ASSERT_EQUAL_INT(n, numbers.values[n]);
+    }
+}
+
+TEST_CASE("mqtt_outbox drops the oldest messages when full", "[mqtt_outbox]") {
+    const int published = 20;
+    mqtt_outbox_stats_t after;
+    numbers_t numbers;
+
+    start_offline();
+    for (int n = 0; n < published; n++) {
+        publish_json(TOPIC_A, n, 1000);
+    }
+    mqtt_outbox_get_stats(&after);
+    uint32_t dropped = after.dropped - before.dropped;
+    TEST_ASSERT_TRUE(dropped > 0);
+    TEST_ASSERT_EQUAL_UINT32(published - dropped, after.buffered);
+
+    mqtt_outbox_set_connected(mqtt_mock_client());
+    drain();
+    sent_numbers(&numbers);
+    TEST_ASSERT_EQUAL_INT(published - dropped, numbers.count);
+    for (int i = 0; i < numbers.count; i++) {
+        TEST_ASSERT_EQUAL_INT(dropped + i, numbers.values[i]);
+    }
+}
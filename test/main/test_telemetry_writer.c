@@ -0,0 +1,98 @@
+#include <string.h>
+
+#include "telemetry_writer.h"
+#include "unity.h"
+
+// One document with every kind of item, written in either format
+static size_t write_sample(telemetry_format_t format, uint8_t *buf, size_t cap) {
+    telemetry_writer_t writer;
+
+    telemetry_writer_init_format(&writer, format, buf, cap);
+    telemetry_write_uint(&writer, "a", 1);
+    telemetry_write_int(&writer, "neg", -5);
+    telemetry_write_bool(&writer, "ok", true);
+    telemetry_write_string(&writer, "s", "q\"x");
+    telemetry_begin_object(&writer, "o");
+    telemetry_begin_array(&writer, "list");
+    telemetry_write_uint(&writer, "ignored", 1);
+    telemetry_write_uint(&writer, NULL, 2);
+    telemetry_end_array(&writer);
+    telemetry_end_object(&writer);
+    return telemetry_writer_finish(&writer);
+}
+
+TEST_CASE("telemetry_writer writes JSON", "[telemetry_writer]") {
+    static const char expected[] = "{\"a\":1,\"neg\":-5,\"ok\":true,\"s\":\"q\\\"x\","
+                                   "\"o\":{\"list\":[1,2]}}";
+    uint8_t buf[128];
+
+    size_t len = write_sample(TELEMETRY_FORMAT_JSON, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_size_t(strlen(expected), len);
+    TEST_ASSERT_EQUAL_MEMORY(expected, buf, len);
+}
+
+TEST_CASE("telemetry_writer writes CBOR", "[telemetry_writer]") {
+    static const uint8_t expected[] = {
+        0xBF,                                // Map, indefinite length
+        0x61, 'a', 0x01,                     // "a": 1
+        0x63, 'n', 'e', 'g', 0x24,           // "neg": -5
+        0x62, 'o', 'k', 0xF5,                // "ok": true
+        0x61, 's', 0x63, 'q', '"', 'x',      // "s": "q\"x"
+        0x61, 'o', 0xBF,                     // "o": {
+        0x64, 'l', 'i', 's', 't', 0x9F,      // "list": [
+        0x01, 0x02, 0xFF,                    // 1, 2]
+        0xFF,                                // }
+        0xFF,
+    };
+    uint8_t buf[128];
+
+    size_t len = write_sample(TELEMETRY_FORMAT_CBOR, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_size_t(sizeof(expected), len);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, buf, len);
+}
+
+TEST_CASE("telemetry_writer picks the shortest CBOR integer", "[telemetry_writer]") {
+    static const uint8_t expected[] = {
+        0xBF, 0x61, 'a', 0x17,                                         // 23
+        0x61, 'b', 0x18, 0x18,                                         // 24
+        0x61, 'c', 0x19, 0x01, 0x00,                                   // 256
+        0x61, 'd', 0x1A, 0x00, 0x01, 0x00, 0x00,                       // 65536
+        0x61, 'e', 0x1B, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,  // 2^32
+        0x61, 'f', 0x38, 0xFF,                                         // -256
+        0xFF,
+    };
+    telemetry_writer_t writer;
+    uint8_t buf[64];
+
+    telemetry_writer_init_format(&writer, TELEMETRY_FORMAT_CBOR, buf, sizeof(buf));
+    telemetry_write_uint(&writer, "a", 23);
+    telemetry_write_uint(&writer, "b", 24);
+    telemetry_write_uint(&writer, "c", 256);
+    telemetry_write_uint(&writer, "d", 65536);
+    telemetry_write_uint(&writer, "e", 1ULL << 32);
+    telemetry_write_int(&writer, "f", -256);
+    size_t len = telemetry_writer_finish(&writer);
+    TEST_ASSERT_EQUAL_size_t(sizeof(expected), len);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, buf, len);
+}
+
+TEST_CASE("telemetry_writer reports a full buffer", "[telemetry_writer]") {
+    uint8_t buf[128];
+
+    for (int format = TELEMETRY_FORMAT_JSON; format <= TELEMETRY_FORMAT_CBOR; format++) {
+        size_t len = write_sample(format, buf, sizeof(buf));
+        TEST_ASSERT_NOT_EQUAL(0, len);
+        // One byte short of the document, which must not be cut off silently
+        TEST_ASSERT_EQUAL_size_t(0, write_sample(format, buf, len - 1));
+        TEST_ASSERT_EQUAL_size_t(len, write_sample(format, buf, len));
+    }
+}
+
+TEST_CASE("telemetry_writer rejects unclosed levels", "[telemetry_writer]") {
+    telemetry_writer_t writer;
+    uint8_t buf[32];
+
+    telemetry_writer_init(&writer, buf, sizeof(buf));
+    telemetry_begin_object(&writer, "o");
+    TEST_ASSERT_EQUAL_size_t(0, telemetry_writer_finish(&writer));
+}